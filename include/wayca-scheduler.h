@@ -456,6 +456,12 @@ int wayca_managed_threadpool_create(int id, int num, pthread_t *thread[],
  * The maximum wayca scheduler threads user can created simultaneously
  * is default to 32765. It can be modified by passing the desired
  * upper limits to environment variable WAYCA_SC_THREADS_NUMBER.
+ *
+ * The identifiers of wayca scheduler threads, groups, threadpools,
+ * fibers, taskgroups and taskgraphs are opaque. The slot of a destroyed
+ * object may be reused by a new one, but the identifier will differ, so
+ * a stale identifier is rejected with -EINVAL rather than referring to
+ * the new object.
  */
 typedef unsigned long long	wayca_sc_thread_t;
 
@@ -542,6 +548,36 @@ int wayca_sc_pid_attach_thread(wayca_sc_thread_t *wthread, pid_t pid);
  */
 int wayca_sc_pid_detach_thread(wayca_sc_thread_t wthread);
 
+/**
+ * wayca_sc_thread_set_edge - declare how much two wayca scheduler threads
+ *                            talk to each other
+ * @wthread: one of the wayca scheduler threads
+ * @peer: the other wayca scheduler thread
+ * @weight: the weight of the edge between them, 0 to remove the edge
+ *
+ * The threads talking to each other, like a producer and its consumer,
+ * run faster sharing the caches. The edge is taken by the groups with
+ * WT_GF_AFFINE_GRAPH when the threads are placed, that is when they're
+ * attached to the group or the attribute of the group is set. The edge
+ * is dropped when either of the threads is destroyed.
+ *
+ * Return 0 on success, otherwise a negative error number.
+ */
+int wayca_sc_thread_set_edge(wayca_sc_thread_t wthread, wayca_sc_thread_t peer,
+			     unsigned int weight);
+
+/**
+ * wayca_sc_thread_get_edge - get the weight of the edge between two wayca
+ *                            scheduler threads
+ * @wthread: one of the wayca scheduler threads
+ * @peer: the other wayca scheduler thread
+ * @weight: the weight of the edge, 0 if there's none
+ *
+ * Return 0 on success, otherwise a negative error number.
+ */
+int wayca_sc_thread_get_edge(wayca_sc_thread_t wthread, wayca_sc_thread_t peer,
+			     unsigned int *weight);
+
 /*
  * The identifier of wayca scheduler group
  *
@@ -559,6 +595,12 @@ int wayca_sc_pid_detach_thread(wayca_sc_thread_t wthread);
  *  - the cpu range of the group is decided by its father group's
  *    attribute, or if it has no father it will cover all the
  *    cpus in the system
+ *  - the threads and groups are placed on the least loaded cpus of
+ *    the range, by the number of wayca threads bound to them. If
+ *    environment variable WAYCA_SC_UTIL_PERIOD is set to a period in
+ *    milliseconds, the cpu time taken by the other processes is
+ *    sampled from procfs once a period by a thread of the library and
+ *    counted too, so the cpus a co-tenant keeps busy are avoided.
  *
  * The maximum wayca scheduler groups user can created simultaneously
  * is default to 256. It can be modified by passing the desired
@@ -602,6 +644,16 @@ typedef unsigned long long	wayca_sc_group_t;
  * affinity:     0 - 3        0 - 3       0 - 3        0 - 3         4 - 7   WT_GF_CCL|WT_GF_COMPACT
  * affinity:       0            1           2            3             4     WT_GF_CCL|WT_GF_PERCPU|
  *                                                                           WT_GF_COMPACT
+ *
+ * With WT_GF_AFFINE_GRAPH, the member threads are partitioned by the edges
+ * declared by wayca_sc_thread_set_edge(), so the threads talking to each
+ * other the most are placed in the same cluster, or the same domain of
+ * the topology granularity if it's larger than a cluster. Each cpu takes
+ * one thread as WT_GF_COMPACT, and the threads having no edges spread
+ * over the clusters left. Say Thread 0 and 2 talk to each other, as well
+ * as Thread 1 and 3:
+ * affinity:       0            4           1            5                   WT_GF_CPU|WT_GF_PERCPU|
+ *                                                                           WT_GF_AFFINE_GRAPH
  */
 typedef unsigned long long	wayca_sc_group_attr_t;
 #define WT_GF_CPU	0x00000001	/* Each thread/group accepts per-CPU affinity */
@@ -611,6 +663,7 @@ typedef unsigned long long	wayca_sc_group_attr_t;
 #define WT_GF_ALL	0x00000400	/* Each thread/group doesn't have an affinity hint */
 #define WT_GF_PERCPU	0x00010000	/* Each thread will bind to the CPU */
 #define WT_GF_COMPACT	0x00100000	/* The threads in this group will be compact */
+#define WT_GF_AFFINE_GRAPH	0x00200000	/* The threads talking to each other will be together */
 
 /**
  * wayca_sc_group_set_attr - set the attribute of wayca scheduler group
@@ -738,6 +791,84 @@ int wayca_sc_group_attach_group(wayca_sc_group_t group, wayca_sc_group_t father)
  */
 int wayca_sc_group_detach_group(wayca_sc_group_t group, wayca_sc_group_t father);
 
+/**
+ * wayca_sc_group_rebalance_start - start rebalancing the groups in the
+ *                                  background
+ * @period_ms: the period of rebalancing in milliseconds
+ *
+ * The threads of a group are only arranged when they're attached or the
+ * attribute of the group is changed, so the groups may drift into
+ * imbalance as the threads come and go and the others share the CPUs.
+ * Start a thread which checks the groups each @period_ms and moves the
+ * member threads from the topology domain of the group where they wait
+ * the most for the CPUs, to the domain where they wait the least.
+ *
+ * The wait of each CPU is read from /proc/schedstat if the kernel has
+ * schedstats enabled, otherwise only the wait of the group's own threads
+ * is counted. A thread is moved only if the wait to save is more than
+ * the cost of moving it, and the imbalance lasts for some periods. At
+ * most one thread of a group is moved in a period, and the thread moved
+ * stays for some periods before it can be moved again. The groups with
+ * WT_GF_AFFINE_GRAPH are left alone.
+ *
+ * Return 0 on success, -EBUSY if already started, otherwise a negative
+ * error number.
+ */
+int wayca_sc_group_rebalance_start(unsigned int period_ms);
+
+/**
+ * wayca_sc_group_rebalance_stop - stop rebalancing the groups
+ *
+ * Stop the thread started by wayca_sc_group_rebalance_start() and wait
+ * for it to exit. The threads keep where they're when it stops.
+ *
+ * Return 0 on success, -EINVAL if it's not started.
+ */
+int wayca_sc_group_rebalance_stop(void);
+
+/**
+ * The flags of calibrating the migration cost
+ *
+ * By default the cost from the first CPU to one CPU of each topology
+ * level is measured, and taken for all the CPUs sharing that level.
+ */
+#define WT_MC_ALL_PAIRS	0x00000001	/* Measure each pair of the CPUs */
+
+/**
+ * wayca_sc_migration_cost_calibrate - measure the cost of moving a thread
+ *                                     between the CPUs
+ * @path: the file to save the cost to, NULL for the default one
+ * @flags: the flags of calibrating
+ *
+ * Measure how much slower a thread walking a working set as large as
+ * the L2 cache runs after moved from a CPU to another, and save the cost
+ * as a matrix of the CPUs to @path. The calling thread is moved among
+ * the CPUs meanwhile, and its CPU affinity is restored when it returns.
+ *
+ * If @path is NULL, the file is the one in the environment variable
+ * WAYCA_SC_MIGRATION_COST_FILE, or /var/cache/wayca-scheduler/migration_cost
+ * by default. The library loads it when started, and takes the one just
+ * measured once it's saved. Without it, the cost is estimated by the
+ * topology level the CPUs share.
+ *
+ * The wayca scheduler groups place their threads again for the least
+ * cost in total when their attribute is changed, and the rebalancer only
+ * moves a thread when it gains more than the cost.
+ *
+ * Return 0 on success, otherwise a negative error number.
+ */
+int wayca_sc_migration_cost_calibrate(const char *path, unsigned int flags);
+
+/**
+ * wayca_sc_migration_cost - get the cost of moving a thread between the CPUs
+ * @from: the CPU the thread is moved from
+ * @to: the CPU the thread is moved to
+ * @cost: the cost in nanoseconds
+ *
+ * Return 0 on success, -EINVAL if the CPUs are invalid or offline.
+ */
+int wayca_sc_migration_cost(int from, int to, unsigned long long *cost);
+
 /**
  * wayca_sc_is_thread_in_group - whether the wayca scheduler thread is in
  *                               the wayca scheduler group
@@ -796,6 +927,53 @@ typedef void (*wayca_sc_threadpool_task_func)(void *);
 ssize_t wayca_sc_threadpool_create(wayca_sc_threadpool_t *threadpool,
 				   pthread_attr_t *attr, size_t num);
 
+/**
+ * wayca_sc_threadpool_create_elastic - create a wayca scheduler threadpool
+ *                                      sized by the load
+ * @threadpool: the identifier of the wayca scheduler threadpool created
+ * @attr: the pthread attribute of threads in the pool
+ * @min: the fewest working threads in the pool
+ * @max: the most working threads in the pool
+ *
+ * Create a wayca scheduler threadpool like wayca_sc_threadpool_create()
+ * with @min working threads. When the queued tasks have waited with no
+ * idle working thread for a millisecond, a new thread is spawned until
+ * there're @max of them. A working thread idle for a second exits if
+ * there're more than @min. The new threads are attached to the group
+ * of the pool as well, so they are placed by the topology like the
+ * others. Only the stack size of @attr is applied to the threads
+ * spawned on demand.
+ *
+ * Return how many threads successfully created in the pool, or a negative
+ * error number on failure.
+ */
+ssize_t wayca_sc_threadpool_create_elastic(wayca_sc_threadpool_t *threadpool,
+					   pthread_attr_t *attr,
+					   size_t min, size_t max);
+
+/**
+ * wayca_sc_threadpool_create_numa - create a wayca scheduler threadpool
+ *                                   with a sub-pool per NUMA node
+ * @threadpool: the identifier of the wayca scheduler threadpool created
+ * @attr: the pthread attribute of threads in the pool
+ * @num: the number of working threads on each NUMA node
+ *
+ * Create a wayca scheduler threadpool like wayca_sc_threadpool_create()
+ * with @num working threads on each NUMA node. The attribute of the
+ * group is WT_GF_NUMA, so each thread is bound to the CPUs of a node.
+ * Each node has its own queue and lock, and the tasks queued by the
+ * threads out of the pool go to the queue of the node the caller is
+ * running on. A working thread only takes the tasks queued on another
+ * node when it has nothing to do and that node has more tasks waiting
+ * than working threads, so the tasks and the queue stay in the node
+ * unless it's overloaded.
+ *
+ * Return how many threads successfully created in the pool, or a negative
+ * error number on failure.
+ */
+ssize_t wayca_sc_threadpool_create_numa(wayca_sc_threadpool_t *threadpool,
+					pthread_attr_t *attr, size_t num);
+
 /**
  * wayca_sc_threadpool_destroy - destroy a wayca scheduler threadpool
  * @threadpool: the identifier of the wayca scheduler threadpool to destroy
@@ -805,7 +983,8 @@ ssize_t wayca_sc_threadpool_create(wayca_sc_threadpool_t *threadpool,
  * executed to be finished. And any tasks waiting in the queue will be
  * discarded.
  *
- * Return 0 on success, or a negative error number.
+ * Return 0 on success, -EBUSY if there're taskgroups of the threadpool
+ * not destroyed or fibers not finished, or other negative error number.
  */
 int wayca_sc_threadpool_destroy(wayca_sc_threadpool_t threadpool);
 
@@ -823,6 +1002,154 @@ int wayca_sc_threadpool_destroy(wayca_sc_threadpool_t threadpool);
 int wayca_sc_threadpool_get_group(wayca_sc_threadpool_t threadpool,
 				  wayca_sc_group_t *group);
 
+/**
+ * wayca_sc_threadpool_set_weight - set the share of the threadpool in the
+ *                                  CPU budget of the process
+ * @threadpool: the identifier of the wayca scheduler threadpool
+ * @weight: the weight of the threadpool, 0 to leave the budget
+ *
+ * The CPUs of the process are partitioned among the threadpools with a
+ * weight, each gets a contiguous range of the CPUs in proportion to its
+ * weight and at least one CPU, and its working threads are placed in
+ * the range only. The ranges are rearranged whenever a threadpool joins
+ * or leaves the budget or changes its weight, so the pools don't pile
+ * onto the same CPUs. A threadpool without a weight is placed on all
+ * the CPUs as usual.
+ *
+ * The threadpools created by wayca_sc_threadpool_create() and
+ * wayca_sc_threadpool_create_elastic() join the budget with the weight
+ * set by environment variable WAYCA_SC_THREADPOOL_WEIGHT if it's set.
+ * Only the threadpools placing the threads per CPU can join the budget.
+ *
+ * Return 0 on success, -EINVAL if @threadpool is invalid or not placed
+ * per CPU, or other negative error number.
+ */
+int wayca_sc_threadpool_set_weight(wayca_sc_threadpool_t threadpool,
+				   unsigned int weight);
+
+/**
+ * wayca_sc_threadpool_budget_rebalance - lend the CPUs of the idle
+ *                                        threadpools to the busy ones
+ *
+ * Rearrange the CPU budget of the process as the weights tell, and then
+ * lend the CPUs of the threadpools in the budget whose working threads
+ * are all idle to the others in the budget, in proportion to their
+ * weights. A lending threadpool keeps its own CPUs as well, and takes
+ * back the lent ones once a task is queued to it, while the CPUs lent
+ * by the others still idle stay lent.
+ *
+ * The idle threadpools only lend their CPUs when this is called, it's
+ * expected to be called periodically by the application.
+ *
+ * Return 0 on success, or a negative error number.
+ */
+int wayca_sc_threadpool_budget_rebalance(void);
+
+/**
+ * The attribute of wayca scheduler threadpool
+ *
+ * WT_PF_STEAL_TOPO: the idle working threads steal tasks from the
+ *                   others following the topology of where they're
+ *                   placed. Try the ones in the same cluster first,
+ *                   then the same NUMA node, the same package and
+ *                   the remote ones at last. Otherwise the victim
+ *                   is picked randomly.
+ * WT_PF_IDLE_SPIN: the idle working threads spin for a short while
+ *                  before parking, so the tasks queued in the meantime
+ *                  are picked up without the latency of a wakeup.
+ *                  Suitable for the latency sensitive pools, at the
+ *                  cost of the CPU time burnt by spinning. Otherwise
+ *                  the idle working threads park at once.
+ * WT_PF_BOUNDED: the shared queue of the threadpool holds at most
+ *                WAYCA_SC_THREADPOOL_RING_SIZE tasks, and queueing
+ *                more fails with -EAGAIN to push back the producers.
+ *                The tasks in the default priority are kept in a
+ *                lock-free ring, so the threads out of the pool
+ *                queue them without any lock or allocation.
+ *                Otherwise the shared queue is unbounded.
+ */
+typedef unsigned long long	wayca_sc_threadpool_attr_t;
+#define WT_PF_STEAL_TOPO	0x00000001
+#define WT_PF_IDLE_SPIN		0x00000002
+#define WT_PF_BOUNDED		0x00000004
+
+/* The capacity of the shared queue of a WT_PF_BOUNDED threadpool */
+#define WAYCA_SC_THREADPOOL_RING_SIZE	4096
+
+/**
+ * wayca_sc_threadpool_set_attr - set the attribute of wayca scheduler threadpool
+ * @threadpool: the identifier of the wayca scheduler threadpool
+ * @attr: the attribute to be set
+ *
+ * The topology of each working thread is recorded when the threadpool
+ * is created. Changing the attribute of the group in the threadpool
+ * won't update it.
+ *
+ * Return 0 on success, or a negative error number.
+ */
+int wayca_sc_threadpool_set_attr(wayca_sc_threadpool_t threadpool,
+				 wayca_sc_threadpool_attr_t *attr);
+
+/**
+ * wayca_sc_threadpool_get_attr - get the attribute of wayca scheduler threadpool
+ * @threadpool: the identifier of the wayca scheduler threadpool
+ * @attr: the attribute of the threadpool
+ *
+ * Return 0 on success, or a negative error number.
+ */
+int wayca_sc_threadpool_get_attr(wayca_sc_threadpool_t threadpool,
+				 wayca_sc_threadpool_attr_t *attr);
+
+/* The number of tasks stolen by the working threads at each topology level */
+struct wayca_sc_threadpool_steals {
+	unsigned long long ccl;		/* from the thread in the same cluster */
+	unsigned long long node;	/* from the thread in the same NUMA node */
+	unsigned long long package;	/* from the thread in the same package */
+	unsigned long long remote;	/* from the thread in other packages */
+};
+
+/**
+ * wayca_sc_threadpool_get_steals - get the number of tasks stolen in the pool
+ * @threadpool: the identifier of the wayca scheduler threadpool
+ * @steals: the number of steals at each topology level
+ *
+ * Return 0 on success, or a negative error number.
+ */
+int wayca_sc_threadpool_get_steals(wayca_sc_threadpool_t threadpool,
+				   struct wayca_sc_threadpool_steals *steals);
+
+/*
+ * The statistics of the tasks run in the pool since it's created. The
+ * percentiles are estimated from log2 histograms, so they're accurate
+ * to the power of 2 range they fall in. All the times are in ns.
+ */
+struct wayca_sc_threadpool_stats {
+	unsigned long long executed;	/* the tasks finished */
+	unsigned long long steals;	/* the tasks stolen from other threads */
+	unsigned long long parks;	/* the times idle threads went to sleep */
+	unsigned long long wait_avg;	/* the time from queued to started */
+	unsigned long long wait_p50;
+	unsigned long long wait_p99;
+	unsigned long long wait_p999;
+	unsigned long long run_avg;	/* the time from started to finished */
+	unsigned long long run_p50;
+	unsigned long long run_p99;
+	unsigned long long run_p999;
+};
+
+/**
+ * wayca_sc_threadpool_get_stats - get the statistics of the threadpool
+ * @threadpool: the identifier of the wayca scheduler threadpool
+ * @stats: the statistics of the threadpool
+ *
+ * The counters are summed up from the working threads without any lock,
+ * so the snapshot may miss the tasks finishing meanwhile.
+ *
+ * Return 0 on success, or a negative error number.
+ */
+int wayca_sc_threadpool_get_stats(wayca_sc_threadpool_t threadpool,
+				  struct wayca_sc_threadpool_stats *stats);
+
 /**
  * wayca_sc_threadpool_queue - queue a task into the wayca scheduler threadpool
  * @threadpool: the identifier of the wayca scheduler threadpool
@@ -831,14 +1158,438 @@ int wayca_sc_threadpool_get_group(wayca_sc_threadpool_t threadpool,
  *
  * Queue a task into the threadpool to execute. If there's idle working
  * thread(s) in the pool, the task will be executed immediatedly.
- * Otherwise it will be queued into an internal FIFO waiting for
- * execution.
+ * Otherwise it will be queued waiting for execution.
  *
- * Return 0 on success, or a negative error number.
+ * Each working thread owns a task deque. The tasks queued from the
+ * working threads of the pool are pushed to their own deques without
+ * locking and executed in LIFO order by the owner, while idle working
+ * threads steal the oldest tasks from others. The tasks queued from
+ * outside the pool are put into a shared FIFO.
+ *
+ * Return 0 on success, -EAGAIN if the shared queue of a WT_PF_BOUNDED
+ * threadpool is full, or other negative error number.
  */
 int wayca_sc_threadpool_queue(wayca_sc_threadpool_t threadpool,
 			      wayca_sc_threadpool_task_func task_func, void *arg);
 
+/* The priority levels of the tasks, the smaller the higher */
+#define WAYCA_SC_THREADPOOL_PRIO_LEVELS		8
+#define WAYCA_SC_THREADPOOL_PRIO_HIGHEST	0
+#define WAYCA_SC_THREADPOOL_PRIO_DEFAULT	4
+#define WAYCA_SC_THREADPOOL_PRIO_LOWEST		(WAYCA_SC_THREADPOOL_PRIO_LEVELS - 1)
+
+/**
+ * wayca_sc_threadpool_queue_prio - queue a task with the priority into the
+ *                                  wayca scheduler threadpool
+ * @threadpool: the identifier of the wayca scheduler threadpool
+ * @prio: the priority of the task, from WAYCA_SC_THREADPOOL_PRIO_HIGHEST
+ *        to WAYCA_SC_THREADPOOL_PRIO_LOWEST
+ * @task_func: the function to be executed
+ * @arg: the argument of @task_func
+ *
+ * Queue a task like wayca_sc_threadpool_queue(), which queues the task
+ * with WAYCA_SC_THREADPOOL_PRIO_DEFAULT.
+ *
+ * The tasks not in the default priority are always put into the shared
+ * queue, where the tasks of the higher priority are executed first.
+ * The ones higher than the default are also executed before the tasks
+ * queued by the working threads to their own deques. To avoid the
+ * starvation, a task in the lower priority will be executed once it
+ * has waited for a number of tasks proportional to the difference
+ * of the priorities.
+ *
+ * Return 0 on success, or a negative error number.
+ */
+int wayca_sc_threadpool_queue_prio(wayca_sc_threadpool_t threadpool, int prio,
+				   wayca_sc_threadpool_task_func task_func,
+				   void *arg);
+
+/**
+ * wayca_sc_threadpool_queue_on - queue a task to run in a topology domain
+ * @threadpool: the identifier of the wayca scheduler threadpool
+ * @topo: the kind of the topology domain, one of WT_GF_CPU, WT_GF_CCL,
+ *        WT_GF_NUMA and WT_GF_PACKAGE
+ * @id: the id of the CPU, cluster, NUMA node or package
+ * @task_func: the function to be executed
+ * @arg: the argument of @task_func
+ *
+ * Queue a task to the working thread placed in the domain, which
+ * owns the data touched by the task, with the fewest tasks queued in
+ * this way. If it's busy, the idle working threads in the same domain
+ * may take the task. The task never runs out of the domain.
+ *
+ * Return 0 on success, -ENOENT if no working thread of @threadpool is
+ * placed in the domain, or other negative error number.
+ */
+int wayca_sc_threadpool_queue_on(wayca_sc_threadpool_t threadpool,
+				 wayca_sc_group_attr_t topo, int id,
+				 wayca_sc_threadpool_task_func task_func,
+				 void *arg);
+
+/**
+ * wayca_sc_threadpool_queue_batch - queue a batch of tasks into the wayca
+ *                                   scheduler threadpool
+ * @threadpool: the identifier of the wayca scheduler threadpool
+ * @task_funcs: the array of @num functions to be executed
+ * @args: the array of @num arguments of each function in @task_funcs,
+ *        or NULL to pass NULL to all the functions
+ * @num: the number of tasks in the batch
+ *
+ * Queue @num tasks into the threadpool at once. Comparing to queueing
+ * the tasks one by one, the batch is linked into the queue with one
+ * lock acquisition, or one deque publish when called from the working
+ * threads of the pool, and the idle working thread(s) are woken up
+ * once.
+ *
+ * Either all or none of the tasks will be queued.
+ *
+ * Return 0 on success, -EAGAIN if the shared queue of a WT_PF_BOUNDED
+ * threadpool has no room for the tasks, or other negative error number.
+ */
+int wayca_sc_threadpool_queue_batch(wayca_sc_threadpool_t threadpool,
+				    wayca_sc_threadpool_task_func *task_funcs,
+				    void **args, size_t num);
+
+/* The identifier of a timer of a wayca scheduler threadpool */
+typedef unsigned long long	wayca_sc_timer_t;
+
+/**
+ * wayca_sc_threadpool_queue_after - queue a task into the wayca scheduler
+ *                                   threadpool after a delay
+ * @threadpool: the identifier of the wayca scheduler threadpool
+ * @ns: the delay in nanoseconds
+ * @task_func: the function to be executed
+ * @arg: the argument of @task_func
+ *
+ * Queue a task into the threadpool like wayca_sc_threadpool_queue()
+ * after at least @ns nanoseconds. The timers of a threadpool are kept
+ * in a hierarchical timing wheel in the resolution of a millisecond,
+ * driven by one thread sleeping on a timerfd, which is started when
+ * the first timer of the pool is added. The due tasks are queued to
+ * the normal queues of the pool and run by the working threads.
+ *
+ * The timers still pending are discarded when the threadpool is
+ * destroyed.
+ *
+ * Return 0 on success, or a negative error number on failure.
+ */
+int wayca_sc_threadpool_queue_after(wayca_sc_threadpool_t threadpool,
+				    unsigned long long ns,
+				    wayca_sc_threadpool_task_func task_func,
+				    void *arg);
+
+/**
+ * wayca_sc_threadpool_queue_periodic - queue a task into the wayca
+ *                                      scheduler threadpool periodically
+ * @threadpool: the identifier of the wayca scheduler threadpool
+ * @ns: the delay in nanoseconds before the first run
+ * @period: the period in nanoseconds of the following runs
+ * @task_func: the function to be executed
+ * @arg: the argument of @task_func
+ * @timer: the identifier of the timer created, or NULL if not needed
+ *
+ * Like wayca_sc_threadpool_queue_after(), but the task is queued again
+ * every @period nanoseconds after the first time until the timer is
+ * cancelled. The period is counted from the time the task is due, so
+ * the runs don't drift, and the runs missed while the timer thread is
+ * delayed are skipped.
+ *
+ * Return 0 on success, or a negative error number on failure.
+ */
+int wayca_sc_threadpool_queue_periodic(wayca_sc_threadpool_t threadpool,
+				       unsigned long long ns,
+				       unsigned long long period,
+				       wayca_sc_threadpool_task_func task_func,
+				       void *arg, wayca_sc_timer_t *timer);
+
+/**
+ * wayca_sc_threadpool_cancel_timer - cancel a periodic timer of the wayca
+ *                                    scheduler threadpool
+ * @threadpool: the identifier of the wayca scheduler threadpool
+ * @timer: the identifier of the timer to cancel
+ *
+ * Stop queueing the task of the @timer created by
+ * wayca_sc_threadpool_queue_periodic(). The task already queued may
+ * still run after this returns.
+ *
+ * Return 0 on success, -ENOENT if the timer doesn't exist, or -EINVAL
+ * if @threadpool is invalid.
+ */
+int wayca_sc_threadpool_cancel_timer(wayca_sc_threadpool_t threadpool,
+				     wayca_sc_timer_t timer);
+
+/* The identifier of a wayca scheduler fiber */
+typedef unsigned long long	wayca_sc_fiber_t;
+
+/* The size of the stack of each fiber, a guard page below not counted */
+#define WAYCA_SC_FIBER_STACK_SIZE	(64 * 1024)
+
+/**
+ * wayca_sc_threadpool_queue_fiber - queue a task running as a fiber into
+ *                                   the wayca scheduler threadpool
+ * @threadpool: the identifier of the wayca scheduler threadpool
+ * @task_func: the function to be executed
+ * @arg: the argument of @task_func
+ * @fiber: the identifier of the fiber created, or NULL if not needed
+ *
+ * Queue a task into the threadpool which runs on a stack of its own,
+ * so that it can give up the working thread in the middle by
+ * wayca_sc_fiber_yield() or wayca_sc_fiber_park() and let it run other
+ * tasks, rather than blocking it. Once a working thread of the pool has
+ * run the fiber, the fiber is always resumed by the working threads on
+ * the same CPU, so it keeps the placement of the pool. The stacks are
+ * cached by the working threads and allocated on their NUMA nodes.
+ *
+ * The identifier of the fiber is released when @task_func returns. The
+ * maximum fibers can be set by environment variable
+ * WAYCA_SC_FIBERS_NUMBER, or 4096 by default.
+ *
+ * Return 0 on success, or a negative error number on failure.
+ */
+int wayca_sc_threadpool_queue_fiber(wayca_sc_threadpool_t threadpool,
+				    wayca_sc_threadpool_task_func task_func,
+				    void *arg, wayca_sc_fiber_t *fiber);
+
+/**
+ * wayca_sc_fiber_self - get the identifier of the current fiber
+ * @fiber: where to store the identifier
+ *
+ * Return 0 on success, -EINVAL if @fiber is NULL, or -EPERM if not
+ * called in a fiber.
+ */
+int wayca_sc_fiber_self(wayca_sc_fiber_t *fiber);
+
+/**
+ * wayca_sc_fiber_yield - give up the working thread for a while
+ *
+ * Let the working thread run other tasks. The current fiber is queued
+ * again at once and continues when a working thread picks it up.
+ *
+ * Return 0 on success, or -EPERM if not called in a fiber.
+ */
+int wayca_sc_fiber_yield(void);
+
+/**
+ * wayca_sc_fiber_park - suspend the current fiber until it's woken
+ *
+ * Give up the working thread until someone calls wayca_sc_fiber_wake()
+ * on the current fiber. Return at once if the fiber has been woken since
+ * it's parked last time.
+ *
+ * Return 0 on success, or -EPERM if not called in a fiber.
+ */
+int wayca_sc_fiber_park(void);
+
+/**
+ * wayca_sc_fiber_wake - wake up a parked fiber
+ * @fiber: the identifier of the fiber
+ *
+ * Queue the @fiber again if it's parked, otherwise make its next
+ * wayca_sc_fiber_park() return at once. Can be called from any thread.
+ *
+ * Return 0 on success, -EINVAL if @fiber doesn't exist, or other
+ * negative error number on failure.
+ */
+int wayca_sc_fiber_wake(wayca_sc_fiber_t fiber);
+
+/* The identifier of a wayca scheduler taskgroup */
+typedef unsigned long long	wayca_sc_taskgroup_t;
+
+/**
+ * wayca_sc_taskgroup_create - create a taskgroup on the wayca scheduler
+ *                             threadpool
+ * @taskgroup: the identifier of the created taskgroup
+ * @threadpool: the identifier of the wayca scheduler threadpool
+ *
+ * A taskgroup collects the tasks queued to @threadpool through
+ * wayca_sc_taskgroup_queue(), and can be waited for the finish of
+ * all its tasks by wayca_sc_threadpool_wait(). The taskgroup can be
+ * reused after the wait. All the taskgroups of a threadpool should
+ * be destroyed before the threadpool.
+ *
+ * Return 0 on success, or a negative error number.
+ */
+int wayca_sc_taskgroup_create(wayca_sc_taskgroup_t *taskgroup,
+			      wayca_sc_threadpool_t threadpool);
+
+/**
+ * wayca_sc_taskgroup_destroy - destroy a taskgroup
+ * @taskgroup: the identifier of the taskgroup
+ *
+ * Return 0 on success, -EBUSY if there're still tasks of @taskgroup
+ * unfinished, or other negative error number.
+ */
+int wayca_sc_taskgroup_destroy(wayca_sc_taskgroup_t taskgroup);
+
+/**
+ * wayca_sc_taskgroup_eventfd - get the eventfd notifying the completion
+ *                              of the tasks of a taskgroup
+ * @taskgroup: the identifier of the taskgroup
+ *
+ * Create an eventfd for @taskgroup at the first call, and return the
+ * same one later. The counter of the eventfd is increased by one each
+ * time a task of @taskgroup finishes after the eventfd is created, so
+ * an event loop can poll it with the other fds and read the number of
+ * tasks finished, rather than polling the results or sleeping in
+ * wayca_sc_threadpool_wait(). The eventfd is non-blocking and owned by
+ * @taskgroup, it's closed when @taskgroup is destroyed.
+ *
+ * Each task of the group costs a write to the eventfd once it's
+ * created, and the tasks finish under the lock of the group in turn.
+ *
+ * Return the eventfd on success, or a negative error number.
+ */
+int wayca_sc_taskgroup_eventfd(wayca_sc_taskgroup_t taskgroup);
+
+/**
+ * wayca_sc_taskgroup_queue - queue a task of the taskgroup
+ * @taskgroup: the identifier of the taskgroup
+ * @task_func: the function to be executed
+ * @arg: the argument of @task_func
+ *
+ * Queue a task into the threadpool of @taskgroup like
+ * wayca_sc_threadpool_queue(), and account it to @taskgroup.
+ *
+ * Return 0 on success, or a negative error number.
+ */
+int wayca_sc_taskgroup_queue(wayca_sc_taskgroup_t taskgroup,
+			     wayca_sc_threadpool_task_func task_func, void *arg);
+
+/**
+ * wayca_sc_threadpool_wait - wait for all the tasks of a taskgroup finished
+ * @taskgroup: the identifier of the taskgroup
+ *
+ * Rather than sleeping, the caller helps to execute the tasks waiting
+ * in the threadpool, no matter which taskgroup they belong to, until
+ * all the tasks of @taskgroup finished. It only sleeps when there is
+ * nothing left to execute while some tasks of @taskgroup are still
+ * running on the other threads.
+ *
+ * It can be called from the tasks running in the threadpool to wait
+ * for the tasks they queued, without holding the working thread idle.
+ *
+ * Return 0 on success, or a negative error number.
+ */
+int wayca_sc_threadpool_wait(wayca_sc_taskgroup_t taskgroup);
+
+/* The function to process the indexes [@begin, @end) of a parallel_for */
+typedef void (*wayca_sc_parallel_for_func)(size_t begin, size_t end, void *ctx);
+
+/**
+ * wayca_sc_parallel_for - process an index range in parallel on the
+ *                         wayca scheduler threadpool
+ * @threadpool: the identifier of the wayca scheduler threadpool
+ * @begin: the first index of the range
+ * @end: the index after the last one of the range
+ * @grain: the number of indexes processed by each call of @func,
+ *         0 to let the threadpool decide
+ * @func: the function to process a part of the range
+ * @ctx: the argument passed to @func
+ *
+ * Split [@begin, @end) into one contiguous block per working thread,
+ * assigned in the order of the topology the working threads placed on,
+ * so that adjacent blocks are processed by the threads sharing the
+ * cluster or the NUMA node. The same range on the same threadpool
+ * is always split and assigned in the same way, so the data first
+ * touched by a working thread will be processed on its node again.
+ *
+ * Each working thread processes its block @grain indexes at a time,
+ * then helps the unfinished blocks of the others, the nearest first.
+ * The caller out of the threadpool helps all the blocks as well.
+ *
+ * Return 0 after the whole range processed, or a negative error number.
+ */
+int wayca_sc_parallel_for(wayca_sc_threadpool_t threadpool,
+			  size_t begin, size_t end, size_t grain,
+			  wayca_sc_parallel_for_func func, void *ctx);
+
+/*
+ * The identifier of a wayca scheduler taskgraph.
+ *
+ * The maximum taskgraphs user can created simultaneously is default
+ * to 1024. It can be modified by passing the desired upper limits to
+ * environment variable WAYCA_SC_TASKGRAPHS_NUMBER.
+ */
+typedef unsigned long long	wayca_sc_taskgraph_t;
+
+/**
+ * wayca_sc_taskgraph_create - create a taskgraph on the wayca scheduler
+ *                             threadpool
+ * @taskgraph: the identifier of the created taskgraph
+ * @threadpool: the identifier of the wayca scheduler threadpool
+ *
+ * A taskgraph is a set of tasks with the dependencies between them,
+ * executed on @threadpool by wayca_sc_taskgraph_run(). A task is queued
+ * once all the tasks it depends on finished. All the taskgraphs of a
+ * threadpool should be destroyed before the threadpool.
+ *
+ * Return 0 on success, or a negative error number.
+ */
+int wayca_sc_taskgraph_create(wayca_sc_taskgraph_t *taskgraph,
+			      wayca_sc_threadpool_t threadpool);
+
+/**
+ * wayca_sc_taskgraph_destroy - destroy a taskgraph
+ * @taskgraph: the identifier of the taskgraph
+ *
+ * Return 0 on success, -EBUSY if @taskgraph is still running, or other
+ * negative error number.
+ */
+int wayca_sc_taskgraph_destroy(wayca_sc_taskgraph_t taskgraph);
+
+/**
+ * wayca_sc_taskgraph_add_task - add a task to the taskgraph
+ * @taskgraph: the identifier of the taskgraph
+ * @task_func: the function to be executed
+ * @arg: the argument of @task_func
+ *
+ * Return the index of the task in @taskgraph used by
+ * wayca_sc_taskgraph_add_edge(), -EBUSY if @taskgraph is running, or
+ * other negative error number.
+ */
+ssize_t wayca_sc_taskgraph_add_task(wayca_sc_taskgraph_t taskgraph,
+				    wayca_sc_threadpool_task_func task_func,
+				    void *arg);
+
+/**
+ * wayca_sc_taskgraph_add_edge - make a task depend on another one
+ * @taskgraph: the identifier of the taskgraph
+ * @from: the index of the task to finish first
+ * @to: the index of the task to run after @from finished
+ *
+ * Return 0 on success, -EBUSY if @taskgraph is running, or other
+ * negative error number.
+ */
+int wayca_sc_taskgraph_add_edge(wayca_sc_taskgraph_t taskgraph,
+				size_t from, size_t to);
+
+/**
+ * wayca_sc_taskgraph_run - start executing the taskgraph
+ * @taskgraph: the identifier of the taskgraph
+ *
+ * Queue the tasks depending on nothing to the threadpool of @taskgraph.
+ * When a task finishes, the tasks depending on it are queued once all
+ * their dependencies finished. The first of them runs next on the same
+ * working thread, so a chain of tasks keeps its data in the cache, and
+ * the others are queued to the same thread to be stolen by the nearest
+ * idle ones. A taskgraph can be run again after it finished.
+ *
+ * Return 0 on success, -EBUSY if @taskgraph is still running, -EINVAL
+ * if the dependencies make a cycle, or other negative error number.
+ */
+int wayca_sc_taskgraph_run(wayca_sc_taskgraph_t taskgraph);
+
+/**
+ * wayca_sc_taskgraph_wait - wait for all the tasks of a taskgraph finished
+ * @taskgraph: the identifier of the taskgraph
+ *
+ * Help to execute the tasks like wayca_sc_threadpool_wait() until the
+ * last task of @taskgraph finished.
+ *
+ * Return 0 on success, or a negative error number.
+ */
+int wayca_sc_taskgraph_wait(wayca_sc_taskgraph_t taskgraph);
+
 /**
  * wayca_sc_threadpool_thread_num - get the work thread(s) number in the pool
  * @threadpool: the identifier of the wayca scheduler threadpool
@@ -71,6 +71,22 @@ extern char *wayca_scheduler_socket_path;
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
+/*
+ * Keep the data written by different CPUs in different cache lines
+ * to avoid false sharing.
+ */
+#define WAYCA_SC_CACHELINE_SIZE	64
+#define __cacheline_aligned	__attribute__((__aligned__(WAYCA_SC_CACHELINE_SIZE)))
+
+/* Hint the CPU that we're busy waiting */
+#if defined(__aarch64__)
+#define cpu_relax()	__asm__ __volatile__("yield" ::: "memory")
+#elif defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()	__asm__ __volatile__("pause" ::: "memory")
+#else
+#define cpu_relax()	__asm__ __volatile__("" ::: "memory")
+#endif
+
 #define WAYCA_SC_PRIO_TOPO 101
 #define WAYCA_SC_PRIO_THREAD 120
 #define WAYCA_SC_PRIO_MANAGED_THREAD 110
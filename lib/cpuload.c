@@ -0,0 +1,415 @@
+/*
+ * Copyright (c) 2021 HiSilicon Technologies Co., Ltd.
+ * Wayca scheduler is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+/* cpuload.c - Sample the CPU time not spent by us from procfs
+ *
+ * The loads of the CPUs accounted by the placement only count the wayca
+ * threads bound to them. Sample the busy time of each CPU from /proc/stat
+ * and take out the time our own tasks run on it, which is read from the
+ * schedstat of each task, so what left is taken by the others sharing
+ * the host. It's smoothed and kept in the loads of the CPU domains, in
+ * the same unit as the loads of the wayca threads.
+ *
+ * The sampling scans procfs, so it's done once a period by a thread of
+ * its own rather than by the placement under the locks of the groups.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "wayca_thread.h"
+
+/* The fractional bits of the utilization kept smoothed */
+#define WAYCA_UTIL_SHIFT	10
+
+/* The CPU time of a task in ns, and the CPU it last ran on */
+struct wayca_task_time {
+	pid_t tid;
+	int cpu;
+	unsigned long long runtime;
+};
+
+static struct {
+	/* The sampling period in ns, 0 for not sampling */
+	long long period;
+	/* The sampler waits for the period or to be stopped on the cond */
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool running;
+	bool stop;
+	long long ns_per_tick;
+	int nr_cpus;
+	/* The busy and total time of each CPU in ticks, last sampled */
+	unsigned long long *busy;
+	unsigned long long *total;
+	/* The time our tasks ran on each CPU in ns since the last sample */
+	unsigned long long *own;
+	/* The utilization of each CPU smoothed, in WAYCA_UTIL_SHIFT fixed point */
+	long long *util;
+	/* Has the utilization been sampled, or it starts with the sample */
+	bool *sampled;
+	/* The tasks last sampled, sorted by tid */
+	struct wayca_task_time *tasks;
+	size_t nr_tasks;
+} wayca_util;
+
+static int wayca_task_time_cmp(const void *a, const void *b)
+{
+	const struct wayca_task_time *x = a, *y = b;
+
+	return (x->tid > y->tid) - (x->tid < y->tid);
+}
+
+static int wayca_read_task_time(pid_t tid, struct wayca_task_time *task)
+{
+	char path[64], buf[1024], *p;
+	FILE *fp;
+	int i;
+
+	task->tid = tid;
+
+	snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat", tid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+	i = fscanf(fp, "%llu", &task->runtime);
+	fclose(fp);
+	if (i != 1)
+		return -EINVAL;
+
+	snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+	p = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+
+	/* The command may have spaces, the fields we need follow the last ')' */
+	if (!p || !(p = strrchr(buf, ')')))
+		return -EINVAL;
+
+	/* The processor is field 39, 37 fields after the command */
+	for (i = 0; i < 37 && p; i++)
+		p = strchr(p + 1, ' ');
+	if (!p || sscanf(p, "%d", &task->cpu) != 1)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* Account the CPU time of our tasks since the last sample to their CPUs */
+static void wayca_sample_tasks(void)
+{
+	struct wayca_task_time *tasks = NULL, *prev, *tmp;
+	size_t num = 0, size = 0;
+	struct dirent *entry;
+	DIR *dir;
+
+	memset(wayca_util.own, 0, wayca_util.nr_cpus * sizeof(*wayca_util.own));
+
+	dir = opendir("/proc/self/task");
+	if (!dir)
+		return;
+
+	while ((entry = readdir(dir)) != NULL) {
+		pid_t tid = atoi(entry->d_name);
+
+		if (tid <= 0)
+			continue;
+
+		if (num == size) {
+			size = size ? size * 2 : 64;
+			tmp = realloc(tasks, size * sizeof(*tasks));
+			if (!tmp)
+				break;
+			tasks = tmp;
+		}
+
+		if (!wayca_read_task_time(tid, &tasks[num]))
+			num++;
+	}
+	closedir(dir);
+
+	qsort(tasks, num, sizeof(*tasks), wayca_task_time_cmp);
+
+	/* The tasks new since the last sample are taken next time */
+	for (size_t i = 0; i < num; i++) {
+		prev = bsearch(&tasks[i], wayca_util.tasks, wayca_util.nr_tasks,
+			       sizeof(*tasks), wayca_task_time_cmp);
+		if (!prev || tasks[i].cpu < 0 || tasks[i].cpu >= wayca_util.nr_cpus ||
+		    tasks[i].runtime < prev->runtime)
+			continue;
+
+		wayca_util.own[tasks[i].cpu] += tasks[i].runtime - prev->runtime;
+	}
+
+	free(wayca_util.tasks);
+	wayca_util.tasks = tasks;
+	wayca_util.nr_tasks = num;
+}
+
+/* Store the smoothed utilization to the loads of the CPUs and the domains above */
+static void wayca_util_store(void)
+{
+	for (int level = 0; level < WAYCA_DOMAIN_LEVELS; level++) {
+		struct wayca_domain_table *table = &wayca_domains[level];
+
+		if (!table->loads)
+			continue;
+
+		for (int i = 0; i < table->nr; i++) {
+			struct wayca_domain *domain = &table->domains[i];
+			long long util = 0;
+
+			for (int cpu = domain->first; cpu >= 0;
+			     cpu = cpuset_find_next_set(&domain->cpus, cpu))
+				util += wayca_util.util[cpu];
+
+			util = (util + (1 << (WAYCA_UTIL_SHIFT - 1))) >>
+			       WAYCA_UTIL_SHIFT;
+			atomic_store_explicit(&table->loads[i].util, util,
+					      memory_order_relaxed);
+		}
+	}
+}
+
+static void wayca_util_sample(void)
+{
+	unsigned long long user, nice, system, idle, iowait, irq, softirq, steal;
+	long long scale = wayca_sc_cpus_in_total();
+	char buf[256];
+	FILE *fp;
+	int cpu;
+
+	fp = fopen("/proc/stat", "r");
+	if (!fp)
+		return;
+
+	wayca_sample_tasks();
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		unsigned long long busy, total, busy_ns, total_ns, own;
+		long long sample;
+
+		/* Skip the summary of all the CPUs and the other lines */
+		steal = 0;
+		if (strncmp(buf, "cpu", 3) || buf[3] < '0' || buf[3] > '9' ||
+		    sscanf(buf, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu",
+			   &cpu, &user, &nice, &system, &idle, &iowait, &irq,
+			   &softirq, &steal) < 8)
+			continue;
+		if (cpu < 0 || cpu >= wayca_util.nr_cpus)
+			continue;
+
+		busy = user + nice + system + irq + softirq + steal;
+		total = busy + idle + iowait;
+
+		/* Nothing to compare with on the first sample */
+		if (!wayca_util.total[cpu] || total <= wayca_util.total[cpu]) {
+			wayca_util.busy[cpu] = busy;
+			wayca_util.total[cpu] = total;
+			continue;
+		}
+
+		busy_ns = (busy - wayca_util.busy[cpu]) * wayca_util.ns_per_tick;
+		total_ns = (total - wayca_util.total[cpu]) * wayca_util.ns_per_tick;
+		own = min(wayca_util.own[cpu], busy_ns);
+		wayca_util.busy[cpu] = busy;
+		wayca_util.total[cpu] = total;
+
+		/*
+		 * A CPU kept busy by the others weighs as much as a wayca
+		 * thread bound to it, and the history halves each period.
+		 */
+		sample = (long long)((busy_ns - own) * (scale << WAYCA_UTIL_SHIFT) /
+				     total_ns);
+		if (wayca_util.sampled[cpu])
+			wayca_util.util[cpu] += (sample - wayca_util.util[cpu]) / 2;
+		else
+			wayca_util.util[cpu] = sample;
+		wayca_util.sampled[cpu] = true;
+	}
+	fclose(fp);
+
+	wayca_util_store();
+}
+
+static void *wayca_util_routine(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&wayca_util.mutex);
+	while (!wayca_util.stop) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += wayca_util.period / 1000000000LL;
+		ts.tv_nsec += wayca_util.period % 1000000000LL;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		while (!wayca_util.stop &&
+		       pthread_cond_timedwait(&wayca_util.cond, &wayca_util.mutex,
+					      &ts) != ETIMEDOUT)
+			;
+		if (wayca_util.stop)
+			break;
+
+		pthread_mutex_unlock(&wayca_util.mutex);
+		wayca_util_sample();
+		pthread_mutex_lock(&wayca_util.mutex);
+	}
+	pthread_mutex_unlock(&wayca_util.mutex);
+
+	return NULL;
+}
+
+/*
+ * Read the time the tasks have waited on the run queue of each CPU in ns,
+ * from /proc/schedstat which is there only if the kernel has schedstats
+ * enabled. The CPUs not found are left untouched.
+ */
+int wayca_cpu_wait_read(unsigned long long *wait, int nr_cpus)
+{
+	unsigned long long field[8];
+	char buf[256];
+	int cpu, found = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/schedstat", "r");
+	if (!fp)
+		return -errno;
+
+	/* The run delay is the 8th field of the cpuN lines */
+	while (fgets(buf, sizeof(buf), fp)) {
+		if (strncmp(buf, "cpu", 3) || buf[3] < '0' || buf[3] > '9' ||
+		    sscanf(buf, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu",
+			   &cpu, &field[0], &field[1], &field[2], &field[3],
+			   &field[4], &field[5], &field[6], &field[7]) != 9)
+			continue;
+		if (cpu < 0 || cpu >= nr_cpus)
+			continue;
+
+		wait[cpu] = field[7];
+		found++;
+	}
+	fclose(fp);
+
+	return found ? 0 : -ENODATA;
+}
+
+/* Read the time the task @tid has waited on a run queue in ns */
+int wayca_task_wait_read(pid_t tid, unsigned long long *wait)
+{
+	unsigned long long runtime;
+	char path[64];
+	FILE *fp;
+	int ret;
+
+	snprintf(path, sizeof(path), "/proc/%d/schedstat", tid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+	ret = fscanf(fp, "%llu %llu", &runtime, wait);
+	fclose(fp);
+
+	return ret == 2 ? 0 : -EINVAL;
+}
+
+void wayca_cpu_util_init(int nr_cpus)
+{
+	pthread_condattr_t attr;
+	unsigned long long ms;
+	char *p;
+
+	pthread_mutex_init(&wayca_util.mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wayca_util.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	p = secure_getenv("WAYCA_SC_UTIL_PERIOD");
+	if (!p)
+		return;
+
+	errno = 0;
+	ms = strtoull(p, NULL, 10);
+	if (errno || !ms || ms > 1000000)
+		return;
+
+	wayca_util.nr_cpus = nr_cpus;
+	wayca_util.ns_per_tick = 1000000000LL / sysconf(_SC_CLK_TCK);
+	wayca_util.busy = calloc(nr_cpus, sizeof(*wayca_util.busy));
+	wayca_util.total = calloc(nr_cpus, sizeof(*wayca_util.total));
+	wayca_util.own = calloc(nr_cpus, sizeof(*wayca_util.own));
+	wayca_util.util = calloc(nr_cpus, sizeof(*wayca_util.util));
+	wayca_util.sampled = calloc(nr_cpus, sizeof(*wayca_util.sampled));
+	if (!wayca_util.busy || !wayca_util.total || !wayca_util.own ||
+	    !wayca_util.util || !wayca_util.sampled) {
+		wayca_cpu_util_exit();
+		return;
+	}
+
+	wayca_util.period = ms * 1000000;
+
+	/* Take the first sample, so the next one has something to compare */
+	wayca_util_sample();
+
+	wayca_util.stop = false;
+	if (pthread_create(&wayca_util.thread, NULL, wayca_util_routine, NULL)) {
+		wayca_cpu_util_exit();
+		return;
+	}
+	wayca_util.running = true;
+}
+
+void wayca_cpu_util_exit(void)
+{
+	if (wayca_util.running) {
+		pthread_mutex_lock(&wayca_util.mutex);
+		wayca_util.stop = true;
+		pthread_cond_signal(&wayca_util.cond);
+		pthread_mutex_unlock(&wayca_util.mutex);
+
+		pthread_join(wayca_util.thread, NULL);
+		wayca_util.running = false;
+	}
+
+	wayca_util.period = 0;
+	pthread_cond_destroy(&wayca_util.cond);
+	pthread_mutex_destroy(&wayca_util.mutex);
+	free(wayca_util.busy);
+	wayca_util.busy = NULL;
+	free(wayca_util.total);
+	wayca_util.total = NULL;
+	free(wayca_util.own);
+	wayca_util.own = NULL;
+	free(wayca_util.util);
+	wayca_util.util = NULL;
+	free(wayca_util.sampled);
+	wayca_util.sampled = NULL;
+	free(wayca_util.tasks);
+	wayca_util.tasks = NULL;
+	wayca_util.nr_tasks = 0;
+}
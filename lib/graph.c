@@ -0,0 +1,333 @@
+/*
+ * Copyright (c) 2021 HiSilicon Technologies Co., Ltd.
+ * Wayca scheduler is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+/* graph.c - The graph of the wayca threads talking to each other
+ *
+ * The users declare how much the threads talk to each other as the
+ * weighted edges between them, like the stages of a pipeline. A group
+ * with WT_GF_AFFINE_GRAPH partitions its threads by the edges, so the
+ * threads talking the most share the caches of a CCL.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "wayca_thread.h"
+
+/*
+ * Each edge is kept by both the threads, and dropped from the peer when
+ * one of them is freed, so the peer is always valid under the mutex.
+ */
+static pthread_mutex_t wayca_graph_mutex;
+
+static struct wayca_edge *wayca_graph_find(struct wayca_thread *thread,
+					   struct wayca_thread *peer)
+{
+	for (int i = 0; i < thread->nr_edges; i++)
+		if (thread->edges[i].peer == peer)
+			return &thread->edges[i];
+
+	return NULL;
+}
+
+static void wayca_graph_del(struct wayca_thread *thread,
+			    struct wayca_thread *peer)
+{
+	struct wayca_edge *edge = wayca_graph_find(thread, peer);
+
+	if (!edge)
+		return;
+
+	*edge = thread->edges[--thread->nr_edges];
+	if (!thread->nr_edges) {
+		free(thread->edges);
+		thread->edges = NULL;
+	}
+}
+
+static int wayca_graph_add(struct wayca_thread *thread,
+			   struct wayca_thread *peer, unsigned int weight)
+{
+	struct wayca_edge *edge = wayca_graph_find(thread, peer);
+
+	if (!edge) {
+		edge = realloc(thread->edges,
+			       (thread->nr_edges + 1) * sizeof(*edge));
+		if (!edge)
+			return -ENOMEM;
+
+		thread->edges = edge;
+		edge = &thread->edges[thread->nr_edges++];
+		edge->peer = peer;
+	}
+
+	edge->weight = weight;
+	return 0;
+}
+
+int wayca_graph_set_edge(struct wayca_thread *thread,
+			 struct wayca_thread *peer, unsigned int weight)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&wayca_graph_mutex);
+	if (!weight) {
+		wayca_graph_del(thread, peer);
+		wayca_graph_del(peer, thread);
+		goto out;
+	}
+
+	ret = wayca_graph_add(thread, peer, weight);
+	if (ret)
+		goto out;
+
+	ret = wayca_graph_add(peer, thread, weight);
+	if (ret)
+		wayca_graph_del(thread, peer);
+out:
+	pthread_mutex_unlock(&wayca_graph_mutex);
+	return ret;
+}
+
+unsigned int wayca_graph_get_edge(struct wayca_thread *thread,
+				  struct wayca_thread *peer)
+{
+	struct wayca_edge *edge;
+	unsigned int weight;
+
+	pthread_mutex_lock(&wayca_graph_mutex);
+	edge = wayca_graph_find(thread, peer);
+	weight = edge ? edge->weight : 0;
+	pthread_mutex_unlock(&wayca_graph_mutex);
+
+	return weight;
+}
+
+/* Drop all the edges of the thread as it's going to be freed */
+void wayca_graph_clear(struct wayca_thread *thread)
+{
+	pthread_mutex_lock(&wayca_graph_mutex);
+	for (int i = 0; i < thread->nr_edges; i++)
+		wayca_graph_del(thread->edges[i].peer, thread);
+
+	free(thread->edges);
+	thread->edges = NULL;
+	thread->nr_edges = 0;
+	pthread_mutex_unlock(&wayca_graph_mutex);
+}
+
+/*
+ * Sum up the weight of the edges from @thread to the other threads of
+ * @group, by the domain of @level each of them is placed in, the ones
+ * in no domain of @level are skipped. Return the number of the edges of
+ * @thread.
+ */
+int wayca_graph_weights(struct wayca_thread *thread,
+			struct wayca_sc_group *group,
+			enum wayca_domain_level level, long long *weights)
+{
+	struct wayca_domain_table *table = &wayca_domains[level];
+	int nr_edges;
+
+	pthread_mutex_lock(&wayca_graph_mutex);
+	for (int i = 0; i < thread->nr_edges; i++) {
+		struct wayca_thread *peer = thread->edges[i].peer;
+		int domain;
+
+		if (!is_thread_in_group(group, peer))
+			continue;
+
+		domain = table->cpu_domain[peer->target_pos];
+		if (domain < 0)
+			continue;
+
+		weights[domain] += thread->edges[i].weight;
+	}
+	nr_edges = thread->nr_edges;
+	pthread_mutex_unlock(&wayca_graph_mutex);
+
+	return nr_edges;
+}
+
+struct wayca_graph_node {
+	struct wayca_thread *thread;
+	int index;
+};
+
+static int wayca_graph_node_cmp(const void *a, const void *b)
+{
+	const struct wayca_graph_node *x = a, *y = b;
+
+	if (x->thread == y->thread)
+		return 0;
+	return x->thread < y->thread ? -1 : 1;
+}
+
+/* Pick the thread left with the most weight in @weights, -1 if none */
+static int wayca_graph_pick(const long long *weights, const bool *done, int n)
+{
+	long long max = 0;
+	int pick = -1;
+
+	for (int i = 0; i < n; i++)
+		if (!done[i] && weights[i] > max) {
+			max = weights[i];
+			pick = i;
+		}
+
+	return pick;
+}
+
+/**
+ * wayca_graph_partition - Partition the threads by the edges between them
+ *
+ * @threads: the threads to partition
+ * @n: the number of the threads
+ * @caps: the number of the threads each part takes
+ * @nr_parts: the number of the parts
+ * @order: the index of the threads in the order they're partitioned
+ * @part: the part each thread of @order goes to
+ *
+ * Grow the parts one by one greedily. A part is seeded by the thread left
+ * with the most weight to the others left, and takes the thread left with
+ * the most weight to it until it's full. When no one left talks to the
+ * part, it's closed if the rest parts can take all the threads left, so
+ * the unrelated threads spread. If the threads are more than the parts
+ * take, they roll over the parts again.
+ *
+ * Return 0 on success, otherwise a negative error number.
+ */
+int wayca_graph_partition(struct wayca_thread **threads, int n,
+			  const int *caps, int nr_parts, int *order, int *part)
+{
+	struct wayca_graph_node *nodes, key, *node;
+	long long *total, *conn, rest;
+	int *start, *peers, nr_edges = 0, assigned = 0, ret = -ENOMEM;
+	unsigned int *weights;
+	bool *done;
+
+	nodes = calloc(n, sizeof(*nodes));
+	start = calloc(n + 1, sizeof(*start));
+	total = calloc(n, sizeof(*total));
+	conn = calloc(n, sizeof(*conn));
+	done = calloc(n, sizeof(*done));
+	peers = NULL;
+	weights = NULL;
+	if (!nodes || !start || !total || !conn || !done)
+		goto out;
+
+	for (int i = 0; i < n; i++) {
+		nodes[i].thread = threads[i];
+		nodes[i].index = i;
+	}
+	qsort(nodes, n, sizeof(*nodes), wayca_graph_node_cmp);
+
+	/* Keep the edges between the threads only, indexed by the thread */
+	pthread_mutex_lock(&wayca_graph_mutex);
+	for (int i = 0; i < n; i++)
+		nr_edges += threads[i]->nr_edges;
+
+	peers = calloc(nr_edges ? nr_edges : 1, sizeof(*peers));
+	weights = calloc(nr_edges ? nr_edges : 1, sizeof(*weights));
+	if (!peers || !weights) {
+		pthread_mutex_unlock(&wayca_graph_mutex);
+		goto out;
+	}
+
+	nr_edges = 0;
+	for (int i = 0; i < n; i++) {
+		start[i] = nr_edges;
+		for (int j = 0; j < threads[i]->nr_edges; j++) {
+			key.thread = threads[i]->edges[j].peer;
+			node = bsearch(&key, nodes, n, sizeof(*nodes),
+				       wayca_graph_node_cmp);
+			if (!node)
+				continue;
+
+			peers[nr_edges] = node->index;
+			weights[nr_edges++] = threads[i]->edges[j].weight;
+			total[i] += threads[i]->edges[j].weight;
+		}
+	}
+	start[n] = nr_edges;
+	pthread_mutex_unlock(&wayca_graph_mutex);
+
+	while (assigned < n) {
+		rest = 0;
+		for (int p = 0; p < nr_parts; p++)
+			rest += caps[p];
+
+		for (int p = 0; p < nr_parts && assigned < n; p++) {
+			int cap = caps[p], taken = 0, u;
+
+			rest -= cap;
+			memset(conn, 0, n * sizeof(*conn));
+
+			while (cap && assigned < n) {
+				u = wayca_graph_pick(conn, done, n);
+				if (u < 0) {
+					if (taken && rest >= n - assigned)
+						break;
+
+					u = wayca_graph_pick(total, done, n);
+				}
+
+				/* No edges left, take the threads in order */
+				for (int i = 0; u < 0; i++)
+					if (!done[i])
+						u = i;
+
+				done[u] = true;
+				order[assigned] = u;
+				part[assigned++] = p;
+				cap--;
+				taken++;
+
+				for (int e = start[u]; e < start[u + 1]; e++) {
+					int v = peers[e];
+
+					if (done[v])
+						continue;
+					conn[v] += weights[e];
+					total[v] -= weights[e];
+				}
+			}
+		}
+	}
+
+	ret = 0;
+out:
+	free(nodes);
+	free(start);
+	free(total);
+	free(conn);
+	free(done);
+	free(peers);
+	free(weights);
+	return ret;
+}
+
+void wayca_graph_init(void)
+{
+	pthread_mutex_init(&wayca_graph_mutex, NULL);
+}
+
+void wayca_graph_exit(void)
+{
+	pthread_mutex_destroy(&wayca_graph_mutex);
+}
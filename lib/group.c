@@ -16,17 +16,37 @@
 #include <limits.h>
 #include <sched.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "wayca_thread.h"
 
-void wayca_thread_update_load(struct wayca_thread *thread, bool add)
+/* The load to place by, counting the CPU time of the others sampled */
+static inline long long wayca_load_read(struct wayca_load *load)
 {
-	int cnt, pos;
-	long long load;
+	return atomic_load_explicit(&load->load, memory_order_relaxed) +
+	       atomic_load_explicit(&load->util, memory_order_relaxed);
+}
+
+static inline void wayca_load_add(struct wayca_load *load, long long delta)
+{
+	if (delta)
+		atomic_fetch_add_explicit(&load->load, delta,
+					  memory_order_relaxed);
+}
+
+static inline long long wayca_cpu_load(int cpu)
+{
+	struct wayca_domain_table *table = &wayca_domains[WAYCA_DOMAIN_CPU];
+
+	return wayca_load_read(&table->loads[table->cpu_domain[cpu]]);
+}
 
-	pthread_mutex_lock(&wayca_cpu_loads_mutex);
+void wayca_thread_update_load(struct wayca_thread *thread, bool add)
+{
+	int domain[WAYCA_DOMAIN_LEVELS], level, cnt, pos;
+	long long load, sum[WAYCA_DOMAIN_LEVELS];
 
 	/*
 	 * Load is updated when the thread is created, destroyed or the
@@ -38,124 +58,234 @@ void wayca_thread_update_load(struct wayca_thread *thread, bool add)
 	 */
 	cnt = CPU_COUNT(&thread->cur_set);
 	if (!cnt)
-		goto out;
+		return;
 
 	load = div_round_up(wayca_sc_cpus_in_total(), cnt);
 
 	if (!add)
 		load = -load;
 
+	for (level = 0; level < WAYCA_DOMAIN_LEVELS; level++) {
+		domain[level] = -1;
+		sum[level] = 0;
+	}
+
+	/*
+	 * Sum up the load of each domain while walking the CPUs, and add
+	 * it once we step out of the domain.
+	 */
 	pos = cpuset_find_first_set(&thread->cur_set);
 	while (pos >= 0) {
-		wayca_cpu_loads[pos] += load;
+		for (level = 0; level < WAYCA_DOMAIN_LEVELS; level++) {
+			struct wayca_domain_table *table = &wayca_domains[level];
+
+			if (!table->loads || table->cpu_domain[pos] < 0)
+				continue;
+
+			if (table->cpu_domain[pos] != domain[level]) {
+				if (domain[level] >= 0)
+					wayca_load_add(&table->loads[domain[level]],
+						       sum[level]);
+				domain[level] = table->cpu_domain[pos];
+				sum[level] = 0;
+			}
+			sum[level] += load;
+		}
+
 		pos = cpuset_find_next_set(&thread->cur_set, pos);
 	}
 
-out:
-	pthread_mutex_unlock(&wayca_cpu_loads_mutex);
+	for (level = 0; level < WAYCA_DOMAIN_LEVELS; level++)
+		if (domain[level] >= 0)
+			wayca_load_add(&wayca_domains[level].loads[domain[level]],
+				       sum[level]);
+}
+
+/*
+ * The load of the domain @index of @level. The loads of the levels above
+ * the nodes are not accounted, sum up the domains of the nearest level
+ * accounted in it instead.
+ */
+static long long wayca_domain_load(enum wayca_domain_level level, int index)
+{
+	struct wayca_domain *domain = &wayca_domains[level].domains[index];
+	struct wayca_domain_table *table;
+	long long load = 0;
+
+	if (wayca_domains[level].loads)
+		return wayca_load_read(&wayca_domains[level].loads[index]);
+
+	while (!wayca_domains[level].loads)
+		level--;
+
+	table = &wayca_domains[level];
+	for (int i = 0; i < table->nr; i++)
+		if (CPU_ISSET(table->domains[i].first, &domain->cpus))
+			load += wayca_load_read(&table->loads[i]);
+
+	return load;
+}
+
+/* Does the @domain have any CPU in @cpuset */
+static bool wayca_domain_available(struct wayca_domain *domain,
+				   cpu_set_t *cpuset)
+{
+	cpu_set_t tset;
+
+	if (CPU_ISSET(domain->first, cpuset))
+		return true;
+
+	CPU_AND(&tset, &domain->cpus, cpuset);
+	return CPU_COUNT(&tset);
 }
 
 static int find_idlest_core(cpu_set_t *cpuset)
 {
 	int pos, idlest_core;
-	long long load;
+	long long load, tload;
 
-	pthread_mutex_lock(&wayca_cpu_loads_mutex);
 	pos = cpuset_find_first_set(cpuset);
 	idlest_core = pos;
-	load = wayca_cpu_loads[pos];
+	load = wayca_cpu_load(pos);
 
-	while (pos <= cpuset_find_last_set(cpuset) && pos >= 0) {
-		if (load > wayca_cpu_loads[pos]) {
-			load = wayca_cpu_loads[pos];
+	while (pos >= 0) {
+		tload = wayca_cpu_load(pos);
+		if (load > tload) {
+			load = tload;
 			idlest_core = pos;
 		}
 
 		pos = cpuset_find_next_set(cpuset, pos);
 	}
-	pthread_mutex_unlock(&wayca_cpu_loads_mutex);
 
 	return idlest_core;
 }
 
 /**
- * Find the idlest set in the @cpuset, and return the found set
- * by @cpuset. The @cpuset must not be an empty set.
+ * Find the idlest domain of the group's topology level in the @cpuset,
+ * and return the CPUs of @cpuset in it by @cpuset. The @cpuset must not
+ * be an empty set.
  */
 static void find_idlest_set(struct wayca_sc_group *group, cpu_set_t *cpuset)
 {
-	int stride, pos, idlest_pos, i;
-	long long load = INT_MAX, tload;
-
-	stride = group->nr_cpus_per_topo;
-	pos = cpuset_find_first_set(cpuset);
+	struct wayca_domain_table *table = &wayca_domains[group->level];
+	long long load = LLONG_MAX, tload;
+	int idlest = -1;
 
-	/* Make sure the @pos is always the start the topology. */
-	pos -= pos % stride;
-	idlest_pos = pos;
-
-	pthread_mutex_lock(&wayca_cpu_loads_mutex);
-	while (pos <= cpuset_find_last_set(cpuset)) {
-		/**
-		 * @cpuset maybe inconsistent. So skip the inavailable
-		 * set of cpus.
-		 */
-		if (!CPU_ISSET(pos, cpuset)) {
-			pos += stride;
+	for (int i = 0; i < table->nr; i++) {
+		/* Skip the domains of which no CPU is available */
+		if (!wayca_domain_available(&table->domains[i], cpuset))
 			continue;
-		}
-
-		tload = 0;
-		for (i = 0; i < stride; i++)
-			tload += wayca_cpu_loads[pos + i];
 
+		tload = wayca_domain_load(group->level, i);
 		if (tload < load) {
-			idlest_pos = pos;
+			idlest = i;
 			load = tload;
 		}
-
-		pos += stride;
 	}
-	pthread_mutex_unlock(&wayca_cpu_loads_mutex);
 
-	CPU_ZERO(cpuset);
-
-	for (i = idlest_pos; i < idlest_pos + stride; i++)
-		CPU_SET(i, cpuset);
+	WAYCA_SC_ASSERT(idlest >= 0);
+	if (idlest >= 0)
+		CPU_AND(cpuset, cpuset, &table->domains[idlest].cpus);
 }
 
 /**
- * Find the first topology set in the @cpuset, which is not set
- * completely. Return the id of the first CPU in the found set.
+ * Find the first domain of the group's topology level, of which the CPUs
+ * in the group are partly in the @cpuset. Return the index of the found
+ * domain.
  */
 static int find_incomplete_set(struct wayca_sc_group *group, cpu_set_t *cpuset)
 {
-	int stride, pos;
-
-	stride = group->nr_cpus_per_topo;
-	pos = cpuset_find_first_set(&group->total);
+	struct wayca_domain_table *table = &wayca_domains[group->level];
 
-	while (pos <= cpuset_find_last_set(&group->total)) {
-		cpu_set_t tset;
-		int i;
+	for (int i = 0; i < table->nr; i++) {
+		cpu_set_t tset, aset;
+		int cnt;
 
-		CPU_ZERO(&tset);
-		for (i = 0; i < stride; i++)
-			CPU_SET(pos + i, &tset);
-
-		CPU_AND(&tset, &tset, cpuset);
+		CPU_AND(&tset, &table->domains[i].cpus, &group->total);
+		CPU_AND(&aset, &tset, cpuset);
+		cnt = CPU_COUNT(&aset);
 
 		/* An empty set is not an incomplete set. */
-		if (CPU_COUNT(&tset) != stride && CPU_COUNT(&tset) != 0)
-			return pos;
-
-		pos += stride;
+		if (cnt && cnt != CPU_COUNT(&tset))
+			return i;
 	}
 
 	/* No imcomplete set is found in the @cpuset */
 	return -ENODATA;
 }
 
+/*
+ * The level of the domains the threads talking to each other are put
+ * together in, the CCLs unless each thread takes more than a CCL.
+ */
+static enum wayca_domain_level wayca_group_affine_level(struct wayca_sc_group *group)
+{
+	enum wayca_domain_level level = group->level;
+
+	if (level < WAYCA_DOMAIN_CCL)
+		level = WAYCA_DOMAIN_CCL;
+	while (!wayca_domains[level].nr)
+		level++;
+
+	return level;
+}
+
+/**
+ * Find the domain in the @cpuset where the threads of the group @thread
+ * talks to the most are placed, or the idlest domain none of the group
+ * is placed in if it talks to none of them yet, and return the idlest CPU
+ * of @cpuset in it. Return -ENODATA if it has no edges or no such domain.
+ */
+static int find_affine_core(struct wayca_sc_group *group,
+			    struct wayca_thread *thread, cpu_set_t *cpuset)
+{
+	enum wayca_domain_level level = wayca_group_affine_level(group);
+	struct wayca_domain_table *table = &wayca_domains[level];
+	long long weights[CPU_SETSIZE], weight = 0, load = LLONG_MAX, tload;
+	int affine = -1;
+	cpu_set_t tset, aset;
+
+	/* The domains are no more than the CPUs, keep off malloc under the lock */
+	if (table->nr > CPU_SETSIZE)
+		return -ENODATA;
+	memset(weights, 0, table->nr * sizeof(*weights));
+
+	if (!wayca_graph_weights(thread, group, level, weights))
+		return -ENODATA;
+
+	for (int i = 0; i < table->nr; i++) {
+		if (weights[i] <= weight ||
+		    !wayca_domain_available(&table->domains[i], cpuset))
+			continue;
+
+		affine = i;
+		weight = weights[i];
+	}
+
+	/* Talks to none placed yet, take a domain none of the group is in */
+	if (affine < 0) {
+		for (int i = 0; i < table->nr; i++) {
+			CPU_AND(&tset, &table->domains[i].cpus, &group->total);
+			CPU_AND(&aset, &tset, cpuset);
+			if (!CPU_COUNT(&tset) || !CPU_EQUAL(&aset, &tset))
+				continue;
+
+			tload = wayca_domain_load(level, i);
+			if (tload < load) {
+				affine = i;
+				load = tload;
+			}
+		}
+	}
+
+	if (affine < 0)
+		return -ENODATA;
+
+	CPU_AND(&tset, &table->domains[affine].cpus, cpuset);
+	return find_idlest_core(&tset);
+}
+
 bool is_thread_in_group(struct wayca_sc_group *group, struct wayca_thread *thread)
 {
 	struct wayca_thread *member;
@@ -363,6 +493,8 @@ static int wayca_group_request_resource(struct wayca_sc_group *group)
 
 	if (group->father == NULL) {
 		memcpy(&group->total, &total_cpu_set, sizeof(cpu_set_t));
+		if (CPU_COUNT(&group->limit))
+			CPU_AND(&group->total, &group->total, &group->limit);
 		return 0;
 	}
 
@@ -390,7 +522,7 @@ static int wayca_group_request_resource(struct wayca_sc_group *group)
 static int wayca_group_arrange(struct wayca_sc_group *group)
 {
 	/* Arrange the parameters according to the attribute */
-	switch (group->attribute & 0xffff) {
+	switch (group->attribute & WT_GF_TOPO_MASK) {
 	case WT_GF_CPU:
 		group->nr_cpus_per_topo = 1;
 		break;
@@ -411,13 +543,32 @@ static int wayca_group_arrange(struct wayca_sc_group *group)
 		return -EINVAL;
 	}
 
+	switch (group->attribute & WT_GF_TOPO_MASK) {
+	case WT_GF_CCL:
+		group->level = WAYCA_DOMAIN_CCL;
+		break;
+	case WT_GF_NUMA:
+		group->level = WAYCA_DOMAIN_NODE;
+		break;
+	case WT_GF_PACKAGE:
+		group->level = WAYCA_DOMAIN_PACKAGE;
+		break;
+	case WT_GF_ALL:
+		group->level = WAYCA_DOMAIN_ALL;
+		break;
+	default:
+		group->level = WAYCA_DOMAIN_CPU;
+		break;
+	}
+
 	/**
 	 * If certain topology level doesn't exist, we'll fall
 	 * back to WT_GF_CPU, as it must exist.
 	 */
-	if (group->nr_cpus_per_topo < 0) {
+	if (group->nr_cpus_per_topo < 0 || !wayca_domains[group->level].nr) {
+		group->level = WAYCA_DOMAIN_CPU;
 		group->nr_cpus_per_topo = 1;
-		group->attribute &= (~0xffff);
+		group->attribute &= ~WT_GF_TOPO_MASK;
 		group->attribute |= WT_GF_CPU;
 	}
 
@@ -449,6 +600,7 @@ int wayca_group_init(struct wayca_sc_group *group)
 	group->roll_over_cnts = 0;
 
 	CPU_ZERO(&group->used);
+	CPU_ZERO(&group->limit);
 	pthread_mutex_init(&group->mutex, NULL);
 
 	/*
@@ -460,39 +612,37 @@ int wayca_group_init(struct wayca_sc_group *group)
 	return wayca_group_arrange(group);
 }
 
-static void wayca_group_assign_thread_resource(struct wayca_sc_group *group,
-					       struct wayca_thread *thread)
+/*
+ * The CPUs the thread at @target_pos takes in the group->used. Only the
+ * CPU itself if the threads are compact or placed by the edges, as the
+ * next thread may be placed in the same topology set. Otherwise the whole
+ * domain of the CPU in the group, as it's exclusive to the next thread.
+ */
+static void wayca_group_thread_used(struct wayca_sc_group *group,
+				    size_t target_pos, cpu_set_t *cpuset)
 {
-	cpu_set_t available_set;
-	ssize_t target_pos = 0;
-	int anchor;
+	struct wayca_domain_table *table = &wayca_domains[group->level];
 
-	memset(&available_set, -1, sizeof(cpu_set_t));
-	CPU_XOR(&available_set, &available_set, &group->used);
-	CPU_AND(&available_set, &available_set, &group->total);
-
-	/**
-	 * If threads in the group is compact, and the available CPU counts
-	 * isn't integer multiple of topology level CPU counts, then find the
-	 * incomplete topology set and place the thread.
-	 *
-	 * Else find the idlest core in the idlest set and place the thread.
-	 */
-	if ((CPU_COUNT(&available_set) % group->nr_cpus_per_topo) &&
-	    group->attribute & WT_GF_COMPACT) {
-		anchor = find_incomplete_set(group, &available_set);
+	CPU_ZERO(cpuset);
+	if (group->attribute & (WT_GF_COMPACT | WT_GF_AFFINE_GRAPH))
+		CPU_SET(target_pos, cpuset);
+	else
+		CPU_AND(cpuset, &table->domains[table->cpu_domain[target_pos]].cpus,
+			&group->total);
+}
 
-		WAYCA_SC_ASSERT(anchor >= 0);
-		target_pos = anchor;
+/* Bind the thread to @target_pos and account it in the group */
+static void wayca_group_place_thread(struct wayca_sc_group *group,
+				     struct wayca_thread *thread,
+				     size_t target_pos)
+{
+	struct wayca_domain_table *table = &wayca_domains[group->level];
+	cpu_set_t domain_set, used_set;
+	int anchor;
 
-		/* iterate the available cpu set and find a proper cpu */
-		while(target_pos < anchor + group->nr_cpus_per_topo &&
-		      !CPU_ISSET(target_pos, &available_set))
-			target_pos += 1;
-	} else {
-		find_idlest_set(group, &available_set);
-		target_pos = find_idlest_core(&available_set);
-	}
+	/* The CPUs of the group in the domain the thread is placed */
+	anchor = table->cpu_domain[target_pos];
+	CPU_AND(&domain_set, &table->domains[anchor].cpus, &group->total);
 
 	/* Reset the thread's cpuset infomation first */
 	CPU_ZERO(&thread->allowed_set);
@@ -504,8 +654,8 @@ static void wayca_group_assign_thread_resource(struct wayca_sc_group *group,
 	 * single CPU to the thread. So we directly assign the CPU at
 	 * the @target_pos to the thread.
 	 *
-	 * Otherwise, we assign a set of CPUs to the thread, ranged
-	 * [target_pos, target_pos + group->nr_cpus_per_topo).
+	 * Otherwise, we assign the CPUs of the group in the domain of
+	 * @target_pos to the thread.
 	 */
 	if (group->attribute & WT_GF_PERCPU) {
 		CPU_SET(target_pos, &thread->cur_set);
@@ -514,44 +664,16 @@ static void wayca_group_assign_thread_resource(struct wayca_sc_group *group,
 		/**
 		 * If the bind policy is not per-CPU, then each thread will
 		 * bind to a set of CPU according to the topology level.
-		 * So always make the start CPU at the beginning of the
-		 * The topology set to avoid intercrossing between adjacent
-		 * topology sets.
+		 * So always bind it to the whole domain to avoid
+		 * intercrossing between adjacent topology sets.
 		 */
-		anchor = target_pos - target_pos % group->nr_cpus_per_topo;
-		for (int num = anchor;
-		     num < anchor + group->nr_cpus_per_topo;
-		     num++) {
-			CPU_SET(num, &thread->cur_set);
-			CPU_SET(num, &thread->allowed_set);
-		}
+		CPU_OR(&thread->cur_set, &thread->cur_set, &domain_set);
+		CPU_OR(&thread->allowed_set, &thread->allowed_set, &domain_set);
 	}
 
-	/**
-	 * Update the group's resource information.
-	 * If the relationship between threads is compact, we only
-	 * record the @target_pos of this thread in the group->used,
-	 * as next thread may be placed in the same topology set.
-	 * Otherwise the threads are scatterred, we have to record
-	 * all the CPUs assigned to this thread in the group->used,
-	 * as it's exclusive to the next thread.
-	 */
-	if (group->attribute & WT_GF_COMPACT) {
-		CPU_SET(target_pos, &group->used);
-	} else {
-		if (group->attribute & WT_GF_PERCPU) {
-			anchor = target_pos -
-				 target_pos % group->nr_cpus_per_topo;
-
-			for (int num = anchor;
-			     num < anchor + group->nr_cpus_per_topo;
-			     num++)
-				CPU_SET(num, &group->used);
-		} else {
-			CPU_OR(&group->used, &group->used,
-			       &thread->allowed_set);
-		}
-	}
+	/* Update the group's resource information */
+	wayca_group_thread_used(group, target_pos, &used_set);
+	CPU_OR(&group->used, &group->used, &used_set);
 
 	/**
 	 * When no cores remains in the group, increase the group->roll_over_cnts
@@ -563,6 +685,66 @@ static void wayca_group_assign_thread_resource(struct wayca_sc_group *group,
 	}
 }
 
+static void wayca_group_assign_thread_resource(struct wayca_sc_group *group,
+					       struct wayca_thread *thread)
+{
+	struct wayca_domain_table *table = &wayca_domains[group->level];
+	cpu_set_t available_set, domain_set;
+	ssize_t target_pos = -ENODATA;
+	int anchor = -ENODATA;
+
+	memset(&available_set, -1, sizeof(cpu_set_t));
+	CPU_XOR(&available_set, &available_set, &group->used);
+	CPU_AND(&available_set, &available_set, &group->total);
+
+	/**
+	 * If the threads in the group are placed by the edges, then place
+	 * the thread together with the threads it talks to the most.
+	 *
+	 * Else if threads in the group is compact, and some domain of the
+	 * topology level is partly used, then place the thread in the
+	 * incomplete domain.
+	 *
+	 * Else find the idlest core in the idlest set and place the thread.
+	 */
+	if (group->attribute & WT_GF_AFFINE_GRAPH)
+		target_pos = find_affine_core(group, thread, &available_set);
+
+	if (target_pos < 0 && (group->attribute & WT_GF_COMPACT))
+		anchor = find_incomplete_set(group, &available_set);
+
+	if (anchor >= 0) {
+		CPU_AND(&domain_set, &table->domains[anchor].cpus,
+			&available_set);
+		target_pos = cpuset_find_first_set(&domain_set);
+	} else if (target_pos < 0) {
+		find_idlest_set(group, &available_set);
+		target_pos = find_idlest_core(&available_set);
+	}
+
+	WAYCA_SC_ASSERT(target_pos >= 0);
+
+	wayca_group_place_thread(group, thread, target_pos);
+}
+
+/* Give back the CPUs the thread takes in the group->used */
+static void wayca_group_release_thread(struct wayca_sc_group *group,
+				       struct wayca_thread *thread)
+{
+	cpu_set_t used_set;
+
+	if (CPU_COUNT(&group->used) == 0) {
+		WAYCA_SC_ASSERT(group->roll_over_cnts > 0);
+
+		group->roll_over_cnts--;
+		CPU_OR(&group->used, &group->used, &group->total);
+	}
+
+	wayca_group_thread_used(group, thread->target_pos, &used_set);
+	CPU_AND(&used_set, &used_set, &group->used);
+	CPU_XOR(&group->used, &group->used, &used_set);
+}
+
 int wayca_group_add_thread(struct wayca_sc_group *group,
 			   struct wayca_thread *thread)
 {
@@ -592,18 +774,7 @@ int wayca_group_delete_thread(struct wayca_sc_group *group,
 	if (!is_thread_in_group(group, thread))
 		return -EINVAL;
 
-	if (CPU_COUNT(&group->used) == 0) {
-		WAYCA_SC_ASSERT(group->roll_over_cnts > 0);
-
-		group->roll_over_cnts--;
-		CPU_OR(&group->used, &group->used, &group->total);
-	}
-
-	if ((group->attribute & WT_GF_COMPACT) &&
-	    !(group->attribute & WT_GF_PERCPU))
-		CPU_CLR(thread->target_pos, &group->used);
-	else
-		CPU_XOR(&group->used, &group->used, &thread->allowed_set);
+	wayca_group_release_thread(group, thread);
 
 	group_thread_delete_thread(group, thread);
 	thread->group = NULL;
@@ -623,6 +794,424 @@ int wayca_group_rearrange_thread(struct wayca_sc_group *group,
 	return 0;
 }
 
+/*
+ * A group must be found imbalanced between the same domains for
+ * WAYCA_REBALANCE_PERSIST periods in a row before a thread is moved, and
+ * the thread moved stays for at least WAYCA_REBALANCE_COOLDOWN periods,
+ * so short bursts and the threads going back and forth won't cost us
+ * more than they gain.
+ */
+#define WAYCA_REBALANCE_PERSIST		3
+#define WAYCA_REBALANCE_COOLDOWN	8
+
+/*
+ * Update the wait of the group's threads per period, smoothed as it's
+ * quite noisy in a short period, and the history halves each period.
+ */
+static void wayca_group_sample_wait(struct wayca_sc_group *group)
+{
+	struct wayca_thread *thread;
+	unsigned long long run_delay;
+
+	group_for_each_threads(thread, group) {
+		if (wayca_task_wait_read(thread->pid, &run_delay) ||
+		    run_delay < thread->run_delay)
+			continue;
+
+		/* Nothing to compare with on the first sample */
+		if (thread->run_delay) {
+			long long delta = run_delay - thread->run_delay;
+
+			thread->wait += (delta - thread->wait) / 2;
+		}
+		thread->run_delay = run_delay;
+	}
+}
+
+/**
+ * wayca_group_rebalance - Move a thread to where the group waits less
+ *
+ * @group: the group of threads, locked by the caller
+ * @wait: the run queue wait of each CPU in the last period, NULL if unknown
+ * @tick: the count of the rebalance periods
+ *
+ * Compare the wait per CPU of the domains of the group's topology level in
+ * the group. If we don't know the wait of the CPUs, count the wait of the
+ * group's threads in the domains instead. Move a thread from the domain
+ * waiting the most to the one waiting the least, if the gap is expected
+ * to narrow by more than the migration cost between the CPUs.
+ *
+ * Return 1 if a thread is moved, otherwise 0.
+ */
+int wayca_group_rebalance(struct wayca_sc_group *group,
+			  const long long *wait, unsigned long tick)
+{
+	struct wayca_domain_table *table = &wayca_domains[group->level];
+	struct wayca_thread *thread, *victim = NULL;
+	long long *domain_wait, load = LLONG_MAX, tload, gap, gain = 0, tgain;
+	long long cost = 0, tcost;
+	int hot = -1, cold = -1, target, domain, *cnts;
+	cpu_set_t cpuset, unused;
+
+	wayca_group_sample_wait(group);
+
+	domain_wait = calloc(table->nr, sizeof(*domain_wait));
+	cnts = calloc(table->nr, sizeof(*cnts));
+	if (!domain_wait || !cnts)
+		goto out;
+
+	for (int i = 0; i < table->nr; i++) {
+		CPU_AND(&cpuset, &table->domains[i].cpus, &group->total);
+		cnts[i] = CPU_COUNT(&cpuset);
+		if (!cnts[i] || !wait)
+			continue;
+
+		for (int cpu = cpuset_find_first_set(&cpuset); cpu >= 0;
+		     cpu = cpuset_find_next_set(&cpuset, cpu))
+			domain_wait[i] += wait[cpu];
+	}
+
+	group_for_each_threads(thread, group) {
+		domain = table->cpu_domain[thread->target_pos];
+		if (domain >= 0 && !wait)
+			domain_wait[domain] += thread->wait;
+	}
+
+	for (int i = 0; i < table->nr; i++)
+		if (cnts[i])
+			domain_wait[i] /= cnts[i];
+
+	/*
+	 * The hot one is where the threads wait the most and some has stayed
+	 * long enough, and the cold one is where they wait the least, or
+	 * with the least load if they're equal.
+	 */
+	group_for_each_threads(thread, group) {
+		domain = table->cpu_domain[thread->target_pos];
+		if (domain >= 0 && tick - thread->migrated >= WAYCA_REBALANCE_COOLDOWN &&
+		    (hot < 0 || domain_wait[domain] > domain_wait[hot]))
+			hot = domain;
+	}
+
+	for (int i = 0; i < table->nr && hot >= 0; i++) {
+		if (!cnts[i] || i == hot)
+			continue;
+
+		tload = wayca_domain_load(group->level, i);
+		if (cold < 0 || domain_wait[i] < domain_wait[cold] ||
+		    (domain_wait[i] == domain_wait[cold] && tload < load)) {
+			cold = i;
+			load = tload;
+		}
+	}
+
+	if (cold < 0) {
+		group->imbalanced = 0;
+		goto out;
+	}
+
+	/* Don't double up on a CPU taken by another thread of the group */
+	CPU_AND(&cpuset, &table->domains[cold].cpus, &group->total);
+	CPU_AND(&unused, &cpuset, &group->used);
+	CPU_XOR(&unused, &unused, &cpuset);
+	target = find_idlest_core(CPU_COUNT(&unused) ? &unused : &cpuset);
+
+	/*
+	 * The thread takes its wait with it, so the gain is how much the
+	 * gap narrows, which is none if it just turns the other way. It
+	 * must close half of the gap at least, or we're chasing the noise,
+	 * and be more than the cost of moving the thread.
+	 */
+	gap = domain_wait[hot] - domain_wait[cold];
+	group_for_each_threads(thread, group) {
+		if (table->cpu_domain[thread->target_pos] != hot ||
+		    tick - thread->migrated < WAYCA_REBALANCE_COOLDOWN)
+			continue;
+
+		tgain = gap - llabs(gap - thread->wait / cnts[hot] -
+				    thread->wait / cnts[cold]);
+		tcost = wayca_migration_cost(thread->target_pos, target);
+		if (!victim || tgain - tcost > gain - cost) {
+			victim = thread;
+			gain = tgain;
+			cost = tcost;
+		}
+	}
+
+	if (gain <= cost || gain * 2 < gap) {
+		group->imbalanced = 0;
+		goto out;
+	}
+
+	if (group->imbalance != hot * table->nr + cold) {
+		group->imbalance = hot * table->nr + cold;
+		group->imbalanced = 0;
+	}
+
+	if (++group->imbalanced < WAYCA_REBALANCE_PERSIST)
+		goto out;
+
+	group->imbalanced = 0;
+	free(domain_wait);
+	free(cnts);
+
+	wayca_thread_update_load(victim, false);
+	wayca_group_release_thread(group, victim);
+
+	wayca_group_place_thread(group, victim, target);
+	wayca_group_rearrange_thread(group, victim);
+	victim->migrated = tick;
+
+	return 1;
+out:
+	free(domain_wait);
+	free(cnts);
+	return 0;
+}
+
+/*
+ * Place the threads of the group again after it's arranged. The places
+ * are taken the same as the threads are added from scratch, but which
+ * thread goes to which place is solved for the least migration cost in
+ * total, so the threads able to stay keep their caches warm.
+ */
+static void wayca_group_replace_threads(struct wayca_sc_group *group)
+{
+	struct wayca_thread *slots, *thread;
+	int n = group->nr_threads, i = 0;
+	size_t *from, *to;
+	int *plan;
+
+	slots = calloc(n, sizeof(*slots));
+	from = calloc(n, sizeof(*from));
+	to = calloc(n, sizeof(*to));
+	plan = calloc(n, sizeof(*plan));
+	if (!slots || !from || !to || !plan)
+		goto fallback;
+
+	group_for_each_threads(thread, group) {
+		wayca_thread_update_load(thread, false);
+		from[i++] = thread->target_pos;
+	}
+
+	/* The places take the load so the next ones are placed around them */
+	for (i = 0; i < n; i++) {
+		wayca_group_assign_thread_resource(group, &slots[i]);
+		wayca_thread_update_load(&slots[i], true);
+		to[i] = slots[i].target_pos;
+	}
+
+	for (i = 0; i < n; i++)
+		wayca_thread_update_load(&slots[i], false);
+
+	if (wayca_migration_plan(from, to, n, plan))
+		for (i = 0; i < n; i++)
+			plan[i] = i;
+
+	i = 0;
+	group_for_each_threads(thread, group) {
+		struct wayca_thread *slot = &slots[plan[i++]];
+
+		thread->target_pos = slot->target_pos;
+		memcpy(&thread->cur_set, &slot->cur_set, sizeof(cpu_set_t));
+		memcpy(&thread->allowed_set, &slot->allowed_set, sizeof(cpu_set_t));
+		wayca_group_rearrange_thread(group, thread);
+	}
+
+	free(slots);
+	free(from);
+	free(to);
+	free(plan);
+	return;
+
+fallback:
+	free(slots);
+	free(from);
+	free(to);
+	free(plan);
+
+	group_for_each_threads(thread, group) {
+		wayca_thread_update_load(thread, false);
+		wayca_group_assign_thread_resource(group, thread);
+		wayca_group_rearrange_thread(group, thread);
+	}
+}
+
+/*
+ * The parts of the same size are alike to the partition, so map each
+ * part to the domain most of its threads are on already, which saves
+ * moving them. @parts is the domain of each part, and is remapped.
+ */
+static void wayca_group_keep_parts(struct wayca_sc_group *group,
+				   struct wayca_thread **threads, int n,
+				   int *parts, const int *caps, int nr_parts,
+				   const int *order, const int *part)
+{
+	enum wayca_domain_level level = wayca_group_affine_level(group);
+	struct wayca_domain_table *table = &wayca_domains[level];
+	int *cnts, *map, *domains;
+	bool *taken;
+
+	cnts = calloc((size_t)nr_parts * nr_parts, sizeof(*cnts));
+	map = calloc(nr_parts, sizeof(*map));
+	domains = calloc(nr_parts, sizeof(*domains));
+	taken = calloc(nr_parts, sizeof(*taken));
+	if (!cnts || !map || !domains || !taken)
+		goto out;
+
+	/* Count the threads of each part on the domain of each part */
+	for (int i = 0; i < n; i++) {
+		size_t pos = threads[order[i]]->target_pos;
+		int domain;
+
+		if (!CPU_ISSET(pos, &group->total))
+			continue;
+
+		domain = table->cpu_domain[pos];
+		for (int q = 0; q < nr_parts; q++)
+			if (parts[q] == domain)
+				cnts[part[i] * nr_parts + q]++;
+	}
+
+	for (int p = 0; p < nr_parts; p++)
+		map[p] = -1;
+
+	/* Take the pair of the most threads kept first */
+	for (;;) {
+		int max = 0, mp = -1, mq = -1;
+
+		for (int p = 0; p < nr_parts; p++)
+			for (int q = 0; q < nr_parts && map[p] < 0; q++)
+				if (!taken[q] && caps[p] == caps[q] &&
+				    cnts[p * nr_parts + q] > max) {
+					max = cnts[p * nr_parts + q];
+					mp = p;
+					mq = q;
+				}
+
+		if (mp < 0)
+			break;
+		map[mp] = mq;
+		taken[mq] = true;
+	}
+
+	for (int p = 0; p < nr_parts; p++)
+		for (int q = 0; q < nr_parts && map[p] < 0; q++)
+			if (!taken[q] && caps[p] == caps[q]) {
+				map[p] = q;
+				taken[q] = true;
+			}
+
+	for (int p = 0; p < nr_parts; p++)
+		domains[p] = parts[map[p]];
+	memcpy(parts, domains, nr_parts * sizeof(*parts));
+out:
+	free(cnts);
+	free(map);
+	free(domains);
+	free(taken);
+}
+
+/*
+ * Place the threads of the group again by the edges between them. The
+ * domains of the group are the parts, idlest first, each takes as many
+ * threads as its CPUs in the group. A thread keeps its CPU if it's still
+ * free in the domain its part is mapped to.
+ */
+static void wayca_group_partition_threads(struct wayca_sc_group *group)
+{
+	enum wayca_domain_level level = wayca_group_affine_level(group);
+	struct wayca_domain_table *table = &wayca_domains[level];
+	int n = group->nr_threads, nr_parts = 0, i = 0;
+	struct wayca_thread **threads, *thread;
+	int *parts, *caps, *order, *part;
+	long long *loads;
+	cpu_set_t cpuset;
+
+	threads = calloc(n, sizeof(*threads));
+	parts = calloc(table->nr, sizeof(*parts));
+	caps = calloc(table->nr, sizeof(*caps));
+	loads = calloc(table->nr, sizeof(*loads));
+	order = calloc(n, sizeof(*order));
+	part = calloc(n, sizeof(*part));
+	if (!threads || !parts || !caps || !loads || !order || !part)
+		goto fallback;
+
+	group_for_each_threads(thread, group) {
+		wayca_thread_update_load(thread, false);
+		threads[i++] = thread;
+	}
+
+	/* Sort the domains of the group by the load, the idlest first */
+	for (int d = 0; d < table->nr; d++) {
+		long long load;
+		int cnt, j;
+
+		CPU_AND(&cpuset, &table->domains[d].cpus, &group->total);
+		cnt = CPU_COUNT(&cpuset);
+		if (!cnt)
+			continue;
+
+		load = wayca_domain_load(level, d);
+		for (j = nr_parts; j > 0 && loads[j - 1] > load; j--) {
+			parts[j] = parts[j - 1];
+			caps[j] = caps[j - 1];
+			loads[j] = loads[j - 1];
+		}
+		parts[j] = d;
+		caps[j] = cnt;
+		loads[j] = load;
+		nr_parts++;
+	}
+
+	if (wayca_graph_partition(threads, n, caps, nr_parts, order, part)) {
+		for (i = 0; i < n; i++) {
+			wayca_group_assign_thread_resource(group, threads[i]);
+			wayca_group_rearrange_thread(group, threads[i]);
+		}
+		goto out;
+	}
+
+	wayca_group_keep_parts(group, threads, n, parts, caps, nr_parts,
+			       order, part);
+
+	for (i = 0; i < n; i++) {
+		size_t target_pos;
+
+		thread = threads[order[i]];
+
+		/*
+		 * A part takes no more threads than the CPUs of its domain
+		 * before all the parts are full and group->used rolls over,
+		 * so there's always a CPU free in the domain.
+		 */
+		memset(&cpuset, -1, sizeof(cpu_set_t));
+		CPU_XOR(&cpuset, &cpuset, &group->used);
+		CPU_AND(&cpuset, &cpuset, &group->total);
+		CPU_AND(&cpuset, &cpuset, &table->domains[parts[part[i]]].cpus);
+		WAYCA_SC_ASSERT(CPU_COUNT(&cpuset) > 0);
+
+		if (CPU_ISSET(thread->target_pos, &cpuset))
+			target_pos = thread->target_pos;
+		else
+			target_pos = find_idlest_core(&cpuset);
+
+		wayca_group_place_thread(group, thread, target_pos);
+		wayca_group_rearrange_thread(group, thread);
+	}
+	goto out;
+
+fallback:
+	wayca_group_replace_threads(group);
+out:
+	free(threads);
+	free(parts);
+	free(caps);
+	free(loads);
+	free(order);
+	free(part);
+}
+
 int wayca_group_rearrange_group(struct wayca_sc_group *group)
 {
 	int ret;
@@ -650,14 +1239,11 @@ int wayca_group_rearrange_group(struct wayca_sc_group *group)
 	 * Otherwise it's an empty group, do nothing.
 	 */
 	if (group->nr_threads) {
-		struct wayca_thread *thread;
-
 		WAYCA_SC_ASSERT(group->nr_groups == 0);
-		group_for_each_threads(thread, group) {
-			wayca_thread_update_load(thread, false);
-			wayca_group_assign_thread_resource(group, thread);
-			wayca_group_rearrange_thread(group, thread);
-		}
+		if (group->attribute & WT_GF_AFFINE_GRAPH)
+			wayca_group_partition_threads(group);
+		else
+			wayca_group_replace_threads(group);
 	} else if (group->nr_groups) {
 		struct wayca_sc_group *child;
 
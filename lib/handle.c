@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2021 HiSilicon Technologies Co., Ltd.
+ * Wayca scheduler is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "handle.h"
+
+/* Find the chunk and the offset in it of the slot @index */
+static struct wayca_handle *handle_slot(struct wayca_handle_table *table,
+					size_t index)
+{
+	struct wayca_handle *chunk;
+	size_t base = (index >> WAYCA_HANDLE_CHUNK_SHIFT) + 1;
+	int k = 63 - __builtin_clzll(base);
+
+	chunk = atomic_load_explicit(&table->chunks[k], memory_order_acquire);
+	if (!chunk)
+		return NULL;
+
+	return &chunk[index - (((1UL << k) - 1) << WAYCA_HANDLE_CHUNK_SHIFT)];
+}
+
+void wayca_handle_table_init(struct wayca_handle_table *table, size_t max)
+{
+	int i;
+
+	for (i = 0; i < WAYCA_HANDLE_CHUNKS; i++)
+		atomic_init(&table->chunks[i], NULL);
+	atomic_init(&table->num, 0);
+	table->max = min(max, (size_t)WAYCA_HANDLE_INDEX_MASK);
+	table->used = 0;
+	table->free = SIZE_MAX;
+	pthread_mutex_init(&table->mutex, NULL);
+}
+
+void wayca_handle_table_fini(struct wayca_handle_table *table)
+{
+	int i;
+
+	for (i = 0; i < WAYCA_HANDLE_CHUNKS; i++) {
+		free(atomic_load(&table->chunks[i]));
+		atomic_store(&table->chunks[i], NULL);
+	}
+	atomic_store(&table->num, 0);
+	table->used = 0;
+	table->free = SIZE_MAX;
+	pthread_mutex_destroy(&table->mutex);
+}
+
+/*
+ * Take a slot for @ptr and return its id in @id. Freed slots are reused
+ * first, otherwise a new one is handed out and the chunk holding it is
+ * allocated on its first use. Return -ENOMEM if the table is full or
+ * out of memory.
+ */
+int wayca_handle_alloc(struct wayca_handle_table *table, void *ptr,
+		       unsigned long long *id)
+{
+	struct wayca_handle *handle;
+	size_t index;
+
+	pthread_mutex_lock(&table->mutex);
+
+	if (table->used >= table->max) {
+		pthread_mutex_unlock(&table->mutex);
+		return -ENOMEM;
+	}
+
+	if (table->free != SIZE_MAX) {
+		index = table->free;
+		handle = handle_slot(table, index);
+		table->free = handle->next;
+	} else {
+		index = atomic_load_explicit(&table->num, memory_order_relaxed);
+		handle = handle_slot(table, index);
+		if (!handle) {
+			size_t base = (index >> WAYCA_HANDLE_CHUNK_SHIFT) + 1;
+			int k = 63 - __builtin_clzll(base);
+			struct wayca_handle *chunk;
+
+			chunk = calloc(WAYCA_HANDLE_CHUNK_BASE << k,
+				       sizeof(*chunk));
+			if (!chunk) {
+				pthread_mutex_unlock(&table->mutex);
+				return -ENOMEM;
+			}
+			atomic_store_explicit(&table->chunks[k], chunk,
+					      memory_order_release);
+			handle = handle_slot(table, index);
+		}
+		atomic_store_explicit(&table->num, index + 1,
+				      memory_order_release);
+	}
+
+	table->used++;
+	atomic_store_explicit(&handle->ptr, ptr, memory_order_release);
+	*id = (unsigned long long)atomic_load_explicit(&handle->gen,
+						       memory_order_relaxed)
+		<< WAYCA_HANDLE_INDEX_BITS | index;
+
+	pthread_mutex_unlock(&table->mutex);
+	return 0;
+}
+
+/*
+ * Return the object of @id, or NULL if @id has never been handed out
+ * or has been freed. It's up to the caller to keep the object alive
+ * while it's used.
+ */
+void *wayca_handle_lookup(struct wayca_handle_table *table,
+			  unsigned long long id)
+{
+	struct wayca_handle *handle;
+	size_t index = id & WAYCA_HANDLE_INDEX_MASK;
+	unsigned int gen = id >> WAYCA_HANDLE_INDEX_BITS;
+	void *ptr;
+
+	if (index >= atomic_load_explicit(&table->num, memory_order_acquire))
+		return NULL;
+
+	handle = handle_slot(table, index);
+	ptr = atomic_load_explicit(&handle->ptr, memory_order_acquire);
+	if (!ptr || atomic_load_explicit(&handle->gen,
+					 memory_order_acquire) != gen)
+		return NULL;
+
+	return ptr;
+}
+
+void wayca_handle_free(struct wayca_handle_table *table, unsigned long long id)
+{
+	struct wayca_handle *handle;
+	size_t index = id & WAYCA_HANDLE_INDEX_MASK;
+	unsigned int gen = id >> WAYCA_HANDLE_INDEX_BITS;
+
+	pthread_mutex_lock(&table->mutex);
+
+	if (index >= atomic_load_explicit(&table->num, memory_order_relaxed))
+		goto out;
+
+	handle = handle_slot(table, index);
+	if (!atomic_load_explicit(&handle->ptr, memory_order_relaxed) ||
+	    atomic_load_explicit(&handle->gen, memory_order_relaxed) != gen)
+		goto out;
+
+	/* Retire the id before the slot can be seen empty and reused */
+	atomic_store_explicit(&handle->gen, gen + 1, memory_order_release);
+	atomic_store_explicit(&handle->ptr, NULL, memory_order_release);
+	handle->next = table->free;
+	table->free = index;
+	table->used--;
+out:
+	pthread_mutex_unlock(&table->mutex);
+}
+
+/*
+ * Call @func with each object in the table, until it returns non-zero.
+ * The table is locked meanwhile so the objects can't be freed under us,
+ * so @func must not allocate or free in the same table.
+ */
+int wayca_handle_for_each(struct wayca_handle_table *table,
+			  int (*func)(void *ptr, void *arg), void *arg)
+{
+	size_t num;
+	int ret = 0;
+
+	pthread_mutex_lock(&table->mutex);
+
+	num = atomic_load_explicit(&table->num, memory_order_relaxed);
+	for (size_t index = 0; index < num && !ret; index++) {
+		void *ptr = atomic_load_explicit(&handle_slot(table, index)->ptr,
+						 memory_order_relaxed);
+
+		if (ptr)
+			ret = func(ptr, arg);
+	}
+
+	pthread_mutex_unlock(&table->mutex);
+	return ret;
+}
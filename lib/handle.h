@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2021 HiSilicon Technologies Co., Ltd.
+ * Wayca scheduler is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#ifndef _WAYCA_HANDLE_H
+#define _WAYCA_HANDLE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/*
+ * An id hands out the index of its slot in the low 32 bits and the
+ * generation of the slot in the high 32 bits. The generation is bumped
+ * each time the slot is freed, so a stale id will no longer match.
+ */
+#define WAYCA_HANDLE_INDEX_BITS		32
+#define WAYCA_HANDLE_INDEX_MASK		((1ULL << WAYCA_HANDLE_INDEX_BITS) - 1)
+
+/*
+ * The slots are kept in chunks of growing size, chunk k has
+ * (WAYCA_HANDLE_CHUNK_BASE << k) slots. Chunks are never moved or
+ * freed until the table goes away, so lookups need no lock.
+ */
+#define WAYCA_HANDLE_CHUNK_SHIFT	6
+#define WAYCA_HANDLE_CHUNK_BASE		(1UL << WAYCA_HANDLE_CHUNK_SHIFT)
+#define WAYCA_HANDLE_CHUNKS		32
+
+struct wayca_handle {
+	_Atomic(void *) ptr;
+	_Atomic unsigned int gen;
+	/* Next free slot, only valid on the free list */
+	size_t next;
+};
+
+struct wayca_handle_table {
+	_Atomic(struct wayca_handle *) chunks[WAYCA_HANDLE_CHUNKS];
+	/* The number of slots ever handed out */
+	_Atomic size_t num;
+	/* The most slots allowed to be in use */
+	size_t max;
+	/* The number of slots in use */
+	size_t used;
+	/* The head of the free slots, SIZE_MAX if none */
+	size_t free;
+	/* Serialize allocating and freeing */
+	pthread_mutex_t mutex;
+};
+
+void wayca_handle_table_init(struct wayca_handle_table *table, size_t max);
+void wayca_handle_table_fini(struct wayca_handle_table *table);
+int wayca_handle_alloc(struct wayca_handle_table *table, void *ptr,
+		       unsigned long long *id);
+void *wayca_handle_lookup(struct wayca_handle_table *table,
+			  unsigned long long id);
+void wayca_handle_free(struct wayca_handle_table *table, unsigned long long id);
+int wayca_handle_for_each(struct wayca_handle_table *table,
+			  int (*func)(void *ptr, void *arg), void *arg);
+
+#endif	/* _WAYCA_HANDLE_H */
@@ -0,0 +1,581 @@
+/*
+ * Copyright (c) 2021 HiSilicon Technologies Co., Ltd.
+ * Wayca scheduler is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+/* migration.c - The cost of moving a thread between the CPUs
+ *
+ * The cost is mostly the time a thread takes to warm up the caches again
+ * on the new CPU. It's measured by moving a thread walking its working
+ * set back and forth between the CPUs, and kept as a matrix on disk to
+ * be loaded when the library starts. If it's not measured yet, estimate
+ * it by the topology level the CPUs share.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "wayca_thread.h"
+
+#define WAYCA_MIGRATION_COST_PATH	"/var/cache/wayca-scheduler/migration_cost"
+
+/* The working set walked if we fail to tell the size of the L2 cache */
+#define WAYCA_MIGRATION_BUF_SIZE	(1024 * 1024)
+/* The times a pair of CPUs is measured, the median is taken */
+#define WAYCA_MIGRATION_ROUNDS		9
+/* The most threads to solve the placement of the least cost for */
+#define WAYCA_MIGRATION_PLAN_MAX	256
+
+/* The estimated cost in ns by the lowest topology level the CPUs share */
+static const long long wayca_migration_estimate[WAYCA_DOMAIN_LEVELS] = {
+	[WAYCA_DOMAIN_CPU]	= 0,
+	[WAYCA_DOMAIN_CCL]	= 125000,
+	[WAYCA_DOMAIN_NODE]	= 250000,
+	[WAYCA_DOMAIN_PACKAGE]	= 500000,
+	[WAYCA_DOMAIN_ALL]	= 1000000,
+};
+
+static struct {
+	int nr_cpus;
+	/* The cost in ns from the CPU of the row to the CPU of the column */
+	_Atomic(long long *) cost;
+	/*
+	 * The matrices replaced by calibrating, which may still be read
+	 * meanwhile, so they're only freed at exit. Under @mutex.
+	 */
+	long long **retired;
+	int nr_retired;
+	pthread_mutex_t mutex;
+} wayca_migration = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static long long wayca_migration_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static bool wayca_migration_cpu_valid(int cpu)
+{
+	struct wayca_domain_table *table = &wayca_domains[WAYCA_DOMAIN_CPU];
+
+	return cpu >= 0 && cpu < wayca_sc_cpus_in_total() &&
+	       table->cpu_domain && table->cpu_domain[cpu] >= 0;
+}
+
+/* The lowest topology level of which a domain has both the CPUs */
+static enum wayca_domain_level wayca_migration_level(int from, int to)
+{
+	enum wayca_domain_level level;
+
+	for (level = WAYCA_DOMAIN_CPU; level < WAYCA_DOMAIN_ALL; level++) {
+		struct wayca_domain_table *table = &wayca_domains[level];
+
+		if (table->nr && table->cpu_domain[from] >= 0 &&
+		    table->cpu_domain[from] == table->cpu_domain[to])
+			return level;
+	}
+
+	return WAYCA_DOMAIN_ALL;
+}
+
+long long wayca_migration_cost(int from, int to)
+{
+	long long *cost;
+
+	if (from == to)
+		return 0;
+
+	cost = atomic_load_explicit(&wayca_migration.cost, memory_order_acquire);
+	if (cost)
+		return cost[from * wayca_migration.nr_cpus + to];
+
+	return wayca_migration_estimate[wayca_migration_level(from, to)];
+}
+
+static long long *wayca_migration_load(const char *path, int nr_cpus)
+{
+	long long *cost;
+	char buf[256];
+	int nr, i;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return NULL;
+
+	/* Skip the comments */
+	do {
+		if (!fgets(buf, sizeof(buf), fp)) {
+			fclose(fp);
+			return NULL;
+		}
+	} while (buf[0] == '#');
+
+	/* The matrix is measured on another machine, or the CPUs changed */
+	if (sscanf(buf, "%d", &nr) != 1 || nr != nr_cpus) {
+		fclose(fp);
+		return NULL;
+	}
+
+	cost = calloc((size_t)nr * nr, sizeof(*cost));
+	if (!cost) {
+		fclose(fp);
+		return NULL;
+	}
+
+	for (i = 0; i < nr * nr; i++)
+		if (fscanf(fp, "%lld", &cost[i]) != 1 || cost[i] < 0)
+			break;
+	fclose(fp);
+
+	if (i != nr * nr) {
+		free(cost);
+		return NULL;
+	}
+
+	return cost;
+}
+
+static int wayca_migration_save(const char *path, long long *cost, int nr_cpus)
+{
+	char *dir;
+	FILE *fp;
+
+	/* Create the cache directory if it's not there */
+	dir = strdup(path);
+	if (!dir)
+		return -ENOMEM;
+	if (mkdir(dirname(dir), 0755) && errno != EEXIST) {
+		free(dir);
+		return -errno;
+	}
+	free(dir);
+
+	fp = fopen(path, "w");
+	if (!fp)
+		return -errno;
+
+	fprintf(fp, "# The migration cost in ns from the CPU of the row to the CPU of the column\n");
+	fprintf(fp, "%d\n", nr_cpus);
+	for (int from = 0; from < nr_cpus; from++)
+		for (int to = 0; to < nr_cpus; to++)
+			fprintf(fp, "%lld%c", cost[from * nr_cpus + to],
+				to == nr_cpus - 1 ? '\n' : ' ');
+
+	if (fclose(fp))
+		return -errno;
+
+	return 0;
+}
+
+static const char *wayca_migration_path(const char *path)
+{
+	if (path)
+		return path;
+
+	path = secure_getenv("WAYCA_SC_MIGRATION_COST_FILE");
+	return path ? path : WAYCA_MIGRATION_COST_PATH;
+}
+
+void wayca_migration_init(int nr_cpus)
+{
+	wayca_migration.nr_cpus = nr_cpus;
+	atomic_init(&wayca_migration.cost,
+		    wayca_migration_load(wayca_migration_path(NULL), nr_cpus));
+}
+
+void wayca_migration_exit(void)
+{
+	free(atomic_exchange(&wayca_migration.cost, NULL));
+
+	pthread_mutex_lock(&wayca_migration.mutex);
+	for (int i = 0; i < wayca_migration.nr_retired; i++)
+		free(wayca_migration.retired[i]);
+	free(wayca_migration.retired);
+	wayca_migration.retired = NULL;
+	wayca_migration.nr_retired = 0;
+	pthread_mutex_unlock(&wayca_migration.mutex);
+}
+
+/* Take the matrix @cost just measured instead of the one in use */
+static int wayca_migration_replace(long long *cost)
+{
+	long long **retired, *old;
+	int ret = 0;
+
+	pthread_mutex_lock(&wayca_migration.mutex);
+	retired = realloc(wayca_migration.retired,
+			  (wayca_migration.nr_retired + 1) * sizeof(*retired));
+	if (!retired) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	wayca_migration.retired = retired;
+
+	old = atomic_exchange_explicit(&wayca_migration.cost, cost,
+				       memory_order_acq_rel);
+	if (old)
+		retired[wayca_migration.nr_retired++] = old;
+out:
+	pthread_mutex_unlock(&wayca_migration.mutex);
+	return ret;
+}
+
+/* Write each cache line of the buffer and return the time it takes */
+static long long wayca_migration_walk(volatile char *buf, size_t size)
+{
+	long long start = wayca_migration_now();
+
+	for (size_t i = 0; i < size; i += WAYCA_SC_CACHELINE_SIZE)
+		buf[i]++;
+
+	return wayca_migration_now() - start;
+}
+
+static int wayca_migration_cmp(const void *a, const void *b)
+{
+	const long long *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+/*
+ * Warm up the buffer on @from and move to @to, the cost is how much
+ * slower the first walk on @to is than the next one.
+ */
+static int wayca_migration_measure(int from, int to, char *buf, size_t size,
+				   long long *cost)
+{
+	long long samples[WAYCA_MIGRATION_ROUNDS], cold, warm;
+	cpu_set_t from_set, to_set;
+
+	CPU_ZERO(&from_set);
+	CPU_SET(from, &from_set);
+	CPU_ZERO(&to_set);
+	CPU_SET(to, &to_set);
+
+	for (int i = 0; i < WAYCA_MIGRATION_ROUNDS; i++) {
+		if (sched_setaffinity(0, sizeof(cpu_set_t), &from_set))
+			return -errno;
+		wayca_migration_walk(buf, size);
+		wayca_migration_walk(buf, size);
+
+		if (sched_setaffinity(0, sizeof(cpu_set_t), &to_set))
+			return -errno;
+		cold = wayca_migration_walk(buf, size);
+		warm = wayca_migration_walk(buf, size);
+
+		samples[i] = max(cold - warm, 0LL);
+	}
+
+	qsort(samples, WAYCA_MIGRATION_ROUNDS, sizeof(long long),
+	      wayca_migration_cmp);
+	*cost = samples[WAYCA_MIGRATION_ROUNDS / 2];
+
+	return 0;
+}
+
+/*
+ * Measure the cost from the first CPU to one CPU of each topology level,
+ * and take it for all the CPUs sharing the same level.
+ */
+static int wayca_migration_measure_levels(long long *cost, int nr_cpus,
+					  char *buf, size_t size)
+{
+	long long level_cost[WAYCA_DOMAIN_LEVELS];
+	bool measured[WAYCA_DOMAIN_LEVELS] = { false };
+	enum wayca_domain_level level;
+	int first = -1, ret;
+
+	for (int cpu = 0; cpu < nr_cpus; cpu++) {
+		if (!wayca_migration_cpu_valid(cpu))
+			continue;
+
+		if (first < 0) {
+			first = cpu;
+			continue;
+		}
+
+		level = wayca_migration_level(first, cpu);
+		if (measured[level])
+			continue;
+
+		ret = wayca_migration_measure(first, cpu, buf, size,
+					      &level_cost[level]);
+		if (ret)
+			return ret;
+		measured[level] = true;
+	}
+
+	for (int from = 0; from < nr_cpus; from++)
+		for (int to = 0; to < nr_cpus; to++) {
+			if (from == to || !wayca_migration_cpu_valid(from) ||
+			    !wayca_migration_cpu_valid(to))
+				continue;
+
+			level = wayca_migration_level(from, to);
+			cost[from * nr_cpus + to] = measured[level] ?
+				level_cost[level] : wayca_migration_estimate[level];
+		}
+
+	return 0;
+}
+
+static int wayca_migration_measure_all(long long *cost, int nr_cpus,
+				       char *buf, size_t size)
+{
+	int ret;
+
+	for (int from = 0; from < nr_cpus; from++)
+		for (int to = 0; to < nr_cpus; to++) {
+			if (from == to || !wayca_migration_cpu_valid(from) ||
+			    !wayca_migration_cpu_valid(to))
+				continue;
+
+			ret = wayca_migration_measure(from, to, buf, size,
+						      &cost[from * nr_cpus + to]);
+			if (ret)
+				return ret;
+		}
+
+	return 0;
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_migration_cost_calibrate(const char *path,
+							unsigned int flags)
+{
+	int nr_cpus = wayca_sc_cpus_in_total(), first, ret;
+	cpu_set_t saved;
+	long long *cost;
+	size_t size;
+	char *buf;
+
+	if (nr_cpus <= 0 || !wayca_domains[WAYCA_DOMAIN_CPU].nr ||
+	    (flags & ~WT_MC_ALL_PAIRS))
+		return -EINVAL;
+
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &saved))
+		return -errno;
+
+	/* Walk a working set as large as the L2 cache */
+	first = wayca_domains[WAYCA_DOMAIN_CPU].domains[0].first;
+	ret = wayca_sc_get_l2_size(first);
+	size = ret > 0 ? (size_t)ret * 1024 : WAYCA_MIGRATION_BUF_SIZE;
+
+	cost = calloc((size_t)nr_cpus * nr_cpus, sizeof(*cost));
+	buf = calloc(1, size);
+	if (!cost || !buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (flags & WT_MC_ALL_PAIRS)
+		ret = wayca_migration_measure_all(cost, nr_cpus, buf, size);
+	else
+		ret = wayca_migration_measure_levels(cost, nr_cpus, buf, size);
+	sched_setaffinity(0, sizeof(cpu_set_t), &saved);
+	if (ret)
+		goto out;
+
+	ret = wayca_migration_save(wayca_migration_path(path), cost, nr_cpus);
+	if (ret)
+		goto out;
+
+	/* Use it from now on, as if the library is started with it */
+	ret = wayca_migration_replace(cost);
+	if (!ret)
+		cost = NULL;
+out:
+	free(cost);
+	free(buf);
+	return ret;
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_migration_cost(int from, int to,
+					      unsigned long long *cost)
+{
+	if (!cost || !wayca_migration_cpu_valid(from) ||
+	    !wayca_migration_cpu_valid(to))
+		return -EINVAL;
+
+	*cost = wayca_migration_cost(from, to);
+	return 0;
+}
+
+/*
+ * Too many threads to solve for, keep the threads on the CPU they're on
+ * if there's a place there, and put the rest in order.
+ */
+static int wayca_migration_plan_keep(const size_t *from, const size_t *to,
+				     int n, int *plan)
+{
+	int nr_cpus = wayca_sc_cpus_in_total();
+	int *head, *next, j = 0;
+	bool *taken;
+
+	head = malloc(nr_cpus * sizeof(*head));
+	next = malloc(n * sizeof(*next));
+	taken = calloc(n, sizeof(*taken));
+	if (!head || !next || !taken) {
+		free(head);
+		free(next);
+		free(taken);
+		return -ENOMEM;
+	}
+
+	/* The places on each CPU */
+	for (int cpu = 0; cpu < nr_cpus; cpu++)
+		head[cpu] = -1;
+	for (int i = n - 1; i >= 0; i--) {
+		next[i] = head[to[i]];
+		head[to[i]] = i;
+	}
+
+	for (int i = 0; i < n; i++) {
+		plan[i] = head[from[i]];
+		if (plan[i] < 0)
+			continue;
+
+		head[from[i]] = next[plan[i]];
+		taken[plan[i]] = true;
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (plan[i] >= 0)
+			continue;
+
+		while (taken[j])
+			j++;
+		plan[i] = j;
+		taken[j] = true;
+	}
+
+	free(head);
+	free(next);
+	free(taken);
+	return 0;
+}
+
+/**
+ * wayca_migration_plan - Solve the places for the threads to move to
+ *
+ * @from: the CPU each thread is on
+ * @to: the CPU of each place
+ * @n: the number of threads and places
+ * @plan: the place of each thread solved
+ *
+ * Find which place each thread goes to, for the least cost of moving all
+ * the threads, by the Hungarian algorithm in O(n^3).
+ *
+ * Return 0 on success, or -ENOMEM if out of memory.
+ */
+int wayca_migration_plan(const size_t *from, const size_t *to, int n, int *plan)
+{
+	long long *u, *v, *minv, delta, cur;
+	int *p, *way, i0, j0, j1;
+	bool *used;
+
+	if (n > WAYCA_MIGRATION_PLAN_MAX)
+		return wayca_migration_plan_keep(from, to, n, plan);
+
+	/* Index from 1, the column 0 is the virtual one to start with */
+	u = calloc(n + 1, sizeof(*u));
+	v = calloc(n + 1, sizeof(*v));
+	minv = calloc(n + 1, sizeof(*minv));
+	p = calloc(n + 1, sizeof(*p));
+	way = calloc(n + 1, sizeof(*way));
+	used = calloc(n + 1, sizeof(*used));
+	if (!u || !v || !minv || !p || !way || !used) {
+		free(u);
+		free(v);
+		free(minv);
+		free(p);
+		free(way);
+		free(used);
+		return -ENOMEM;
+	}
+
+	for (int i = 1; i <= n; i++) {
+		p[0] = i;
+		j0 = 0;
+		for (int j = 0; j <= n; j++) {
+			minv[j] = LLONG_MAX;
+			used[j] = false;
+		}
+
+		/* Find the augmenting path for the thread @i */
+		do {
+			used[j0] = true;
+			i0 = p[j0];
+			delta = LLONG_MAX;
+			j1 = 0;
+
+			for (int j = 1; j <= n; j++) {
+				if (used[j])
+					continue;
+
+				cur = wayca_migration_cost(from[i0 - 1], to[j - 1]) -
+				      u[i0] - v[j];
+				if (cur < minv[j]) {
+					minv[j] = cur;
+					way[j] = j0;
+				}
+				if (minv[j] < delta) {
+					delta = minv[j];
+					j1 = j;
+				}
+			}
+
+			for (int j = 0; j <= n; j++) {
+				if (used[j]) {
+					u[p[j]] += delta;
+					v[j] -= delta;
+				} else {
+					minv[j] -= delta;
+				}
+			}
+
+			j0 = j1;
+		} while (p[j0]);
+
+		do {
+			j1 = way[j0];
+			p[j0] = p[j1];
+			j0 = j1;
+		} while (j0);
+	}
+
+	for (int j = 1; j <= n; j++)
+		plan[p[j] - 1] = j - 1;
+
+	free(u);
+	free(v);
+	free(minv);
+	free(p);
+	free(way);
+	free(used);
+	return 0;
+}
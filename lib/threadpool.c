@@ -0,0 +1,3239 @@
+/*
+ * Copyright (c) 2021 HiSilicon Technologies Co., Ltd.
+ * Wayca scheduler is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+
+#include "common.h"
+#include "threadpool.h"
+
+/* The worker running on current thread, NULL if not a threadpool worker */
+static __thread struct wayca_threadpool_worker *current_worker;
+
+/* Seed for the threads out of the pool to pick a worker to steal from */
+static __thread unsigned int helper_seed;
+
+/* The fiber running on current thread, NULL if not in a fiber */
+static __thread struct wayca_threadpool_fiber *current_fiber;
+
+struct wayca_threadpool_slab {
+	struct wayca_threadpool_slab *next;
+};
+
+static inline long mbind(void *addr, unsigned long len, int mode,
+			 const unsigned long *nodemask, unsigned long maxnode,
+			 unsigned int flags)
+{
+	long ret;
+
+	ret = syscall(__NR_mbind, addr, len, mode, nodemask, maxnode, flags);
+	return ret < 0 ? -errno : ret;
+}
+
+static long long threadpool_now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void threadpool_cache_init(struct wayca_threadpool_cache *cache)
+{
+	cache->free = NULL;
+	cache->slabs = NULL;
+	cache->node = -1;
+	atomic_init(&cache->remote_free, NULL);
+}
+
+/*
+ * Add a new slab to the @cache. The slab is preferred to be allocated
+ * on the node of the owner, the pages will be touched by the owner when
+ * carving the tasks as well.
+ */
+static int threadpool_cache_grow(struct wayca_threadpool_cache *cache)
+{
+	size_t size = WAYCA_SC_THREADPOOL_SLAB_SIZE;
+	struct wayca_threadpool_task *task;
+	struct wayca_threadpool_slab *slab;
+	node_set_t mask;
+	size_t offset;
+
+	slab = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (slab == MAP_FAILED)
+		return -ENOMEM;
+
+	/* Failing to bind the memory is not fatal, just lose the locality */
+	if (cache->node >= 0) {
+		NODE_ZERO(&mask);
+		NODE_SET(cache->node, &mask);
+		mbind(slab, size, MPOL_PREFERRED, (unsigned long *)&mask,
+		      wayca_sc_nodes_in_total() + 1, 0);
+	}
+
+	slab->next = cache->slabs;
+	cache->slabs = slab;
+
+	offset = round_up(sizeof(*slab), sizeof(void *));
+	while (offset + sizeof(*task) <= size) {
+		task = (struct wayca_threadpool_task *)((char *)slab + offset);
+		task->cache = cache;
+		task->next = cache->free;
+		cache->free = task;
+		offset += sizeof(*task);
+	}
+
+	return 0;
+}
+
+static void threadpool_cache_release(struct wayca_threadpool_cache *cache)
+{
+	struct wayca_threadpool_slab *slab;
+
+	while (cache->slabs) {
+		slab = cache->slabs;
+		cache->slabs = slab->next;
+		munmap(slab, WAYCA_SC_THREADPOOL_SLAB_SIZE);
+	}
+
+	cache->free = NULL;
+	atomic_store(&cache->remote_free, NULL);
+}
+
+/* Allocate a task from @cache, only called by the owner of the @cache */
+static struct wayca_threadpool_task *
+threadpool_task_alloc(struct wayca_threadpool_cache *cache)
+{
+	struct wayca_threadpool_task *task;
+
+	if (!cache->free) {
+		cache->free = atomic_exchange_explicit(&cache->remote_free, NULL,
+						       memory_order_acquire);
+		if (!cache->free && threadpool_cache_grow(cache))
+			return NULL;
+	}
+
+	task = cache->free;
+	cache->free = task->next;
+
+	return task;
+}
+
+/*
+ * Free a task to where it's allocated. @local is the cache owned by
+ * the caller, NULL if the caller owns none.
+ */
+static void threadpool_task_free(struct wayca_threadpool_task *task,
+				 struct wayca_threadpool_cache *local)
+{
+	struct wayca_threadpool_cache *cache = task->cache;
+	struct wayca_threadpool_task *head;
+
+	if (cache == local) {
+		task->next = cache->free;
+		cache->free = task;
+		return;
+	}
+
+	/*
+	 * Only the owner takes the whole list away, so there is no ABA
+	 * problem for the lockless push.
+	 */
+	head = atomic_load_explicit(&cache->remote_free, memory_order_relaxed);
+	do {
+		task->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&cache->remote_free,
+							&head, task,
+							memory_order_release,
+							memory_order_relaxed));
+}
+
+static void threadpool_queue_task(struct wayca_threadpool_queue *queue,
+				  struct wayca_threadpool_task *task)
+{
+	if (threadpool_queue_is_empty(queue)) {
+		WAYCA_SC_ASSERT(!queue->num);
+		queue->head = task;
+		queue->head->next = task;
+		queue->head->prev = task;
+	} else {
+		struct wayca_threadpool_task *prev, *next;
+
+		WAYCA_SC_ASSERT(queue->num);
+		prev = queue->head->prev;
+		next = queue->head;
+
+		next->prev = task;
+		task->next = next;
+		task->prev = prev;
+		prev->next = task;
+	}
+
+	queue->num++;
+}
+
+static struct wayca_threadpool_task *
+threadpool_dequeue_task(struct wayca_threadpool_queue *queue)
+{
+	struct wayca_threadpool_task *task, *next, *prev;
+
+	if (threadpool_queue_is_empty(queue))
+		return NULL;
+
+	task = queue->head;
+	WAYCA_SC_ASSERT(task);
+
+	/* If there is only one task in the queue */
+	if (task->next == task) {
+		WAYCA_SC_ASSERT(queue->num == 1);
+		queue->head = NULL;
+	} else {
+		WAYCA_SC_ASSERT(queue->num >= 2);
+		next = task->next;
+		prev = task->prev;
+
+		next->prev = prev;
+		prev->next = next;
+		queue->head = next;
+	}
+
+	queue->num--;
+	return task;
+}
+
+/*
+ * Link a chain of tasks to the tail of the @queue. The chain is
+ * [@first, @last] linked by both next and prev, with @num tasks.
+ */
+static void threadpool_queue_splice(struct wayca_threadpool_queue *queue,
+				    struct wayca_threadpool_task *first,
+				    struct wayca_threadpool_task *last,
+				    size_t num)
+{
+	struct wayca_threadpool_task *tail;
+
+	if (threadpool_queue_is_empty(queue)) {
+		WAYCA_SC_ASSERT(!queue->num);
+		queue->head = first;
+	} else {
+		WAYCA_SC_ASSERT(queue->num);
+		tail = queue->head->prev;
+		tail->next = first;
+		first->prev = tail;
+	}
+
+	last->next = queue->head;
+	queue->head->prev = last;
+
+	queue->num += num;
+}
+
+static void threadpool_prio_queue_init(struct wayca_threadpool_prio_queue *pq)
+{
+	for (int prio = 0; prio < WAYCA_SC_THREADPOOL_PRIO_LEVELS; prio++) {
+		pq->levels[prio].queue.head = NULL;
+		atomic_init(&pq->levels[prio].queue.num, 0);
+		pq->levels[prio].since = 0;
+	}
+
+	atomic_init(&pq->bitmap, 0);
+	atomic_init(&pq->num, 0);
+	pq->seq = 0;
+}
+
+/* Link a chain of @num tasks to the tail of the level @prio */
+static void threadpool_prio_queue_splice(struct wayca_threadpool_prio_queue *pq,
+					 struct wayca_threadpool_task *first,
+					 struct wayca_threadpool_task *last,
+					 size_t num, int prio)
+{
+	struct wayca_threadpool_queue *queue = &pq->levels[prio].queue;
+
+	if (threadpool_queue_is_empty(queue)) {
+		pq->levels[prio].since = pq->seq;
+		atomic_fetch_or_explicit(&pq->bitmap, 1UL << prio,
+					 memory_order_relaxed);
+	}
+
+	threadpool_queue_splice(queue, first, last, num);
+	atomic_fetch_add_explicit(&pq->num, num, memory_order_relaxed);
+}
+
+static void threadpool_prio_queue_task(struct wayca_threadpool_prio_queue *pq,
+				       struct wayca_threadpool_task *task,
+				       int prio)
+{
+	task->prev = task->next = NULL;
+	threadpool_prio_queue_splice(pq, task, task, 1, prio);
+}
+
+/*
+ * Dequeue a task from the highest non-empty level, unless the head of
+ * a lower level has waited too long.
+ */
+static struct wayca_threadpool_task *
+threadpool_prio_dequeue_task(struct wayca_threadpool_prio_queue *pq)
+{
+	unsigned long bitmap = atomic_load_explicit(&pq->bitmap,
+						    memory_order_relaxed);
+	struct wayca_threadpool_task *task;
+	int prio, level;
+
+	if (!bitmap)
+		return NULL;
+
+	prio = __builtin_ctzl(bitmap);
+	for (bitmap &= bitmap - 1; bitmap; bitmap &= bitmap - 1) {
+		level = __builtin_ctzl(bitmap);
+		if (pq->seq - pq->levels[level].since >=
+		    (unsigned long long)(level - prio) * WAYCA_SC_THREADPOOL_PRIO_AGING) {
+			prio = level;
+			break;
+		}
+	}
+
+	task = threadpool_dequeue_task(&pq->levels[prio].queue);
+	pq->seq++;
+	if (threadpool_queue_is_empty(&pq->levels[prio].queue))
+		atomic_fetch_and_explicit(&pq->bitmap, ~(1UL << prio),
+					  memory_order_relaxed);
+	else
+		pq->levels[prio].since = pq->seq;
+	atomic_fetch_sub_explicit(&pq->num, 1, memory_order_relaxed);
+
+	return task;
+}
+
+static int threadpool_ring_init(struct wayca_threadpool_ring *ring, size_t size)
+{
+	int ret;
+
+	ret = posix_memalign((void **)&ring->cells, WAYCA_SC_CACHELINE_SIZE,
+			     size * sizeof(struct wayca_threadpool_ring_cell));
+	if (ret)
+		return -ret;
+
+	for (size_t i = 0; i < size; i++)
+		atomic_init(&ring->cells[i].seq, i);
+	ring->mask = size - 1;
+
+	return 0;
+}
+
+/*
+ * The number of the tasks in the ring, including the ones being queued.
+ * The tail is read with acquire, pairing with the release of reserving,
+ * so the consumer seeing any task also sees the cells the producer saw.
+ */
+static size_t threadpool_ring_num(struct wayca_threadpool_ring *ring)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	/* The tail never goes behind the head we've read */
+	return atomic_load_explicit(&ring->tail, memory_order_acquire) - head;
+}
+
+/*
+ * Reserve @num positions from the tail of the ring for queueing, the
+ * first one is returned by @pos. Return false if there isn't enough
+ * room. The reserved cells must be filled by threadpool_ring_fill().
+ */
+static bool threadpool_ring_reserve(struct wayca_threadpool_ring *ring,
+				    size_t num, size_t *pos)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t head;
+
+	for (;;) {
+		head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		if ((ssize_t)(tail - head) < 0) {
+			/* Our tail is stale, the consumers have gone further */
+			tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+			continue;
+		}
+
+		if (tail - head + num > ring->mask + 1)
+			return false;
+
+		if (atomic_compare_exchange_weak_explicit(&ring->tail, &tail, tail + num,
+							  memory_order_release,
+							  memory_order_relaxed))
+			break;
+	}
+
+	*pos = tail;
+	return true;
+}
+
+/* Fill the reserved cell at @pos and publish it to the consumers */
+static void threadpool_ring_fill(struct wayca_threadpool_ring *ring, size_t pos,
+				 struct wayca_threadpool_taskgroup *taskgroup,
+				 wayca_sc_threadpool_task_func task_func,
+				 void *arg, long long queued)
+{
+	struct wayca_threadpool_ring_cell *cell = &ring->cells[pos & ring->mask];
+
+	/* The consumer of the last round may not have finished reading it */
+	while (atomic_load_explicit(&cell->seq, memory_order_acquire) != pos)
+		cpu_relax();
+
+	cell->task = task_func;
+	cell->arg = arg;
+	cell->taskgroup = taskgroup;
+	cell->queued = queued;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+}
+
+/*
+ * Dequeue a task from the ring into @task. Return false if the ring is
+ * empty, or the head task is still being filled by its producer.
+ */
+static bool threadpool_ring_dequeue(struct wayca_threadpool_ring *ring,
+				    struct wayca_threadpool_task *task)
+{
+	struct wayca_threadpool_ring_cell *cell;
+	size_t pos, seq;
+
+	pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	for (;;) {
+		cell = &ring->cells[pos & ring->mask];
+		seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		if ((ssize_t)(seq - (pos + 1)) < 0)
+			return false;
+
+		if (seq == pos + 1) {
+			if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+								  memory_order_relaxed,
+								  memory_order_relaxed))
+				break;
+		} else {
+			pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		}
+	}
+
+	task->cache = NULL;
+	task->task = cell->task;
+	task->arg = cell->arg;
+	task->taskgroup = cell->taskgroup;
+	task->queued = cell->queued;
+	task->topo = 0;
+	atomic_store_explicit(&cell->seq, pos + ring->mask + 1, memory_order_release);
+
+	return true;
+}
+
+static int threadpool_deque_init(struct wayca_threadpool_deque *deque)
+{
+	size_t size = WAYCA_SC_THREADPOOL_DEQUE_SIZE;
+
+	deque->buffer = calloc(size, sizeof(*deque->buffer));
+	if (!deque->buffer)
+		return -ENOMEM;
+
+	atomic_init(&deque->top, 0);
+	atomic_init(&deque->bottom, 0);
+	deque->mask = size - 1;
+
+	return 0;
+}
+
+/*
+ * The free entries of the deque for the owner to push, more may be
+ * freed by the thieves meanwhile.
+ */
+static size_t threadpool_deque_room(struct wayca_threadpool_deque *deque)
+{
+	return deque->mask + 1 -
+	       (atomic_load_explicit(&deque->bottom, memory_order_relaxed) -
+		atomic_load_explicit(&deque->top, memory_order_acquire));
+}
+
+/*
+ * The deque operations follow the C11 version of the Chase-Lev deque,
+ * ref: N.M. Le, et al. "Correct and Efficient Work-Stealing for Weak
+ * Memory Models", PPoPP'13.
+ *
+ * Push a task at the bottom of the deque, only called by the owner.
+ * Return false if the deque is full.
+ */
+static bool threadpool_deque_push(struct wayca_threadpool_deque *deque,
+				  struct wayca_threadpool_task *task)
+{
+	long bottom, top;
+
+	bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+	top = atomic_load_explicit(&deque->top, memory_order_acquire);
+	if (bottom - top > deque->mask)
+		return false;
+
+	atomic_store_explicit(&deque->buffer[bottom & deque->mask], task,
+			      memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+
+	return true;
+}
+
+/*
+ * Push the tasks from the chain headed by @*first at the bottom of the
+ * deque, as many as the deque can hold but no more than @num, and
+ * publish them at once. Only called by the owner. @*first is updated
+ * to the first task not pushed and the number pushed is returned.
+ */
+static size_t threadpool_deque_push_batch(struct wayca_threadpool_deque *deque,
+					  struct wayca_threadpool_task **first,
+					  size_t num)
+{
+	struct wayca_threadpool_task *task;
+	long bottom, top;
+	size_t space;
+
+	bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+	top = atomic_load_explicit(&deque->top, memory_order_acquire);
+	space = deque->mask + 1 - (bottom - top);
+	num = min(num, space);
+
+	for (size_t i = 0; i < num; i++) {
+		task = *first;
+		*first = task->next;
+		atomic_store_explicit(&deque->buffer[(bottom + i) & deque->mask],
+				      task, memory_order_relaxed);
+	}
+
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&deque->bottom, bottom + num, memory_order_relaxed);
+
+	return num;
+}
+
+/* Take a task from the bottom of the deque, only called by the owner */
+static struct wayca_threadpool_task *
+threadpool_deque_take(struct wayca_threadpool_deque *deque)
+{
+	struct wayca_threadpool_task *task = NULL;
+	long bottom, top;
+
+	bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+	if (top > bottom) {
+		/* The deque is empty */
+		atomic_store_explicit(&deque->bottom, bottom + 1,
+				      memory_order_relaxed);
+		return NULL;
+	}
+
+	task = atomic_load_explicit(&deque->buffer[bottom & deque->mask],
+				    memory_order_relaxed);
+	if (top == bottom) {
+		/* The last task, race with the thieves */
+		if (!atomic_compare_exchange_strong_explicit(&deque->top, &top,
+							     top + 1,
+							     memory_order_seq_cst,
+							     memory_order_relaxed))
+			task = NULL;
+		atomic_store_explicit(&deque->bottom, bottom + 1,
+				      memory_order_relaxed);
+	}
+
+	return task;
+}
+
+/* Steal a task from the top of the deque, can be called by anyone */
+static struct wayca_threadpool_task *
+threadpool_deque_steal(struct wayca_threadpool_deque *deque)
+{
+	struct wayca_threadpool_task *task;
+	long bottom, top;
+
+	top = atomic_load_explicit(&deque->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+	if (top >= bottom)
+		return NULL;
+
+	task = atomic_load_explicit(&deque->buffer[top & deque->mask],
+				    memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+						     memory_order_seq_cst,
+						     memory_order_relaxed))
+		return NULL;
+
+	return task;
+}
+
+static inline long futex(_Atomic int *uaddr, int op, int val,
+			 const struct timespec *timeout)
+{
+	return syscall(__NR_futex, (int *)uaddr, op, val, timeout, NULL, 0);
+}
+
+/* Wake up @worker if it's parked, return false if it's not */
+static bool threadpool_unpark(struct wayca_threadpool *pool,
+			      struct wayca_threadpool_worker *worker)
+{
+	int state = THREADPOOL_WORKER_PARKED;
+
+	if (atomic_load_explicit(&worker->park, memory_order_relaxed) != state)
+		return false;
+
+	if (!atomic_compare_exchange_strong(&worker->park, &state,
+					    THREADPOOL_WORKER_RUNNING))
+		return false;
+
+	atomic_fetch_sub(&pool->sleep_num, 1);
+	futex(&worker->park, FUTEX_WAKE_PRIVATE, 1, NULL);
+	return true;
+}
+
+/*
+ * Ask for the CPUs lent to the other pools in the budget back on queueing
+ * the first task after the pool lent them. The submitter only flags it,
+ * the worker woken up for the task takes the budget lock and sets the
+ * affinity of the borrowers.
+ */
+static void threadpool_budget_reclaim(struct wayca_threadpool *pool)
+{
+	if (atomic_load_explicit(&pool->lent, memory_order_relaxed) &&
+	    atomic_exchange(&pool->lent, false))
+		atomic_store(&pool->reclaim, true);
+}
+
+/*
+ * Wake up at most @num parked workers. The ones sharing the cluster
+ * with the submitter are preferred, as the new tasks are likely still
+ * in the cache of the submitter, then the ones on the same node, who
+ * serve the shard of the shared queue the tasks may be queued to.
+ */
+static void threadpool_wakeup(struct wayca_threadpool *pool, size_t num)
+{
+	struct wayca_threadpool_worker *self = current_worker;
+	size_t total = pool->max_worker_num;
+	size_t start;
+	int cpu, ccl, node;
+
+	threadpool_budget_reclaim(pool);
+
+	if (!atomic_load(&pool->sleep_num))
+		return;
+
+	/* A worker has the others sorted by the distance to it already */
+	if (self && self->pool == pool && atomic_load(&pool->victims_ready)) {
+		for (int i = 0; i < self->level_end[THREADPOOL_STEAL_LEVELS - 1]; i++) {
+			if (!atomic_load(&pool->sleep_num))
+				return;
+			if (threadpool_unpark(pool, &pool->workers[self->victims[i]]) &&
+			    !--num)
+				return;
+		}
+		return;
+	}
+
+	cpu = sched_getcpu();
+	ccl = cpu >= 0 ? wayca_sc_get_ccl_id(cpu) : -1;
+	node = cpu >= 0 ? wayca_sc_get_node_id(cpu) : -1;
+	start = rand_r(&helper_seed) % total;
+
+	/* The ones in our cluster first, then our node, then anyone */
+	for (int pass = ccl >= 0 ? 0 : node >= 0 ? 1 : 2; pass < 3; pass++) {
+		for (size_t i = 0; i < total; i++) {
+			struct wayca_threadpool_worker *worker;
+
+			if (!atomic_load(&pool->sleep_num))
+				return;
+
+			worker = &pool->workers[(start + i) % total];
+			if ((pass == 0 && worker->ccl != ccl) ||
+			    (pass == 1 && worker->node != node))
+				continue;
+
+			if (threadpool_unpark(pool, worker) && !--num)
+				return;
+		}
+	}
+}
+
+/*
+ * Add @val to a statistic @counter, which is @shared by the threads out
+ * of the pool, otherwise only updated by its owner.
+ */
+static void threadpool_stat_add(_Atomic unsigned long long *counter,
+				unsigned long long val, bool shared)
+{
+	if (shared)
+		atomic_fetch_add_explicit(counter, val, memory_order_relaxed);
+	else
+		atomic_store_explicit(counter,
+				      atomic_load_explicit(counter, memory_order_relaxed) + val,
+				      memory_order_relaxed);
+}
+
+static void threadpool_hist_add(_Atomic unsigned long long *hist,
+				unsigned long long ns, bool shared)
+{
+	int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+
+	threadpool_stat_add(&hist[min(bucket, THREADPOOL_HIST_BUCKETS - 1)], 1,
+			    shared);
+}
+
+static bool threadpool_deque_is_empty(struct wayca_threadpool_deque *deque)
+{
+	return atomic_load(&deque->bottom) <= atomic_load(&deque->top);
+}
+
+/*
+ * The shard of the shared queue on the node of the current thread. A
+ * worker uses the node it's bound to, others the node they run on.
+ */
+static struct wayca_threadpool_shard *
+threadpool_local_shard(struct wayca_threadpool *pool)
+{
+	struct wayca_threadpool_worker *worker = current_worker;
+	int node = -1, cpu;
+
+	if (pool->shard_num == 1)
+		return pool->shards;
+
+	if (worker && worker->pool == pool)
+		node = worker->node;
+	if (node < 0) {
+		cpu = sched_getcpu();
+		node = cpu >= 0 ? wayca_sc_get_node_id(cpu) : -1;
+	}
+
+	return &pool->shards[node >= 0 ? node % pool->shard_num : 0];
+}
+
+/* Whether the tasks waiting in @shard are more than its workers can take */
+static bool threadpool_shard_overloaded(struct wayca_threadpool_shard *shard)
+{
+	return atomic_load_explicit(&shard->queue.num, memory_order_relaxed) >
+	       atomic_load_explicit(&shard->worker_num, memory_order_relaxed);
+}
+
+/* The number of the tasks in all the shards of the shared queue */
+static size_t threadpool_shared_num(struct wayca_threadpool *pool)
+{
+	size_t num = 0;
+
+	for (size_t i = 0; i < pool->shard_num; i++)
+		num += atomic_load_explicit(&pool->shards[i].queue.num,
+					    memory_order_relaxed);
+
+	return num;
+}
+
+/* The number of the tasks in the deque, racy with the owner and thieves */
+static size_t threadpool_deque_num(struct wayca_threadpool_deque *deque)
+{
+	long num = atomic_load_explicit(&deque->bottom, memory_order_relaxed) -
+		   atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+	return num > 0 ? num : 0;
+}
+
+/*
+ * Whether @thief may take the tasks of @victim. The workers on the other
+ * nodes are left alone unless their node is overloaded, that's its shard
+ * or the deque of @victim has more tasks than the workers there can take.
+ */
+static bool threadpool_may_steal(struct wayca_threadpool_worker *thief,
+				 struct wayca_threadpool_worker *victim)
+{
+	struct wayca_threadpool *pool = thief->pool;
+	struct wayca_threadpool_shard *shard;
+
+	if (pool->shard_num == 1 || thief->node < 0 || victim->node < 0 ||
+	    thief->node == victim->node)
+		return true;
+
+	shard = &pool->shards[victim->node % pool->shard_num];
+	return threadpool_shard_overloaded(shard) ||
+	       threadpool_deque_num(&victim->deque) >
+	       atomic_load_explicit(&shard->worker_num, memory_order_relaxed);
+}
+
+/*
+ * Whether there's a task @worker may run. The tasks in the shards and
+ * of the workers on the other nodes don't count unless they're
+ * overloaded, or the worker would keep polling them while the workers
+ * there are busy.
+ */
+static bool threadpool_worker_has_task(struct wayca_threadpool_worker *worker)
+{
+	struct wayca_threadpool *pool = worker->pool;
+	struct wayca_threadpool_shard *local, *shard;
+	struct wayca_threadpool_worker *victim;
+	size_t task_num, remote = 0;
+
+	/* Read before the shards, so we see the shard of a counted task */
+	task_num = atomic_load(&pool->task_num);
+	if (pool->shard_num == 1 || !task_num)
+		return task_num;
+
+	local = threadpool_local_shard(pool);
+	for (size_t i = 0; i < pool->shard_num; i++) {
+		shard = &pool->shards[i];
+		if (shard == local)
+			continue;
+		if (threadpool_shard_overloaded(shard))
+			return true;
+		remote += atomic_load_explicit(&shard->queue.num, memory_order_relaxed);
+	}
+
+	for (size_t i = 0; i < pool->max_worker_num; i++) {
+		victim = &pool->workers[i];
+		if (threadpool_may_steal(worker, victim))
+			continue;
+
+		remote += threadpool_deque_num(&victim->deque) +
+			  atomic_load_explicit(&victim->inbox.num, memory_order_relaxed);
+	}
+
+	return task_num > remote;
+}
+
+/*
+ * Retire the idle @worker if there're more workers than the minimum.
+ * Return true if retired, and the worker should exit then.
+ */
+static bool threadpool_worker_retire(struct wayca_threadpool_worker *worker)
+{
+	struct wayca_threadpool *pool = worker->pool;
+	bool retired = false;
+
+	pthread_mutex_lock(&pool->resize_mutex);
+	if (atomic_load(&pool->total_worker_num) <= pool->min_worker_num ||
+	    atomic_load(&pool->stop))
+		goto out;
+
+	/*
+	 * The tasks queued to our inbox before the submitter sees we're
+	 * gone are still ours, otherwise the submitter will move them.
+	 */
+	atomic_store(&worker->live, false);
+	if (atomic_load(&worker->inbox.num) ||
+	    !threadpool_deque_is_empty(&worker->deque)) {
+		atomic_store(&worker->live, true);
+		goto out;
+	}
+
+	atomic_fetch_sub(&pool->total_worker_num, 1);
+	atomic_fetch_sub(&pool->idle_num, 1);
+	wayca_sc_thread_detach_group(worker->thread->id, pool->group->id);
+	wayca_threadpool_build_victims(pool);
+	retired = true;
+out:
+	pthread_mutex_unlock(&pool->resize_mutex);
+	return retired;
+}
+
+/*
+ * Wait for new tasks. With WT_PF_IDLE_SPIN, spin for a while before
+ * parking to save the latency of the futex wakeup, otherwise park at
+ * once. Return true if the worker is retired after parked too long.
+ */
+static bool threadpool_worker_idle(struct wayca_threadpool_worker *worker)
+{
+	struct wayca_threadpool *pool = worker->pool;
+	struct timespec begin, now, timeout = {
+		.tv_sec = WAYCA_SC_THREADPOOL_RETIRE_MS / 1000,
+		.tv_nsec = WAYCA_SC_THREADPOOL_RETIRE_MS % 1000 * 1000000,
+	};
+	bool elastic;
+	int state;
+
+	if (atomic_load_explicit(&pool->attribute, memory_order_relaxed) &
+	    WT_PF_IDLE_SPIN) {
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		for (unsigned int i = 1; ; i++) {
+			if (threadpool_worker_has_task(worker) ||
+			    atomic_load_explicit(&worker->inbox.num, memory_order_relaxed) ||
+			    atomic_load_explicit(&pool->stop, memory_order_relaxed))
+				return false;
+
+			cpu_relax();
+
+			/* Don't read the clock on every loop */
+			if (i % 64)
+				continue;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if ((now.tv_sec - begin.tv_sec) * 1000000000L +
+			    now.tv_nsec - begin.tv_nsec >= WAYCA_SC_THREADPOOL_SPIN_NS)
+				break;
+		}
+	}
+
+	/* Only the workers more than the minimum may retire */
+	elastic = atomic_load(&pool->total_worker_num) > pool->min_worker_num;
+
+	atomic_store(&worker->park, THREADPOOL_WORKER_PARKED);
+	atomic_fetch_add(&pool->sleep_num, 1);
+	threadpool_stat_add(&worker->stats.parks, 1, false);
+
+	/*
+	 * Check the task number and our inbox after we're visible as
+	 * parked, so that either we'll see the newly queued task or the
+	 * submitter will see us and wake us up.
+	 */
+	while (atomic_load(&worker->park) == THREADPOOL_WORKER_PARKED) {
+		if (threadpool_worker_has_task(worker) || atomic_load(&worker->inbox.num) ||
+		    atomic_load(&pool->stop)) {
+			/* Unpark ourselves, unless someone has done it for us */
+			state = THREADPOOL_WORKER_PARKED;
+			if (atomic_compare_exchange_strong(&worker->park, &state,
+							   THREADPOOL_WORKER_RUNNING))
+				atomic_fetch_sub(&pool->sleep_num, 1);
+			break;
+		}
+
+		if (futex(&worker->park, FUTEX_WAIT_PRIVATE, THREADPOOL_WORKER_PARKED,
+			  elastic ? &timeout : NULL) && errno == ETIMEDOUT) {
+			state = THREADPOOL_WORKER_PARKED;
+			if (!atomic_compare_exchange_strong(&worker->park, &state,
+							    THREADPOOL_WORKER_RUNNING))
+				break;
+
+			atomic_fetch_sub(&pool->sleep_num, 1);
+			return threadpool_worker_retire(worker);
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Spawn a new worker for an elastic pool if the tasks have been waiting
+ * with no idle worker for a while, and the pool is not at its maximum.
+ */
+static void threadpool_check_grow(struct wayca_threadpool *pool)
+{
+	long long now, since;
+
+	if (pool->min_worker_num == pool->max_worker_num)
+		return;
+
+	if (atomic_load_explicit(&pool->idle_num, memory_order_relaxed) ||
+	    !atomic_load_explicit(&pool->task_num, memory_order_relaxed)) {
+		if (atomic_load_explicit(&pool->backlog_since, memory_order_relaxed))
+			atomic_store_explicit(&pool->backlog_since, 0,
+					      memory_order_relaxed);
+		return;
+	}
+
+	now = threadpool_now_ns();
+	since = atomic_load_explicit(&pool->backlog_since, memory_order_relaxed);
+	if (!since) {
+		atomic_compare_exchange_strong(&pool->backlog_since, &since, now);
+		return;
+	}
+
+	if (now - since < WAYCA_SC_THREADPOOL_GROW_NS)
+		return;
+
+	/* Someone else is resizing the pool, leave it to them */
+	if (pthread_mutex_trylock(&pool->resize_mutex))
+		return;
+
+	if (!atomic_load(&pool->stop) &&
+	    atomic_load(&pool->total_worker_num) < pool->max_worker_num) {
+		for (size_t i = 0; i < pool->max_worker_num; i++) {
+			if (atomic_load(&pool->workers[i].live))
+				continue;
+
+			if (!wayca_threadpool_spawn(pool, &pool->workers[i], NULL))
+				wayca_threadpool_build_victims(pool);
+			break;
+		}
+	}
+
+	atomic_store(&pool->backlog_since, 0);
+	pthread_mutex_unlock(&pool->resize_mutex);
+}
+
+static enum threadpool_steal_level
+threadpool_steal_level(struct wayca_threadpool_worker *thief,
+		       struct wayca_threadpool_worker *victim)
+{
+	if (thief->ccl >= 0 && thief->ccl == victim->ccl)
+		return THREADPOOL_STEAL_CCL;
+	if (thief->node >= 0 && thief->node == victim->node)
+		return THREADPOOL_STEAL_NODE;
+	if (thief->package >= 0 && thief->package == victim->package)
+		return THREADPOOL_STEAL_PACKAGE;
+
+	return THREADPOOL_STEAL_REMOTE;
+}
+
+static void threadpool_count_steal(struct wayca_threadpool_worker *worker,
+				   enum threadpool_steal_level level)
+{
+	/* Only the owner updates the counters, no need of an atomic RMW */
+	atomic_store_explicit(&worker->steals[level],
+			      atomic_load_explicit(&worker->steals[level],
+						   memory_order_relaxed) + 1,
+			      memory_order_relaxed);
+}
+
+/*
+ * Steal from the workers level by level, the ones sharing the cluster
+ * first, then in the same NUMA node, the same package, and the remote
+ * ones at last, if their node is overloaded. Start from a random victim
+ * in each level to spread the thieves.
+ */
+static struct wayca_threadpool_task *
+threadpool_steal_task_topo(struct wayca_threadpool_worker *worker)
+{
+	struct wayca_threadpool *pool = worker->pool;
+	struct wayca_threadpool_task *task;
+	int level, start = 0, end, num;
+	int offset, victim;
+
+	for (level = 0; level < THREADPOOL_STEAL_LEVELS; level++, start = end) {
+		end = worker->level_end[level];
+		num = end - start;
+		if (num <= 0)
+			continue;
+
+		offset = rand_r(&worker->seed) % num;
+		for (int i = 0; i < num; i++) {
+			victim = worker->victims[start + (offset + i) % num];
+			if (!threadpool_may_steal(worker, &pool->workers[victim]))
+				continue;
+
+			task = threadpool_deque_steal(&pool->workers[victim].deque);
+			if (task) {
+				threadpool_count_steal(worker, level);
+				return task;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static struct wayca_threadpool_task *
+threadpool_steal_task_random(struct wayca_threadpool_worker *worker)
+{
+	struct wayca_threadpool *pool = worker->pool;
+	struct wayca_threadpool_task *task;
+	size_t num = pool->max_worker_num;
+	size_t start, victim;
+
+	/* Start from a random victim to spread the thieves */
+	start = rand_r(&worker->seed) % num;
+	for (size_t i = 0; i < num; i++) {
+		victim = (start + i) % num;
+		if (victim == worker->index ||
+		    !threadpool_may_steal(worker, &pool->workers[victim]))
+			continue;
+
+		task = threadpool_deque_steal(&pool->workers[victim].deque);
+		if (task) {
+			if (atomic_load(&pool->victims_ready))
+				threadpool_count_steal(worker,
+					threadpool_steal_level(worker,
+							       &pool->workers[victim]));
+			return task;
+		}
+	}
+
+	return NULL;
+}
+
+/* Whether @worker is placed in the topology domain @topo with the id @id */
+static bool threadpool_worker_in(struct wayca_threadpool_worker *worker,
+				 wayca_sc_group_attr_t topo, int id)
+{
+	switch (topo) {
+	case WT_GF_CPU:
+		return worker->cpu == id;
+	case WT_GF_CCL:
+		return worker->ccl == id;
+	case WT_GF_NUMA:
+		return worker->node == id;
+	case WT_GF_PACKAGE:
+		return worker->package == id;
+	default:
+		return true;
+	}
+}
+
+/*
+ * Take a task from the inbox of @worker by @thief, which is NULL for
+ * the threads out of the pool. The head task is left if it must run
+ * in a topology domain that @thief is not in.
+ */
+static struct wayca_threadpool_task *
+threadpool_inbox_take(struct wayca_threadpool_worker *worker,
+		      struct wayca_threadpool_worker *thief)
+{
+	struct wayca_threadpool_task *task = NULL;
+
+	if (!atomic_load_explicit(&worker->inbox.num, memory_order_relaxed))
+		return NULL;
+
+	pthread_mutex_lock(&worker->inbox_mutex);
+	if (!threadpool_queue_is_empty(&worker->inbox) &&
+	    (thief == worker || !worker->inbox.head->topo ||
+	     (thief && threadpool_worker_in(thief, worker->inbox.head->topo,
+					    worker->inbox.head->topo_id))))
+		task = threadpool_dequeue_task(&worker->inbox);
+	pthread_mutex_unlock(&worker->inbox_mutex);
+
+	return task;
+}
+
+/*
+ * Take a task from the inboxes of the workers other than @thief,
+ * starting from @start. The tasks in the inboxes are expected to run
+ * on their targets, so they're only taken when there's nothing else
+ * to do, and from the other nodes only when they're overloaded.
+ */
+static struct wayca_threadpool_task *
+threadpool_steal_inbox(struct wayca_threadpool *pool,
+		       struct wayca_threadpool_worker *thief, size_t start)
+{
+	struct wayca_threadpool_task *task;
+	size_t num = pool->max_worker_num;
+	struct wayca_threadpool_worker *victim;
+
+	for (size_t i = 0; i < num; i++) {
+		victim = &pool->workers[(start + i) % num];
+		if (victim == thief || (thief && !threadpool_may_steal(thief, victim)))
+			continue;
+
+		task = threadpool_inbox_take(victim, thief);
+		if (task)
+			return task;
+	}
+
+	return NULL;
+}
+
+static struct wayca_threadpool_task *
+threadpool_steal_task(struct wayca_threadpool_worker *worker)
+{
+	struct wayca_threadpool *pool = worker->pool;
+	struct wayca_threadpool_task *task;
+
+	if (pool->max_worker_num < 2)
+		return NULL;
+
+	if (atomic_load_explicit(&pool->attribute, memory_order_relaxed) &
+	    WT_PF_STEAL_TOPO)
+		task = threadpool_steal_task_topo(worker);
+	else
+		task = threadpool_steal_task_random(worker);
+	if (task)
+		return task;
+
+	return threadpool_steal_inbox(pool, worker,
+				      rand_r(&worker->seed) % pool->max_worker_num);
+}
+
+static struct wayca_threadpool_task *
+threadpool_shard_dequeue(struct wayca_threadpool_shard *shard)
+{
+	struct wayca_threadpool_task *task;
+
+	if (!atomic_load_explicit(&shard->queue.num, memory_order_relaxed))
+		return NULL;
+
+	pthread_mutex_lock(&shard->mutex);
+	task = threadpool_prio_dequeue_task(&shard->queue);
+	pthread_mutex_unlock(&shard->mutex);
+
+	return task;
+}
+
+/*
+ * Dequeue a task from @shard of the shared queue. The tasks in the
+ * ring of a WT_PF_BOUNDED pool are in the default priority, served
+ * after the urgent ones in the list, and before the lower ones except
+ * once in a while so that they won't starve. The task from the ring is
+ * copied into @buf, as there's no descriptor for it.
+ */
+static struct wayca_threadpool_task *
+threadpool_shared_dequeue(struct wayca_threadpool *pool,
+			  struct wayca_threadpool_shard *shard,
+			  struct wayca_threadpool_task *buf)
+{
+	unsigned long bitmap = atomic_load_explicit(&shard->queue.bitmap,
+						    memory_order_relaxed);
+	bool ring = threadpool_ring_num(&pool->ring);
+	struct wayca_threadpool_task *task;
+
+	buf->pool = pool;
+	if (ring && !(bitmap & THREADPOOL_PRIO_URGENT_MASK) &&
+	    (!bitmap || rand_r(&helper_seed) % WAYCA_SC_THREADPOOL_PRIO_AGING) &&
+	    threadpool_ring_dequeue(&pool->ring, buf))
+		return buf;
+
+	task = threadpool_shard_dequeue(shard);
+	if (task)
+		return task;
+
+	if (ring && threadpool_ring_dequeue(&pool->ring, buf))
+		return buf;
+
+	return NULL;
+}
+
+/*
+ * Take a task from the shards other than @local. Only the overloaded
+ * ones are visited unless @any, so the tasks stay on their nodes while
+ * the workers there keep up.
+ */
+static struct wayca_threadpool_task *
+threadpool_remote_dequeue(struct wayca_threadpool *pool,
+			  struct wayca_threadpool_shard *local, bool any)
+{
+	struct wayca_threadpool_shard *shard;
+	struct wayca_threadpool_task *task;
+
+	for (size_t i = 0; i < pool->shard_num; i++) {
+		shard = &pool->shards[i];
+		if (shard == local || (!any && !threadpool_shard_overloaded(shard)))
+			continue;
+
+		task = threadpool_shard_dequeue(shard);
+		if (task)
+			return task;
+	}
+
+	return NULL;
+}
+
+/* Get a task for @worker to run, copied into @buf if it's from the ring */
+static struct wayca_threadpool_task *
+threadpool_worker_get_task(struct wayca_threadpool_worker *worker,
+			   struct wayca_threadpool_task *buf)
+{
+	struct wayca_threadpool *pool = worker->pool;
+	struct wayca_threadpool_shard *shard = threadpool_local_shard(pool);
+	struct wayca_threadpool_task *task;
+
+	/* The urgent tasks shouldn't wait behind our own ones */
+	if (atomic_load_explicit(&shard->queue.bitmap, memory_order_relaxed) &
+	    THREADPOOL_PRIO_URGENT_MASK) {
+		task = threadpool_shared_dequeue(pool, shard, buf);
+		if (task)
+			return task;
+	}
+
+	/* The most recently queued task of our own is still hot in cache */
+	task = threadpool_deque_take(&worker->deque);
+	if (task)
+		return task;
+
+	task = threadpool_inbox_take(worker, worker);
+	if (task)
+		return task;
+
+	task = threadpool_shared_dequeue(pool, shard, buf);
+	if (task)
+		return task;
+
+	task = threadpool_steal_task(worker);
+	if (task || pool->shard_num == 1)
+		return task;
+
+	return threadpool_remote_dequeue(pool, shard, false);
+}
+
+/*
+ * Find a task for a thread out of the pool waiting for a taskgroup,
+ * from the shared queue first, then steal from the workers. The task
+ * from the ring is copied into @buf.
+ */
+static struct wayca_threadpool_task *
+threadpool_helper_get_task(struct wayca_threadpool *pool,
+			   struct wayca_threadpool_task *buf)
+{
+	struct wayca_threadpool_shard *shard = threadpool_local_shard(pool);
+	struct wayca_threadpool_task *task;
+	size_t num = pool->max_worker_num;
+	size_t start;
+
+	task = threadpool_shared_dequeue(pool, shard, buf);
+	if (task)
+		return task;
+
+	start = rand_r(&helper_seed) % num;
+	for (size_t i = 0; i < num; i++) {
+		task = threadpool_deque_steal(&pool->workers[(start + i) % num].deque);
+		if (task)
+			return task;
+	}
+
+	task = threadpool_steal_inbox(pool, NULL, start);
+	if (task || pool->shard_num == 1)
+		return task;
+
+	/* We're waiting for the tasks anyway, wherever they're queued */
+	return threadpool_remote_dequeue(pool, shard, true);
+}
+
+static void threadpool_taskgroup_add(struct wayca_threadpool_taskgroup *taskgroup,
+				     size_t num)
+{
+	if (taskgroup)
+		atomic_fetch_add(&taskgroup->pending, num);
+}
+
+static size_t threadpool_taskgroup_pending(struct wayca_threadpool_taskgroup *taskgroup)
+{
+	return atomic_load(&taskgroup->pending) & ~THREADPOOL_TASKGROUP_EVENTFD;
+}
+
+static void threadpool_taskgroup_done(struct wayca_threadpool_taskgroup *taskgroup)
+{
+	size_t pending = atomic_load(&taskgroup->pending);
+	int fd;
+
+	/*
+	 * Not the last one and no eventfd, no one to wake up. The eventfd
+	 * created meanwhile sets the flag, and fails the exchange.
+	 */
+	while (pending > 1 && !(pending & THREADPOOL_TASKGROUP_EVENTFD))
+		if (atomic_compare_exchange_weak(&taskgroup->pending, &pending,
+						 pending - 1))
+			return;
+
+	/*
+	 * The last task finishes under the mutex, so the waiter who sees
+	 * the group finished can be sure we won't touch it any more after
+	 * it acquired the mutex. Signal the eventfd under the mutex as well,
+	 * whoever has read all the tasks finished from it can destroy the
+	 * group at once, which closes the fd after acquiring the mutex.
+	 */
+	pthread_mutex_lock(&taskgroup->mutex);
+	fd = atomic_load(&taskgroup->eventfd);
+	pending = atomic_fetch_sub(&taskgroup->pending, 1) & ~THREADPOOL_TASKGROUP_EVENTFD;
+	if (fd >= 0)
+		eventfd_write(fd, 1);
+	if (pending == 1 && taskgroup->waiters)
+		pthread_cond_broadcast(&taskgroup->cond);
+	pthread_mutex_unlock(&taskgroup->mutex);
+}
+
+/*
+ * Run a task taken from the queues by @worker of the pool, or NULL for
+ * the threads out of the pool, and release it to the cache of @worker.
+ * The task will be released remotely if it's not from that cache.
+ */
+static void threadpool_run_task(struct wayca_threadpool_task *task,
+				struct wayca_threadpool_worker *worker)
+{
+	struct wayca_threadpool_taskgroup *taskgroup = task->taskgroup;
+	struct wayca_threadpool *pool = task->pool;
+	struct wayca_threadpool_stats *stats;
+	long long queued = task->queued;
+	long long start, end;
+
+	atomic_fetch_sub(task->topo ? &pool->local_num : &pool->task_num, 1);
+
+	start = threadpool_now_ns();
+	task->task(task->arg);
+	end = threadpool_now_ns();
+	/* The ones from the ring of a bounded pool have no descriptor */
+	if (task->cache)
+		threadpool_task_free(task, worker ? &worker->cache : NULL);
+
+	stats = worker ? &worker->stats : &pool->stats;
+	threadpool_stat_add(&stats->executed, 1, !worker);
+	threadpool_stat_add(&stats->wait_ns, max(start - queued, 0), !worker);
+	threadpool_stat_add(&stats->run_ns, end - start, !worker);
+	threadpool_hist_add(stats->wait_hist, max(start - queued, 0), !worker);
+	threadpool_hist_add(stats->run_hist, end - start, !worker);
+
+	if (taskgroup)
+		threadpool_taskgroup_done(taskgroup);
+}
+
+void *wayca_threadpool_worker_func(void *priv)
+{
+	struct wayca_threadpool_worker *worker = priv;
+	struct wayca_threadpool *pool = worker->pool;
+	struct wayca_threadpool_task *task, buf;
+
+	current_worker = worker;
+
+	while (!atomic_load(&pool->stop)) {
+		if (atomic_load_explicit(&pool->reclaim, memory_order_relaxed) &&
+		    atomic_exchange(&pool->reclaim, false))
+			wayca_threadpool_budget_reclaim(pool);
+
+		task = threadpool_worker_get_task(worker, &buf);
+		if (!task) {
+			if (threadpool_worker_idle(worker))
+				break;
+			continue;
+		}
+
+		/*
+		 * Mark ourselves busy before the task disappears from the
+		 * queue, so the pool never looks empty and idle while the
+		 * task is in flight.
+		 */
+		atomic_fetch_sub(&pool->idle_num, 1);
+		threadpool_run_task(task, worker);
+		/* Still counted busy, or we'd never see the pool saturated */
+		threadpool_check_grow(pool);
+		atomic_fetch_add(&pool->idle_num, 1);
+	}
+
+	current_worker = NULL;
+	return NULL;
+}
+
+/*
+ * Queue @num tasks to the ring of a WT_PF_BOUNDED pool. Either all or
+ * none of them are queued, return -EAGAIN if there isn't enough room.
+ */
+static int threadpool_ring_queue(struct wayca_threadpool *pool,
+				 struct wayca_threadpool_taskgroup *taskgroup,
+				 wayca_sc_threadpool_task_func *task_funcs,
+				 void **args, size_t num)
+{
+	long long now = threadpool_now_ns();
+	size_t pos;
+
+	if (!threadpool_ring_reserve(&pool->ring, num, &pos))
+		return -EAGAIN;
+
+	/* Counted before published, or the consumers may see it negative */
+	threadpool_taskgroup_add(taskgroup, num);
+	atomic_fetch_add(&pool->task_num, num);
+
+	for (size_t i = 0; i < num; i++)
+		threadpool_ring_fill(&pool->ring, pos + i, taskgroup, task_funcs[i],
+				     args ? args[i] : NULL, now);
+
+	return 0;
+}
+
+/* Whether the shared queue of a WT_PF_BOUNDED pool has no room for @num */
+static bool threadpool_shared_full(struct wayca_threadpool *pool, size_t num)
+{
+	return threadpool_ring_num(&pool->ring) + threadpool_shared_num(pool) + num >
+	       WAYCA_SC_THREADPOOL_RING_SIZE;
+}
+
+int wayca_threadpool_queue(struct wayca_threadpool *pool,
+			   struct wayca_threadpool_taskgroup *taskgroup, int prio,
+			   wayca_sc_threadpool_task_func task_func, void *arg)
+{
+	struct wayca_threadpool_worker *worker = current_worker;
+	struct wayca_threadpool_shard *shard;
+	struct wayca_threadpool_task *task;
+	int ret;
+
+	if (worker && worker->pool != pool)
+		worker = NULL;
+
+	/*
+	 * A bounded pool queues the tasks in the default priority to the
+	 * ring, unless they fit in the deque of the worker queueing them.
+	 * The others go to the list as usual, but still count against the
+	 * capacity, which is checked loosely against the racing producers.
+	 * The acquire pairs with the release in wayca_threadpool_set_attr(),
+	 * so the ring is seen allocated once the flag is.
+	 */
+	if (atomic_load_explicit(&pool->attribute, memory_order_acquire) &
+	    WT_PF_BOUNDED) {
+		if (prio != WAYCA_SC_THREADPOOL_PRIO_DEFAULT) {
+			if (threadpool_shared_full(pool, 1))
+				return -EAGAIN;
+		} else if (!worker || !threadpool_deque_room(&worker->deque)) {
+			ret = threadpool_ring_queue(pool, taskgroup, &task_func, &arg, 1);
+			if (!ret)
+				threadpool_wakeup(pool, 1);
+			return ret;
+		}
+	}
+
+	/*
+	 * Tasks queued by the workers of this pool go to the worker's own
+	 * deque without any lock. Others, the tasks overflowed from a
+	 * full deque, or the ones not in the default priority, go to the
+	 * shard of the shared queue on our node.
+	 */
+	shard = threadpool_local_shard(pool);
+	if (worker) {
+		task = threadpool_task_alloc(&worker->cache);
+		if (!task)
+			return -ENOMEM;
+
+		task->pool = pool;
+		task->task = task_func;
+		task->arg = arg;
+		task->taskgroup = taskgroup;
+		task->topo = 0;
+		task->queued = threadpool_now_ns();
+		threadpool_taskgroup_add(taskgroup, 1);
+
+		/* Counted before published, or a thief may take it below zero */
+		if (prio == WAYCA_SC_THREADPOOL_PRIO_DEFAULT) {
+			atomic_fetch_add(&pool->task_num, 1);
+			if (threadpool_deque_push(&worker->deque, task)) {
+				threadpool_wakeup(pool, 1);
+				return 0;
+			}
+			atomic_fetch_sub(&pool->task_num, 1);
+		}
+
+		pthread_mutex_lock(&shard->mutex);
+	} else {
+		pthread_mutex_lock(&shard->mutex);
+		task = threadpool_task_alloc(&shard->cache);
+		if (!task) {
+			pthread_mutex_unlock(&shard->mutex);
+			return -ENOMEM;
+		}
+
+		task->pool = pool;
+		task->task = task_func;
+		task->arg = arg;
+		task->taskgroup = taskgroup;
+		task->topo = 0;
+		task->queued = threadpool_now_ns();
+		threadpool_taskgroup_add(taskgroup, 1);
+	}
+
+	threadpool_prio_queue_task(&shard->queue, task, prio);
+	atomic_fetch_add(&pool->task_num, 1);
+	pthread_mutex_unlock(&shard->mutex);
+	threadpool_wakeup(pool, 1);
+
+	return 0;
+}
+
+/* Free the tasks linked from @first back to @cache */
+static void threadpool_task_free_batch(struct wayca_threadpool_task *first,
+				       struct wayca_threadpool_cache *cache)
+{
+	struct wayca_threadpool_task *task;
+
+	while (first) {
+		task = first;
+		first = task->next;
+		threadpool_task_free(task, cache);
+	}
+}
+
+/*
+ * Allocate @num tasks from @cache and link them by both next and prev,
+ * with the first and last one returned by @first and @last. Either
+ * all or none of the tasks are allocated. The caller accounts them to
+ * @taskgroup once they're sure to be queued.
+ */
+static int threadpool_task_alloc_batch(struct wayca_threadpool *pool,
+				       struct wayca_threadpool_taskgroup *taskgroup,
+				       struct wayca_threadpool_cache *cache,
+				       wayca_sc_threadpool_task_func *task_funcs,
+				       void **args, size_t num,
+				       struct wayca_threadpool_task **first,
+				       struct wayca_threadpool_task **last)
+{
+	struct wayca_threadpool_task *task, *prev = NULL;
+	long long now = threadpool_now_ns();
+
+	*first = NULL;
+	for (size_t i = 0; i < num; i++) {
+		task = threadpool_task_alloc(cache);
+		if (!task)
+			goto err;
+
+		task->pool = pool;
+		task->task = task_funcs[i];
+		task->arg = args ? args[i] : NULL;
+		task->taskgroup = taskgroup;
+		task->topo = 0;
+		task->queued = now;
+		task->prev = prev;
+		task->next = NULL;
+
+		if (prev)
+			prev->next = task;
+		else
+			*first = task;
+		prev = task;
+	}
+
+	*last = prev;
+	return 0;
+err:
+	threadpool_task_free_batch(*first, cache);
+	return -ENOMEM;
+}
+
+int wayca_threadpool_queue_batch(struct wayca_threadpool *pool,
+				 struct wayca_threadpool_taskgroup *taskgroup,
+				 wayca_sc_threadpool_task_func *task_funcs,
+				 void **args, size_t num)
+{
+	struct wayca_threadpool_worker *worker = current_worker;
+	struct wayca_threadpool_shard *shard;
+	struct wayca_threadpool_task *first, *last;
+	size_t pushed, left, room = num;
+	int ret;
+
+	if (worker && worker->pool != pool)
+		worker = NULL;
+
+	/* A bounded pool queues the tasks not fit in the deque to the ring */
+	if (atomic_load_explicit(&pool->attribute, memory_order_acquire) &
+	    WT_PF_BOUNDED) {
+		room = worker ? min(num, threadpool_deque_room(&worker->deque)) : 0;
+		if (!room) {
+			ret = threadpool_ring_queue(pool, taskgroup, task_funcs, args, num);
+			if (!ret)
+				threadpool_wakeup(pool, num);
+			return ret;
+		}
+	}
+
+	shard = threadpool_local_shard(pool);
+	if (worker) {
+		if (threadpool_task_alloc_batch(pool, taskgroup, &worker->cache,
+						task_funcs, args, room,
+						&first, &last))
+			return -ENOMEM;
+
+		if (room < num) {
+			ret = threadpool_ring_queue(pool, taskgroup, task_funcs + room,
+						    args ? args + room : NULL, num - room);
+			if (ret) {
+				threadpool_task_free_batch(first, &worker->cache);
+				return ret;
+			}
+		}
+
+		threadpool_taskgroup_add(taskgroup, room);
+
+		/* Counted before published, or the thieves may take it below zero */
+		atomic_fetch_add(&pool->task_num, room);
+		pushed = threadpool_deque_push_batch(&worker->deque, &first, room);
+		if (pushed == room) {
+			threadpool_wakeup(pool, num);
+			return 0;
+		}
+
+		/* Overflow the rest to the shared queue, counted there again */
+		left = room - pushed;
+		atomic_fetch_sub(&pool->task_num, left);
+		first->prev = NULL;
+		pthread_mutex_lock(&shard->mutex);
+	} else {
+		left = num;
+		pthread_mutex_lock(&shard->mutex);
+		if (threadpool_task_alloc_batch(pool, taskgroup, &shard->cache,
+						task_funcs, args, num,
+						&first, &last)) {
+			pthread_mutex_unlock(&shard->mutex);
+			return -ENOMEM;
+		}
+		threadpool_taskgroup_add(taskgroup, num);
+	}
+
+	threadpool_prio_queue_splice(&shard->queue, first, last, left,
+				     WAYCA_SC_THREADPOOL_PRIO_DEFAULT);
+	atomic_fetch_add(&pool->task_num, left);
+	pthread_mutex_unlock(&shard->mutex);
+	threadpool_wakeup(pool, num);
+
+	return 0;
+}
+
+/* Sleep until all the tasks of the taskgroup finished */
+static void threadpool_taskgroup_sleep(struct wayca_threadpool_taskgroup *taskgroup)
+{
+	pthread_mutex_lock(&taskgroup->mutex);
+	while (threadpool_taskgroup_pending(taskgroup)) {
+		taskgroup->waiters++;
+		pthread_cond_wait(&taskgroup->cond, &taskgroup->mutex);
+		taskgroup->waiters--;
+	}
+	pthread_mutex_unlock(&taskgroup->mutex);
+}
+
+void wayca_threadpool_taskgroup_init(struct wayca_threadpool_taskgroup *taskgroup,
+				     struct wayca_threadpool *pool)
+{
+	taskgroup->pool = pool;
+	taskgroup->waiters = 0;
+	atomic_init(&taskgroup->pending, 0);
+	atomic_init(&taskgroup->eventfd, -1);
+	pthread_mutex_init(&taskgroup->mutex, NULL);
+	pthread_cond_init(&taskgroup->cond, NULL);
+	atomic_fetch_add(&pool->taskgroup_num, 1);
+}
+
+int wayca_threadpool_taskgroup_eventfd(struct wayca_threadpool_taskgroup *taskgroup)
+{
+	int fd;
+
+	pthread_mutex_lock(&taskgroup->mutex);
+	fd = atomic_load(&taskgroup->eventfd);
+	if (fd < 0) {
+		fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (fd < 0) {
+			fd = -errno;
+		} else {
+			atomic_store(&taskgroup->eventfd, fd);
+			atomic_fetch_or(&taskgroup->pending, THREADPOOL_TASKGROUP_EVENTFD);
+		}
+	}
+	pthread_mutex_unlock(&taskgroup->mutex);
+
+	return fd;
+}
+
+int wayca_threadpool_taskgroup_fini(struct wayca_threadpool_taskgroup *taskgroup)
+{
+	pthread_mutex_lock(&taskgroup->mutex);
+	if (threadpool_taskgroup_pending(taskgroup)) {
+		pthread_mutex_unlock(&taskgroup->mutex);
+		return -EBUSY;
+	}
+	pthread_mutex_unlock(&taskgroup->mutex);
+
+	if (atomic_load(&taskgroup->eventfd) >= 0)
+		close(atomic_load(&taskgroup->eventfd));
+
+	pthread_cond_destroy(&taskgroup->cond);
+	pthread_mutex_destroy(&taskgroup->mutex);
+	atomic_fetch_sub(&taskgroup->pool->taskgroup_num, 1);
+
+	return 0;
+}
+
+void wayca_threadpool_wait(struct wayca_threadpool_taskgroup *taskgroup)
+{
+	struct wayca_threadpool_worker *worker = current_worker;
+	struct wayca_threadpool *pool = taskgroup->pool;
+	struct wayca_threadpool_task *task, buf;
+
+	if (worker && worker->pool != pool)
+		worker = NULL;
+
+	/*
+	 * Help to run the tasks rather than sleeping, any task of the pool
+	 * will do as it makes progress for the others. A worker is already
+	 * accounted busy while running the task calling us.
+	 */
+	while (threadpool_taskgroup_pending(taskgroup)) {
+		if (worker)
+			task = threadpool_worker_get_task(worker, &buf);
+		else
+			task = threadpool_helper_get_task(pool, &buf);
+
+		if (!task)
+			break;
+
+		threadpool_run_task(task, worker);
+	}
+
+	/*
+	 * Nothing left to help, the remaining tasks are running on the
+	 * other threads. Sleep until the last one finished.
+	 */
+	threadpool_taskgroup_sleep(taskgroup);
+}
+
+static void threadpool_graph_node_func(void *arg)
+{
+	struct wayca_threadpool_graph_node *node = arg, *succ, *next;
+	struct wayca_threadpool_taskgraph *graph = node->graph;
+
+	while (node) {
+		node->task(node->arg);
+
+		/*
+		 * Go on with the first successor ready on this thread, as
+		 * the data it consumes is likely still in our cache. The
+		 * others go to our deque, to be stolen by the nearest idle
+		 * workers if we're busy.
+		 */
+		next = NULL;
+		for (size_t i = 0; i < node->succ_num; i++) {
+			succ = &graph->nodes[node->succs[i]];
+			if (atomic_fetch_sub(&succ->pending, 1) != 1)
+				continue;
+
+			if (!next) {
+				next = succ;
+				continue;
+			}
+
+			if (wayca_threadpool_queue(graph->taskgroup.pool, &graph->taskgroup,
+						   WAYCA_SC_THREADPOOL_PRIO_DEFAULT,
+						   threadpool_graph_node_func, succ))
+				threadpool_graph_node_func(succ);
+		}
+
+		node = next;
+	}
+}
+
+void wayca_threadpool_taskgraph_init(struct wayca_threadpool_taskgraph *graph,
+				     struct wayca_threadpool *pool)
+{
+	graph->nodes = NULL;
+	graph->node_num = 0;
+	graph->node_size = 0;
+	graph->checked = true;
+	pthread_mutex_init(&graph->mutex, NULL);
+	wayca_threadpool_taskgroup_init(&graph->taskgroup, pool);
+}
+
+int wayca_threadpool_taskgraph_fini(struct wayca_threadpool_taskgraph *graph)
+{
+	int ret;
+
+	pthread_mutex_lock(&graph->mutex);
+	ret = wayca_threadpool_taskgroup_fini(&graph->taskgroup);
+	pthread_mutex_unlock(&graph->mutex);
+	if (ret)
+		return ret;
+
+	for (size_t i = 0; i < graph->node_num; i++)
+		free(graph->nodes[i].succs);
+	free(graph->nodes);
+	pthread_mutex_destroy(&graph->mutex);
+
+	return 0;
+}
+
+ssize_t wayca_threadpool_taskgraph_add_task(struct wayca_threadpool_taskgraph *graph,
+					    wayca_sc_threadpool_task_func task_func,
+					    void *arg)
+{
+	struct wayca_threadpool_graph_node *node;
+	ssize_t ret;
+
+	pthread_mutex_lock(&graph->mutex);
+	if (threadpool_taskgroup_pending(&graph->taskgroup)) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	if (graph->node_num == graph->node_size) {
+		size_t size = max(graph->node_size * 2, 16);
+
+		node = realloc(graph->nodes, size * sizeof(*node));
+		if (!node) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		graph->nodes = node;
+		graph->node_size = size;
+	}
+
+	node = &graph->nodes[graph->node_num];
+	node->graph = graph;
+	node->task = task_func;
+	node->arg = arg;
+	node->succs = NULL;
+	node->succ_num = 0;
+	node->succ_size = 0;
+	node->dep_num = 0;
+	atomic_init(&node->pending, 0);
+	ret = graph->node_num++;
+out:
+	pthread_mutex_unlock(&graph->mutex);
+	return ret;
+}
+
+int wayca_threadpool_taskgraph_add_edge(struct wayca_threadpool_taskgraph *graph,
+					size_t from, size_t to)
+{
+	struct wayca_threadpool_graph_node *node;
+	int ret = 0;
+
+	pthread_mutex_lock(&graph->mutex);
+	if (threadpool_taskgroup_pending(&graph->taskgroup)) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	if (from >= graph->node_num || to >= graph->node_num || from == to) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	node = &graph->nodes[from];
+	if (node->succ_num == node->succ_size) {
+		size_t size = max(node->succ_size * 2, 4);
+		size_t *succs = realloc(node->succs, size * sizeof(*succs));
+
+		if (!succs) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		node->succs = succs;
+		node->succ_size = size;
+	}
+
+	node->succs[node->succ_num++] = to;
+	graph->nodes[to].dep_num++;
+	graph->checked = false;
+out:
+	pthread_mutex_unlock(&graph->mutex);
+	return ret;
+}
+
+/*
+ * Check the dependencies make no cycle by Kahn's algorithm, which
+ * can visit all the tasks by removing the ones depending on nothing
+ * only if there's no cycle.
+ */
+static int threadpool_taskgraph_check(struct wayca_threadpool_taskgraph *graph)
+{
+	struct wayca_threadpool_graph_node *node;
+	size_t num = graph->node_num;
+	size_t *deps, *ready;
+	size_t head = 0, tail = 0;
+
+	deps = malloc(num * 2 * sizeof(size_t));
+	if (!deps)
+		return -ENOMEM;
+	ready = deps + num;
+
+	for (size_t i = 0; i < num; i++) {
+		deps[i] = graph->nodes[i].dep_num;
+		if (!deps[i])
+			ready[tail++] = i;
+	}
+
+	while (head < tail) {
+		node = &graph->nodes[ready[head++]];
+		for (size_t i = 0; i < node->succ_num; i++)
+			if (!--deps[node->succs[i]])
+				ready[tail++] = node->succs[i];
+	}
+
+	free(deps);
+	if (tail != num)
+		return -EINVAL;
+
+	graph->checked = true;
+	return 0;
+}
+
+int wayca_threadpool_taskgraph_run(struct wayca_threadpool_taskgraph *graph)
+{
+	struct wayca_threadpool_taskgroup *taskgroup = &graph->taskgroup;
+	struct wayca_threadpool_graph_node *node;
+	int ret = 0;
+
+	pthread_mutex_lock(&graph->mutex);
+	if (threadpool_taskgroup_pending(taskgroup)) {
+		pthread_mutex_unlock(&graph->mutex);
+		return -EBUSY;
+	}
+
+	if (!graph->checked)
+		ret = threadpool_taskgraph_check(graph);
+	if (ret || !graph->node_num) {
+		pthread_mutex_unlock(&graph->mutex);
+		return ret;
+	}
+
+	for (size_t i = 0; i < graph->node_num; i++)
+		atomic_store_explicit(&graph->nodes[i].pending, graph->nodes[i].dep_num,
+				      memory_order_relaxed);
+
+	/*
+	 * Hold the graph running until all the roots are queued, so no
+	 * one can change or restart it after we drop the mutex. The tasks
+	 * may call into the graph, which we must not block.
+	 */
+	threadpool_taskgroup_add(taskgroup, 1);
+	pthread_mutex_unlock(&graph->mutex);
+
+	for (size_t i = 0; i < graph->node_num; i++) {
+		node = &graph->nodes[i];
+		if (node->dep_num)
+			continue;
+
+		if (wayca_threadpool_queue(taskgroup->pool, taskgroup,
+					   WAYCA_SC_THREADPOOL_PRIO_DEFAULT,
+					   threadpool_graph_node_func, node))
+			threadpool_graph_node_func(node);
+	}
+
+	threadpool_taskgroup_done(taskgroup);
+	return 0;
+}
+
+/*
+ * Queue a task to the inbox of the @target worker, which must run in
+ * the topology domain @topo with the id @id if @topo is not 0. The
+ * caller should wake up the workers.
+ */
+static int threadpool_queue_inbox(struct wayca_threadpool *pool,
+				  struct wayca_threadpool_taskgroup *taskgroup,
+				  struct wayca_threadpool_worker *target,
+				  wayca_sc_group_attr_t topo, int id,
+				  wayca_sc_threadpool_task_func task_func,
+				  void *arg)
+{
+	struct wayca_threadpool_worker *worker = current_worker;
+	struct wayca_threadpool_shard *shard;
+	struct wayca_threadpool_task *task;
+
+	if (worker && worker->pool == pool) {
+		task = threadpool_task_alloc(&worker->cache);
+	} else {
+		shard = threadpool_local_shard(pool);
+		pthread_mutex_lock(&shard->mutex);
+		task = threadpool_task_alloc(&shard->cache);
+		pthread_mutex_unlock(&shard->mutex);
+	}
+	if (!task)
+		return -ENOMEM;
+
+	task->pool = pool;
+	task->task = task_func;
+	task->arg = arg;
+	task->taskgroup = taskgroup;
+	task->topo = topo;
+	task->topo_id = id;
+	task->queued = threadpool_now_ns();
+	threadpool_taskgroup_add(taskgroup, 1);
+	atomic_fetch_add(topo ? &pool->local_num : &pool->task_num, 1);
+
+	pthread_mutex_lock(&target->inbox_mutex);
+	threadpool_queue_task(&target->inbox, task);
+	pthread_mutex_unlock(&target->inbox_mutex);
+
+	return 0;
+}
+
+/*
+ * Pick the live worker in the topology domain @topo with the id @id
+ * with the fewest tasks in its inbox, preferring the current worker
+ * @self on a tie. Return NULL if no worker is in the domain.
+ */
+static struct wayca_threadpool_worker *
+threadpool_pick_in(struct wayca_threadpool *pool,
+		   struct wayca_threadpool_worker *self,
+		   wayca_sc_group_attr_t topo, int id)
+{
+	struct wayca_threadpool_worker *worker, *target = NULL;
+	size_t num = pool->max_worker_num;
+	size_t start;
+
+	if (self && atomic_load(&self->live) && threadpool_worker_in(self, topo, id))
+		target = self;
+
+	start = rand_r(&helper_seed) % num;
+	for (size_t i = 0; i < num; i++) {
+		worker = &pool->workers[(start + i) % num];
+		if (!atomic_load(&worker->live) ||
+		    !threadpool_worker_in(worker, topo, id))
+			continue;
+
+		if (!target || atomic_load_explicit(&worker->inbox.num, memory_order_relaxed) <
+			       atomic_load_explicit(&target->inbox.num, memory_order_relaxed))
+			target = worker;
+	}
+
+	return target;
+}
+
+/*
+ * Move the tasks in the inbox of the retired @worker to the live
+ * workers. The located tasks go to another worker in their domains,
+ * or the shared queue if there's none, as do the others.
+ */
+static void threadpool_inbox_rescue(struct wayca_threadpool *pool,
+				    struct wayca_threadpool_worker *worker)
+{
+	struct wayca_threadpool_shard *shard = threadpool_local_shard(pool);
+	struct wayca_threadpool_worker *target;
+	struct wayca_threadpool_task *task;
+	size_t moved = 0;
+
+	while ((task = threadpool_inbox_take(worker, worker))) {
+		if (task->topo) {
+			target = threadpool_pick_in(pool, NULL, task->topo,
+						    task->topo_id);
+			if (target) {
+				pthread_mutex_lock(&target->inbox_mutex);
+				threadpool_queue_task(&target->inbox, task);
+				pthread_mutex_unlock(&target->inbox_mutex);
+
+				/* The target may have retired meanwhile */
+				if (!atomic_load(&target->live))
+					threadpool_inbox_rescue(pool, target);
+				else
+					threadpool_unpark(pool, target);
+				continue;
+			}
+
+			/* Nowhere in the domain to go, run it anywhere */
+			atomic_fetch_add(&pool->task_num, 1);
+			atomic_fetch_sub(&pool->local_num, 1);
+			task->topo = 0;
+		}
+
+		pthread_mutex_lock(&shard->mutex);
+		threadpool_prio_queue_task(&shard->queue, task,
+					   WAYCA_SC_THREADPOOL_PRIO_DEFAULT);
+		pthread_mutex_unlock(&shard->mutex);
+		moved++;
+	}
+
+	if (moved)
+		threadpool_wakeup(pool, moved);
+}
+
+int wayca_threadpool_queue_on(struct wayca_threadpool *pool,
+			      wayca_sc_group_attr_t topo, int id,
+			      wayca_sc_threadpool_task_func task_func, void *arg)
+{
+	struct wayca_threadpool_worker *self = current_worker;
+	struct wayca_threadpool_worker *worker, *target;
+	int ret;
+
+	if (self && self->pool != pool)
+		self = NULL;
+
+	target = threadpool_pick_in(pool, self, topo, id);
+	if (!target)
+		return -ENOENT;
+
+	ret = threadpool_queue_inbox(pool, NULL, target, topo, id, task_func, arg);
+	if (ret)
+		return ret;
+
+	/* The target retired before seeing the task, move it elsewhere */
+	if (!atomic_load(&target->live)) {
+		threadpool_inbox_rescue(pool, target);
+		return 0;
+	}
+
+	threadpool_budget_reclaim(pool);
+	if (target == self || threadpool_unpark(pool, target))
+		return 0;
+
+	/* The target is busy, anyone idle in the domain can steal it */
+	for (size_t i = 0; i < pool->max_worker_num && atomic_load(&pool->sleep_num); i++) {
+		worker = &pool->workers[i];
+		if (atomic_load(&worker->live) &&
+		    threadpool_worker_in(worker, topo, id) &&
+		    threadpool_unpark(pool, worker))
+			break;
+	}
+
+	return 0;
+}
+
+/* A contiguous block of the range of parallel_for, owned by a worker */
+struct threadpool_range {
+	/* The next index to process, claimed by the owner and the thieves */
+	_Atomic size_t next;
+	/* The end of this block */
+	size_t end;
+	/* The parallel_for this block belongs to */
+	struct threadpool_range_job *job;
+} __cacheline_aligned;
+
+struct threadpool_range_job {
+	struct wayca_threadpool *pool;
+	wayca_sc_parallel_for_func func;
+	void *ctx;
+	size_t grain;
+	/* The blocks indexed by the owner worker's index */
+	struct threadpool_range *ranges;
+	size_t num;
+	struct wayca_threadpool_taskgroup taskgroup;
+};
+
+/* Claim the next grain of @range, return false if it's exhausted */
+static bool threadpool_range_claim(struct threadpool_range *range, size_t grain,
+				   size_t *begin, size_t *end)
+{
+	size_t next = atomic_load_explicit(&range->next, memory_order_relaxed);
+
+	do {
+		if (next >= range->end)
+			return false;
+
+		*begin = next;
+		*end = range->end - next > grain ? next + grain : range->end;
+	} while (!atomic_compare_exchange_weak_explicit(&range->next, &next, *end,
+							memory_order_relaxed,
+							memory_order_relaxed));
+
+	return true;
+}
+
+static void threadpool_range_drain(struct threadpool_range_job *job,
+				   struct threadpool_range *range)
+{
+	size_t begin, end;
+
+	while (threadpool_range_claim(range, job->grain, &begin, &end))
+		job->func(begin, end, job->ctx);
+}
+
+/*
+ * Process the block @range first, then help the blocks of the others.
+ * A worker helps its victims in order, the ones sharing the cluster
+ * with it first, so the stolen indexes are likely still in the shared
+ * caches.
+ */
+static void threadpool_range_run(struct threadpool_range *range)
+{
+	struct threadpool_range_job *job = range->job;
+	struct wayca_threadpool_worker *worker = current_worker;
+	struct wayca_threadpool *pool = job->pool;
+	size_t start = range - job->ranges;
+
+	threadpool_range_drain(job, range);
+
+	if (worker && worker->pool == pool && atomic_load(&pool->victims_ready)) {
+		threadpool_range_drain(job, &job->ranges[worker->index]);
+		for (int i = 0; i < worker->level_end[THREADPOOL_STEAL_LEVELS - 1]; i++)
+			threadpool_range_drain(job, &job->ranges[worker->victims[i]]);
+		return;
+	}
+
+	for (size_t i = 1; i < job->num; i++)
+		threadpool_range_drain(job, &job->ranges[(start + i) % job->num]);
+}
+
+static void threadpool_range_func(void *arg)
+{
+	threadpool_range_run(arg);
+}
+
+int wayca_threadpool_parallel_for(struct wayca_threadpool *pool,
+				  size_t begin, size_t end, size_t grain,
+				  wayca_sc_parallel_for_func func, void *ctx)
+{
+	struct wayca_threadpool_worker *worker = current_worker;
+	struct threadpool_range_job job;
+	size_t total = end - begin;
+	size_t grains, base, rem, first, workers;
+	size_t queued = 0;
+	int ret;
+
+	if (worker && worker->pool != pool)
+		worker = NULL;
+
+	job.pool = pool;
+	job.func = func;
+	job.ctx = ctx;
+	job.num = pool->max_worker_num;
+
+	ret = posix_memalign((void **)&job.ranges, WAYCA_SC_CACHELINE_SIZE,
+			     job.num * sizeof(struct threadpool_range));
+	if (ret)
+		return -ret;
+
+	for (size_t i = 0; i < job.num; i++) {
+		job.ranges[i].job = &job;
+		atomic_init(&job.ranges[i].next, end);
+		job.ranges[i].end = end;
+	}
+
+	/* Keep the workers and their order stable while assigning blocks */
+	pthread_mutex_lock(&pool->resize_mutex);
+	workers = atomic_load(&pool->total_worker_num);
+
+	/* Leave each worker a few grains to balance by default */
+	if (!grain)
+		grain = max(total / (max(workers, 1) * 4), 1);
+	job.grain = grain;
+
+	/* Nothing to parallel, or the pool has no worker to run them */
+	if (total <= grain || !workers || !atomic_load(&pool->victims_ready)) {
+		pthread_mutex_unlock(&pool->resize_mutex);
+		free(job.ranges);
+		func(begin, end, ctx);
+		return 0;
+	}
+
+	/*
+	 * The k-th block goes to the k-th worker in the topology order, so
+	 * that adjacent blocks run on the workers sharing the caches. The
+	 * mapping is the same for the same range on the same pool, so the
+	 * data first touched by a worker will be processed by it again.
+	 */
+	grains = total / grain + !!(total % grain);
+	base = grains / workers;
+	rem = grains % workers;
+	first = 0;
+	for (size_t k = 0; k < workers; k++) {
+		struct threadpool_range *range = &job.ranges[pool->order[k]];
+		size_t cnt = base + (k < rem);
+
+		atomic_init(&range->next, begin + min(first * grain, total));
+		range->end = begin + min((first + cnt) * grain, total);
+		first += cnt;
+	}
+	pthread_mutex_unlock(&pool->resize_mutex);
+
+	wayca_threadpool_taskgroup_init(&job.taskgroup, pool);
+
+	for (size_t i = 0; i < job.num; i++) {
+		struct threadpool_range *range = &job.ranges[i];
+
+		if (range->next == range->end ||
+		    (worker && worker->index == i))
+			continue;
+
+		if (threadpool_queue_inbox(pool, &job.taskgroup, &pool->workers[i],
+					   0, 0, threadpool_range_func, range))
+			continue;
+
+		queued++;
+		if (!atomic_load(&pool->workers[i].live))
+			threadpool_inbox_rescue(pool, &pool->workers[i]);
+	}
+
+	if (queued)
+		threadpool_wakeup(pool, queued);
+
+	/*
+	 * A worker processes its own block and helps the others, then
+	 * waits for the rest like a task. Other callers help the blocks
+	 * after they're queued, so the range goes on while the workers
+	 * are busy, and those not queued are run too, then sleep.
+	 */
+	if (worker) {
+		threadpool_range_run(&job.ranges[worker->index]);
+		wayca_threadpool_wait(&job.taskgroup);
+	} else {
+		threadpool_range_run(&job.ranges[0]);
+		threadpool_taskgroup_sleep(&job.taskgroup);
+	}
+
+	wayca_threadpool_taskgroup_fini(&job.taskgroup);
+	free(job.ranges);
+
+	return 0;
+}
+
+/* Whether worker @a is placed before worker @b in the topology */
+static bool threadpool_worker_before(struct wayca_threadpool_worker *a,
+				     struct wayca_threadpool_worker *b)
+{
+	if (a->package != b->package)
+		return a->package < b->package;
+	if (a->node != b->node)
+		return a->node < b->node;
+	if (a->ccl != b->ccl)
+		return a->ccl < b->ccl;
+	if (a->cpu != b->cpu)
+		return a->cpu < b->cpu;
+
+	return a->index < b->index;
+}
+
+void wayca_threadpool_build_victims(struct wayca_threadpool *pool)
+{
+	size_t num = pool->max_worker_num;
+	struct wayca_threadpool_worker *worker, *victim;
+	int cpu, level, cnt, total = 0;
+	size_t shard_workers[pool->shard_num];
+
+	memset(shard_workers, 0, sizeof(shard_workers));
+	for (int i = 0; i < num; i++) {
+		worker = &pool->workers[i];
+		if (!atomic_load(&worker->live))
+			continue;
+
+		cpu = cpuset_find_first_set(&worker->thread->cur_set);
+		worker->cpu = cpu;
+		worker->ccl = wayca_sc_get_ccl_id(cpu);
+		worker->node = wayca_sc_get_node_id(cpu);
+		worker->package = wayca_sc_get_package_id(cpu);
+		worker->cache.node = worker->node;
+		if (worker->node >= 0)
+			shard_workers[worker->node % pool->shard_num]++;
+	}
+
+	for (size_t i = 0; i < pool->shard_num; i++) {
+		atomic_store(&pool->shards[i].worker_num, shard_workers[i]);
+		if (pool->shard_num > 1)
+			pool->shards[i].cache.node = i;
+	}
+
+	/*
+	 * The lists are updated in place when the pool is resized, a
+	 * thief racing with us may visit a retired worker or miss a new
+	 * one, which is harmless.
+	 */
+	for (int i = 0; i < num; i++) {
+		worker = &pool->workers[i];
+		if (!atomic_load(&worker->live))
+			continue;
+
+		cnt = 0;
+		for (level = 0; level < THREADPOOL_STEAL_LEVELS; level++) {
+			for (int j = 0; j < num; j++) {
+				victim = &pool->workers[j];
+				if (victim == worker || !atomic_load(&victim->live) ||
+				    threadpool_steal_level(worker, victim) != level)
+					continue;
+
+				worker->victims[cnt++] = j;
+			}
+
+			worker->level_end[level] = cnt;
+		}
+	}
+
+	/* Insertion sort, the workers are mostly placed in order already */
+	for (int i = 0; i < num; i++) {
+		int j;
+
+		if (!atomic_load(&pool->workers[i].live))
+			continue;
+
+		for (j = total; j > 0; j--) {
+			if (!threadpool_worker_before(&pool->workers[i],
+						      &pool->workers[pool->order[j - 1]]))
+				break;
+			pool->order[j] = pool->order[j - 1];
+		}
+		pool->order[j] = i;
+		total++;
+	}
+
+	atomic_store(&pool->victims_ready, true);
+}
+
+void wayca_threadpool_get_steals(struct wayca_threadpool *pool,
+				 struct wayca_sc_threadpool_steals *steals)
+{
+	unsigned long long sum[THREADPOOL_STEAL_LEVELS] = { 0 };
+
+	for (int i = 0; i < pool->max_worker_num; i++)
+		for (int level = 0; level < THREADPOOL_STEAL_LEVELS; level++)
+			sum[level] += atomic_load_explicit(&pool->workers[i].steals[level],
+							   memory_order_relaxed);
+
+	steals->ccl = sum[THREADPOOL_STEAL_CCL];
+	steals->node = sum[THREADPOOL_STEAL_NODE];
+	steals->package = sum[THREADPOOL_STEAL_PACKAGE];
+	steals->remote = sum[THREADPOOL_STEAL_REMOTE];
+}
+
+/*
+ * Estimate the time of the @permille-th of the @num samples from the
+ * log2 histogram @hist, interpolating in the bucket it falls in.
+ */
+static unsigned long long threadpool_hist_percentile(unsigned long long *hist,
+						     unsigned long long num,
+						     unsigned int permille)
+{
+	unsigned long long rank = div_round_up(num * permille, 1000);
+	unsigned long long cnt = 0, low, high;
+
+	for (int i = 0; i < THREADPOOL_HIST_BUCKETS && rank; i++) {
+		if (cnt + hist[i] < rank) {
+			cnt += hist[i];
+			continue;
+		}
+
+		low = i ? 1ULL << (i - 1) : 0;
+		high = i ? 1ULL << i : 0;
+		return low + (unsigned long long)((double)(high - low) *
+						  (rank - cnt) / hist[i]);
+	}
+
+	return 0;
+}
+
+/* The sum of struct wayca_threadpool_stats read from the threads */
+struct threadpool_stats_snapshot {
+	unsigned long long executed, parks, wait_ns, run_ns;
+	unsigned long long wait_num, run_num;
+	unsigned long long wait_hist[THREADPOOL_HIST_BUCKETS];
+	unsigned long long run_hist[THREADPOOL_HIST_BUCKETS];
+};
+
+static void threadpool_stats_sum(struct threadpool_stats_snapshot *sum,
+				 struct wayca_threadpool_stats *stats)
+{
+	unsigned long long cnt;
+
+	sum->executed += atomic_load_explicit(&stats->executed, memory_order_relaxed);
+	sum->parks += atomic_load_explicit(&stats->parks, memory_order_relaxed);
+	sum->wait_ns += atomic_load_explicit(&stats->wait_ns, memory_order_relaxed);
+	sum->run_ns += atomic_load_explicit(&stats->run_ns, memory_order_relaxed);
+
+	for (int i = 0; i < THREADPOOL_HIST_BUCKETS; i++) {
+		cnt = atomic_load_explicit(&stats->wait_hist[i], memory_order_relaxed);
+		sum->wait_hist[i] += cnt;
+		sum->wait_num += cnt;
+
+		cnt = atomic_load_explicit(&stats->run_hist[i], memory_order_relaxed);
+		sum->run_hist[i] += cnt;
+		sum->run_num += cnt;
+	}
+}
+
+void wayca_threadpool_get_stats(struct wayca_threadpool *pool,
+				struct wayca_sc_threadpool_stats *stats)
+{
+	struct threadpool_stats_snapshot sum = { 0 };
+	struct wayca_sc_threadpool_steals steals;
+
+	for (int i = 0; i < pool->max_worker_num; i++)
+		threadpool_stats_sum(&sum, &pool->workers[i].stats);
+	threadpool_stats_sum(&sum, &pool->stats);
+
+	wayca_threadpool_get_steals(pool, &steals);
+
+	stats->executed = sum.executed;
+	stats->steals = steals.ccl + steals.node + steals.package + steals.remote;
+	stats->parks = sum.parks;
+	stats->wait_avg = sum.executed ? sum.wait_ns / sum.executed : 0;
+	stats->wait_p50 = threadpool_hist_percentile(sum.wait_hist, sum.wait_num, 500);
+	stats->wait_p99 = threadpool_hist_percentile(sum.wait_hist, sum.wait_num, 990);
+	stats->wait_p999 = threadpool_hist_percentile(sum.wait_hist, sum.wait_num, 999);
+	stats->run_avg = sum.executed ? sum.run_ns / sum.executed : 0;
+	stats->run_p50 = threadpool_hist_percentile(sum.run_hist, sum.run_num, 500);
+	stats->run_p99 = threadpool_hist_percentile(sum.run_hist, sum.run_num, 990);
+	stats->run_p999 = threadpool_hist_percentile(sum.run_hist, sum.run_num, 999);
+}
+
+/*
+ * Link @timer into the wheel, in the lowest level where the ticks to
+ * its expiry fit. The ones beyond the wheel are put at the top, and
+ * will be added again when they come out there.
+ */
+static void threadpool_timer_add(struct wayca_threadpool_timers *timers,
+				 struct wayca_threadpool_timer *timer)
+{
+	unsigned long long expires = max(timer->expires, timers->jiffies);
+	unsigned long long span = 1ULL << (THREADPOOL_TIMER_SLOT_BITS *
+					   THREADPOOL_TIMER_LEVELS);
+	int level, slot;
+
+	if (expires - timers->jiffies >= span)
+		expires = timers->jiffies + span - 1;
+
+	for (level = 0; level < THREADPOOL_TIMER_LEVELS - 1; level++)
+		if (!((expires - timers->jiffies) >>
+		      (THREADPOOL_TIMER_SLOT_BITS * (level + 1))))
+			break;
+
+	slot = (expires >> (THREADPOOL_TIMER_SLOT_BITS * level)) &
+	       (THREADPOOL_TIMER_SLOTS - 1);
+	timer->next = timers->wheel[level][slot];
+	timers->wheel[level][slot] = timer;
+	timers->bitmap[level] |= 1ULL << slot;
+}
+
+/* Unlink all the timers in a slot of the wheel */
+static struct wayca_threadpool_timer *
+threadpool_timer_take(struct wayca_threadpool_timers *timers, int level, int slot)
+{
+	struct wayca_threadpool_timer *timer = timers->wheel[level][slot];
+
+	timers->wheel[level][slot] = NULL;
+	timers->bitmap[level] &= ~(1ULL << slot);
+	return timer;
+}
+
+/*
+ * The next tick where a timer expires or moves down a level. A slot
+ * of level 0 expires at its tick, and a slot of a higher level moves
+ * down at the first tick it covers, so the current one has moved down
+ * already unless we're just at its first tick.
+ */
+static unsigned long long threadpool_timer_next(struct wayca_threadpool_timers *timers)
+{
+	unsigned long long next = ULLONG_MAX, bits, pos;
+	int shift, start;
+
+	for (int level = 0; level < THREADPOOL_TIMER_LEVELS; level++) {
+		bits = timers->bitmap[level];
+		if (!bits)
+			continue;
+
+		shift = THREADPOOL_TIMER_SLOT_BITS * level;
+		pos = timers->jiffies >> shift;
+		if (timers->jiffies & ((1ULL << shift) - 1))
+			pos++;
+
+		start = pos & (THREADPOOL_TIMER_SLOTS - 1);
+		if (start)
+			bits = (bits >> start) | (bits << (THREADPOOL_TIMER_SLOTS - start));
+
+		next = min(next, (pos + __builtin_ctzll(bits)) << shift);
+	}
+
+	return next;
+}
+
+/* Arm the timerfd for @tick, or disarm it if @tick is ULLONG_MAX */
+static void threadpool_timer_arm(struct wayca_threadpool_timers *timers,
+				 unsigned long long tick)
+{
+	struct itimerspec spec = { 0 };
+	long long ns;
+
+	if (tick == timers->armed)
+		return;
+
+	if (tick != ULLONG_MAX) {
+		ns = timers->base + tick * WAYCA_SC_THREADPOOL_TIMER_TICK_NS;
+		spec.it_value.tv_sec = ns / 1000000000;
+		spec.it_value.tv_nsec = ns % 1000000000;
+	}
+
+	timerfd_settime(timers->fd, TFD_TIMER_ABSTIME, &spec, NULL);
+	timers->armed = tick;
+}
+
+/*
+ * Process the tick @timers->jiffies: move the timers down from the
+ * higher levels wrapping around, then queue the due tasks to the pool.
+ * The periodic ones are added back for the next period, and the ones
+ * failed to queue are retried at the next tick.
+ */
+static void threadpool_timer_tick(struct wayca_threadpool *pool)
+{
+	struct wayca_threadpool_timers *timers = &pool->timers;
+	unsigned long long tick = timers->jiffies;
+	struct wayca_threadpool_timer *timer, *next;
+	int slot = tick & (THREADPOOL_TIMER_SLOTS - 1);
+
+	for (int level = 1, pos = slot; !pos && level < THREADPOOL_TIMER_LEVELS; level++) {
+		pos = (tick >> (THREADPOOL_TIMER_SLOT_BITS * level)) &
+		      (THREADPOOL_TIMER_SLOTS - 1);
+		for (timer = threadpool_timer_take(timers, level, pos); timer; timer = next) {
+			next = timer->next;
+			threadpool_timer_add(timers, timer);
+		}
+	}
+
+	for (timer = threadpool_timer_take(timers, 0, slot); timer; timer = next) {
+		next = timer->next;
+
+		/* Parked at the top for being beyond the wheel */
+		if (timer->expires > tick) {
+			threadpool_timer_add(timers, timer);
+			continue;
+		}
+
+		if (wayca_threadpool_queue(pool, NULL, WAYCA_SC_THREADPOOL_PRIO_DEFAULT,
+					   timer->task, timer->arg)) {
+			timer->expires = tick + 1;
+			threadpool_timer_add(timers, timer);
+			continue;
+		}
+
+		if (!timer->period) {
+			free(timer);
+			continue;
+		}
+
+		/* Skip the periods missed */
+		timer->expires += timer->period;
+		if (timer->expires <= tick)
+			timer->expires = tick + timer->period;
+		threadpool_timer_add(timers, timer);
+	}
+}
+
+/*
+ * The timer thread of a pool. It catches the wheel up with the clock,
+ * skipping the ticks where nothing happens, and sleeps on the timerfd
+ * until the next tick where something does.
+ */
+static void *threadpool_timer_func(void *priv)
+{
+	struct wayca_threadpool *pool = priv;
+	struct wayca_threadpool_timers *timers = &pool->timers;
+	unsigned long long now, next, expirations;
+
+	pthread_mutex_lock(&timers->mutex);
+	while (!atomic_load(&pool->stop)) {
+		now = (threadpool_now_ns() - timers->base) /
+		      WAYCA_SC_THREADPOOL_TIMER_TICK_NS;
+		while (timers->jiffies <= now) {
+			next = threadpool_timer_next(timers);
+			if (next > now) {
+				timers->jiffies = now + 1;
+				break;
+			}
+
+			timers->jiffies = next;
+			threadpool_timer_tick(pool);
+			timers->jiffies++;
+		}
+
+		threadpool_timer_arm(timers, threadpool_timer_next(timers));
+		pthread_mutex_unlock(&timers->mutex);
+
+		/* Woken up by the expiry, or rearmed for an earlier timer */
+		if (read(timers->fd, &expirations, sizeof(expirations)) < 0 &&
+		    errno != EINTR)
+			return NULL;
+
+		pthread_mutex_lock(&timers->mutex);
+	}
+	pthread_mutex_unlock(&timers->mutex);
+
+	return NULL;
+}
+
+/* Create the timerfd and the timer thread, under @timers->mutex */
+static int threadpool_timers_start(struct wayca_threadpool *pool)
+{
+	struct wayca_threadpool_timers *timers = &pool->timers;
+	int ret;
+
+	timers->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (timers->fd < 0)
+		return -errno;
+
+	timers->base = threadpool_now_ns();
+	timers->jiffies = 0;
+	timers->armed = ULLONG_MAX;
+
+	ret = pthread_create(&timers->thread, NULL, threadpool_timer_func, pool);
+	if (ret) {
+		close(timers->fd);
+		timers->fd = -1;
+		return -ret;
+	}
+
+	return 0;
+}
+
+int wayca_threadpool_queue_after(struct wayca_threadpool *pool,
+				 unsigned long long ns, unsigned long long period,
+				 wayca_sc_threadpool_task_func task_func, void *arg,
+				 wayca_sc_timer_t *id)
+{
+	struct wayca_threadpool_timers *timers = &pool->timers;
+	struct wayca_threadpool_timer *timer;
+	unsigned long long next;
+	int ret;
+
+	timer = malloc(sizeof(*timer));
+	if (!timer)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&timers->mutex);
+	if (timers->fd < 0) {
+		ret = threadpool_timers_start(pool);
+		if (ret) {
+			pthread_mutex_unlock(&timers->mutex);
+			free(timer);
+			return ret;
+		}
+	}
+
+	/* Rounded up, never expires earlier than asked */
+	timer->id = timers->next_id++;
+	timer->task = task_func;
+	timer->arg = arg;
+	timer->expires = div_round_up(threadpool_now_ns() - timers->base + ns,
+				      WAYCA_SC_THREADPOOL_TIMER_TICK_NS);
+	timer->period = div_round_up(period, WAYCA_SC_THREADPOOL_TIMER_TICK_NS);
+	threadpool_timer_add(timers, timer);
+
+	next = threadpool_timer_next(timers);
+	if (next < timers->armed)
+		threadpool_timer_arm(timers, next);
+
+	if (id)
+		*id = timer->id;
+	pthread_mutex_unlock(&timers->mutex);
+
+	return 0;
+}
+
+int wayca_threadpool_cancel_timer(struct wayca_threadpool *pool,
+				  wayca_sc_timer_t id)
+{
+	struct wayca_threadpool_timers *timers = &pool->timers;
+	struct wayca_threadpool_timer **pprev, *timer;
+
+	/* The fd may be armed earlier than needed then, which is harmless */
+	pthread_mutex_lock(&timers->mutex);
+	for (int level = 0; level < THREADPOOL_TIMER_LEVELS; level++) {
+		for (int slot = 0; slot < THREADPOOL_TIMER_SLOTS; slot++) {
+			if (!(timers->bitmap[level] & (1ULL << slot)))
+				continue;
+
+			for (pprev = &timers->wheel[level][slot]; *pprev;
+			     pprev = &(*pprev)->next) {
+				if ((*pprev)->id != id)
+					continue;
+
+				timer = *pprev;
+				*pprev = timer->next;
+				if (!timers->wheel[level][slot])
+					timers->bitmap[level] &= ~(1ULL << slot);
+				pthread_mutex_unlock(&timers->mutex);
+				free(timer);
+				return 0;
+			}
+		}
+	}
+	pthread_mutex_unlock(&timers->mutex);
+
+	return -ENOENT;
+}
+
+/*
+ * Allocate a fiber stack with a guard page below, from the stacks
+ * cached by @worker if any, otherwise map a new one preferred on the
+ * node of @worker. @worker is NULL for the threads out of the pool.
+ */
+static void *threadpool_fiber_stack_alloc(struct wayca_threadpool_worker *worker)
+{
+	size_t guard = sysconf(_SC_PAGESIZE);
+	size_t size = WAYCA_SC_FIBER_STACK_SIZE + guard;
+	node_set_t mask;
+	void *stack;
+	int node;
+
+	if (worker && worker->fiber_stacks) {
+		stack = worker->fiber_stacks;
+		worker->fiber_stacks = *(void **)((char *)stack + guard);
+		worker->fiber_stack_num--;
+		return stack;
+	}
+
+	stack = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED)
+		return NULL;
+
+	if (mprotect(stack, guard, PROT_NONE)) {
+		munmap(stack, size);
+		return NULL;
+	}
+
+	/* Failing to bind the memory is not fatal, just lose the locality */
+	node = worker ? atomic_load(&worker->node) : -1;
+	if (node >= 0) {
+		NODE_ZERO(&mask);
+		NODE_SET(node, &mask);
+		mbind((char *)stack + guard, WAYCA_SC_FIBER_STACK_SIZE,
+		      MPOL_PREFERRED, (unsigned long *)&mask,
+		      wayca_sc_nodes_in_total() + 1, 0);
+	}
+
+	return stack;
+}
+
+/* Cache the stack on @worker, or unmap it if there're enough cached */
+static void threadpool_fiber_stack_free(struct wayca_threadpool_worker *worker,
+					void *stack)
+{
+	size_t guard = sysconf(_SC_PAGESIZE);
+
+	if (worker && worker->fiber_stack_num < THREADPOOL_FIBER_STACKS) {
+		/* Linked by the bottom of the stack, the least likely used */
+		*(void **)((char *)stack + guard) = worker->fiber_stacks;
+		worker->fiber_stacks = stack;
+		worker->fiber_stack_num++;
+		return;
+	}
+
+	munmap(stack, WAYCA_SC_FIBER_STACK_SIZE + guard);
+}
+
+static void threadpool_fiber_stack_release(struct wayca_threadpool_worker *worker)
+{
+	size_t guard = sysconf(_SC_PAGESIZE);
+	void *stack;
+
+	while (worker->fiber_stacks) {
+		stack = worker->fiber_stacks;
+		worker->fiber_stacks = *(void **)((char *)stack + guard);
+		munmap(stack, WAYCA_SC_FIBER_STACK_SIZE + guard);
+	}
+	worker->fiber_stack_num = 0;
+}
+
+static void threadpool_fiber_func(void *arg);
+
+/*
+ * Queue the runner of @fiber to the workers on the CPU it last ran on,
+ * or to anyone if it hasn't run on a worker or no worker is there now.
+ */
+static int threadpool_fiber_resume(struct wayca_threadpool_fiber *fiber)
+{
+	int ret = -ENOENT;
+
+	if (fiber->cpu >= 0)
+		ret = wayca_threadpool_queue_on(fiber->pool, WT_GF_CPU, fiber->cpu,
+						threadpool_fiber_func, fiber);
+	if (ret == -ENOENT)
+		ret = wayca_threadpool_queue(fiber->pool, NULL,
+					     WAYCA_SC_THREADPOOL_PRIO_DEFAULT,
+					     threadpool_fiber_func, fiber);
+
+	return ret;
+}
+
+/*
+ * The entry of the fibers. Don't touch the thread local variables
+ * after switching out, the fiber may come back on another thread.
+ */
+static void threadpool_fiber_entry(void)
+{
+	struct wayca_threadpool_fiber *fiber = current_fiber;
+
+	fiber->task(fiber->arg);
+	/* Never come back, the stack is released by the runner */
+	wayca_threadpool_fiber_switch(fiber, THREADPOOL_FIBER_EXIT);
+}
+
+/*
+ * The runner of a fiber. Switch to the fiber and handle the reason
+ * it switches back, the fiber can't be touched once it's queued again
+ * or parked since it may be running elsewhere then.
+ */
+static void threadpool_fiber_func(void *arg)
+{
+	struct wayca_threadpool_worker *worker = current_worker;
+	struct wayca_threadpool_fiber *fiber = arg;
+	struct wayca_threadpool_fiber *saved = current_fiber;
+	int state;
+
+	if (worker && worker->pool != fiber->pool)
+		worker = NULL;
+
+	/* Stay on the CPU of the worker from now on */
+	if (worker)
+		fiber->cpu = atomic_load(&worker->cpu);
+
+again:
+	current_fiber = fiber;
+	swapcontext(&fiber->caller, &fiber->ctx);
+	current_fiber = saved;
+
+	switch (fiber->action) {
+	case THREADPOOL_FIBER_EXIT:
+		threadpool_fiber_stack_free(worker, fiber->stack);
+		atomic_fetch_sub(&fiber->pool->fiber_num, 1);
+		wayca_threadpool_fiber_release(fiber);
+		return;
+	case THREADPOOL_FIBER_PARK:
+		state = THREADPOOL_FIBER_RUNNING;
+		if (atomic_compare_exchange_strong(&fiber->state, &state,
+						   THREADPOOL_FIBER_PARKED))
+			return;
+
+		/* Woken before parked, consume the notification */
+		atomic_store(&fiber->state, THREADPOOL_FIBER_RUNNING);
+		break;
+	}
+
+	/* Keep running it here rather than losing it */
+	if (threadpool_fiber_resume(fiber))
+		goto again;
+}
+
+int wayca_threadpool_queue_fiber(struct wayca_threadpool *pool,
+				 struct wayca_threadpool_fiber *fiber,
+				 wayca_sc_threadpool_task_func task_func,
+				 void *arg)
+{
+	struct wayca_threadpool_worker *worker = current_worker;
+	int ret;
+
+	if (worker && worker->pool != pool)
+		worker = NULL;
+
+	fiber->stack = threadpool_fiber_stack_alloc(worker);
+	if (!fiber->stack)
+		return -ENOMEM;
+
+	getcontext(&fiber->ctx);
+	fiber->ctx.uc_stack.ss_sp = (char *)fiber->stack + sysconf(_SC_PAGESIZE);
+	fiber->ctx.uc_stack.ss_size = WAYCA_SC_FIBER_STACK_SIZE;
+	fiber->ctx.uc_link = NULL;
+	makecontext(&fiber->ctx, threadpool_fiber_entry, 0);
+
+	fiber->pool = pool;
+	fiber->task = task_func;
+	fiber->arg = arg;
+	fiber->cpu = -1;
+	fiber->action = THREADPOOL_FIBER_YIELD;
+	atomic_init(&fiber->state, THREADPOOL_FIBER_RUNNING);
+
+	atomic_fetch_add(&pool->fiber_num, 1);
+	ret = wayca_threadpool_queue(pool, NULL, WAYCA_SC_THREADPOOL_PRIO_DEFAULT,
+				     threadpool_fiber_func, fiber);
+	if (ret) {
+		atomic_fetch_sub(&pool->fiber_num, 1);
+		threadpool_fiber_stack_free(worker, fiber->stack);
+	}
+
+	return ret;
+}
+
+struct wayca_threadpool_fiber *wayca_threadpool_current_fiber(void)
+{
+	return current_fiber;
+}
+
+void wayca_threadpool_fiber_switch(struct wayca_threadpool_fiber *fiber,
+				   int action)
+{
+	fiber->action = action;
+	swapcontext(&fiber->ctx, &fiber->caller);
+}
+
+int wayca_threadpool_fiber_wake(struct wayca_threadpool_fiber *fiber)
+{
+	int state = atomic_load(&fiber->state);
+	int ret;
+
+	/* The runner moves it out of RUNNING only, the wakers are serialized */
+	do {
+		if (state == THREADPOOL_FIBER_NOTIFIED)
+			return 0;
+		if (state == THREADPOOL_FIBER_RUNNING &&
+		    atomic_compare_exchange_strong(&fiber->state, &state,
+						   THREADPOOL_FIBER_NOTIFIED))
+			return 0;
+	} while (state != THREADPOOL_FIBER_PARKED);
+
+	atomic_store(&fiber->state, THREADPOOL_FIBER_RUNNING);
+	ret = threadpool_fiber_resume(fiber);
+	if (ret)
+		atomic_store(&fiber->state, THREADPOOL_FIBER_PARKED);
+
+	return ret;
+}
+
+int wayca_threadpool_set_attr(struct wayca_threadpool *pool,
+			      wayca_sc_threadpool_attr_t attr)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	/* The ring is kept once allocated, the tasks in it are still served */
+	if ((attr & WT_PF_BOUNDED) && !pool->ring.cells)
+		ret = threadpool_ring_init(&pool->ring, WAYCA_SC_THREADPOOL_RING_SIZE);
+	if (!ret)
+		atomic_store_explicit(&pool->attribute, attr, memory_order_release);
+	pthread_mutex_unlock(&pool->mutex);
+
+	return ret;
+}
+
+void wayca_threadpool_stop(struct wayca_threadpool *pool)
+{
+	struct itimerspec now = { .it_value.tv_nsec = 1 };
+
+	atomic_store(&pool->stop, true);
+
+	/* Expire the timerfd at once, the timer thread will see the stop */
+	pthread_mutex_lock(&pool->timers.mutex);
+	if (pool->timers.fd >= 0)
+		timerfd_settime(pool->timers.fd, TFD_TIMER_ABSTIME, &now, NULL);
+	pthread_mutex_unlock(&pool->timers.mutex);
+
+	for (size_t i = 0; i < pool->max_worker_num; i++)
+		threadpool_unpark(pool, &pool->workers[i]);
+}
+
+int wayca_threadpool_setup(struct wayca_threadpool *pool, size_t num,
+			   size_t shard_num)
+{
+	size_t i;
+	int ret;
+
+	ret = posix_memalign((void **)&pool->shards, WAYCA_SC_CACHELINE_SIZE,
+			     shard_num * sizeof(struct wayca_threadpool_shard));
+	if (ret)
+		return -ret;
+
+	ret = posix_memalign((void **)&pool->workers, WAYCA_SC_CACHELINE_SIZE,
+			     num * sizeof(struct wayca_threadpool_worker));
+	if (ret) {
+		free(pool->shards);
+		pool->shards = NULL;
+		return -ret;
+	}
+
+	memset(pool->workers, 0, num * sizeof(struct wayca_threadpool_worker));
+
+	for (i = 0; i < num; i++) {
+		struct wayca_threadpool_worker *worker = &pool->workers[i];
+
+		worker->pool = pool;
+		worker->index = i;
+		worker->seed = i;
+		atomic_init(&worker->cpu, -1);
+		atomic_init(&worker->ccl, -1);
+		atomic_init(&worker->node, -1);
+		atomic_init(&worker->package, -1);
+		atomic_init(&worker->live, false);
+		atomic_init(&worker->park, THREADPOOL_WORKER_RUNNING);
+		worker->inbox.head = NULL;
+		atomic_init(&worker->inbox.num, 0);
+		pthread_mutex_init(&worker->inbox_mutex, NULL);
+		threadpool_cache_init(&worker->cache);
+
+		ret = threadpool_deque_init(&worker->deque);
+		if (ret)
+			goto err;
+
+		worker->victims = malloc(num * sizeof(*worker->victims));
+		if (!worker->victims) {
+			free(worker->deque.buffer);
+			ret = -ENOMEM;
+			goto err;
+		}
+	}
+
+	pool->order = malloc(num * sizeof(*pool->order));
+	if (!pool->order) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	pool->max_worker_num = num;
+	pool->min_worker_num = num;
+	pthread_mutex_init(&pool->resize_mutex, NULL);
+	atomic_init(&pool->total_worker_num, 0);
+	atomic_init(&pool->backlog_since, 0);
+	for (i = 0; i < shard_num; i++) {
+		struct wayca_threadpool_shard *shard = &pool->shards[i];
+
+		threadpool_prio_queue_init(&shard->queue);
+		threadpool_cache_init(&shard->cache);
+		atomic_init(&shard->worker_num, 0);
+		pthread_mutex_init(&shard->mutex, NULL);
+	}
+	pool->shard_num = shard_num;
+	atomic_init(&pool->ring.head, 0);
+	atomic_init(&pool->ring.tail, 0);
+	pool->ring.cells = NULL;
+	memset(&pool->timers, 0, sizeof(pool->timers));
+	pool->timers.fd = -1;
+	pthread_mutex_init(&pool->timers.mutex, NULL);
+	atomic_init(&pool->task_num, 0);
+	atomic_init(&pool->local_num, 0);
+	atomic_init(&pool->idle_num, 0);
+	atomic_init(&pool->sleep_num, 0);
+	atomic_init(&pool->stop, false);
+	atomic_init(&pool->taskgroup_num, 0);
+	atomic_init(&pool->fiber_num, 0);
+	atomic_init(&pool->attribute, 0);
+	atomic_init(&pool->victims_ready, false);
+
+	return 0;
+err:
+	while (i--) {
+		free(pool->workers[i].deque.buffer);
+		free(pool->workers[i].victims);
+	}
+	free(pool->workers);
+	pool->workers = NULL;
+	free(pool->shards);
+	pool->shards = NULL;
+	return ret;
+}
+
+void wayca_threadpool_cleanup(struct wayca_threadpool *pool)
+{
+	if (!pool->workers)
+		return;
+
+	/* The timer thread exits once it sees the pool stopped */
+	if (pool->timers.fd >= 0) {
+		pthread_join(pool->timers.thread, NULL);
+		close(pool->timers.fd);
+		pool->timers.fd = -1;
+	}
+
+	/*
+	 * All the workers have stopped, no one will race with us. The
+	 * tasks still in the queues and the timers pending are discarded,
+	 * the tasks will be released together with the slabs of the caches.
+	 */
+	for (int level = 0; level < THREADPOOL_TIMER_LEVELS; level++) {
+		for (int slot = 0; slot < THREADPOOL_TIMER_SLOTS; slot++) {
+			struct wayca_threadpool_timer *timer, *next;
+
+			timer = threadpool_timer_take(&pool->timers, level, slot);
+			for (; timer; timer = next) {
+				next = timer->next;
+				free(timer);
+			}
+		}
+	}
+	pthread_mutex_destroy(&pool->timers.mutex);
+
+	for (int i = 0; i < pool->shard_num; i++)
+		threadpool_prio_queue_init(&pool->shards[i].queue);
+	atomic_store(&pool->task_num, 0);
+	atomic_store(&pool->local_num, 0);
+
+	for (int i = 0; i < pool->max_worker_num; i++) {
+		free(pool->workers[i].deque.buffer);
+		free(pool->workers[i].victims);
+		pthread_mutex_destroy(&pool->workers[i].inbox_mutex);
+		threadpool_cache_release(&pool->workers[i].cache);
+		threadpool_fiber_stack_release(&pool->workers[i]);
+	}
+	for (int i = 0; i < pool->shard_num; i++) {
+		pthread_mutex_destroy(&pool->shards[i].mutex);
+		threadpool_cache_release(&pool->shards[i].cache);
+	}
+	free(pool->shards);
+	pool->shards = NULL;
+	free(pool->ring.cells);
+	pool->ring.cells = NULL;
+	pthread_mutex_destroy(&pool->resize_mutex);
+	free(pool->order);
+	pool->order = NULL;
+	free(pool->workers);
+	pool->workers = NULL;
+}
@@ -0,0 +1,641 @@
+/*
+ * Copyright (c) 2021 HiSilicon Technologies Co., Ltd.
+ * Wayca scheduler is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#ifndef _WAYCA_THREADPOOL_H
+#define _WAYCA_THREADPOOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ucontext.h>
+
+#include "common.h"
+#include "wayca_thread.h"
+#include "wayca-scheduler.h"
+
+/*
+ * The capacity of each worker's deque, must be power of 2. Tasks
+ * pushed to a full deque will overflow to the shared queue of the pool.
+ */
+#define WAYCA_SC_THREADPOOL_DEQUE_SIZE	1024
+
+/* The topology distance between a thief and its victim */
+enum threadpool_steal_level {
+	THREADPOOL_STEAL_CCL,
+	THREADPOOL_STEAL_NODE,
+	THREADPOOL_STEAL_PACKAGE,
+	THREADPOOL_STEAL_REMOTE,
+	THREADPOOL_STEAL_LEVELS,
+};
+
+#define WT_PF_MASK	(WT_PF_STEAL_TOPO | WT_PF_IDLE_SPIN | WT_PF_BOUNDED)
+
+/* How long an idle worker spins for new tasks before parking, WT_PF_IDLE_SPIN */
+#define WAYCA_SC_THREADPOOL_SPIN_NS	50000
+
+/*
+ * An elastic pool spawns a worker if the tasks have been waiting with
+ * no idle worker for WAYCA_SC_THREADPOOL_GROW_NS, and retires a worker
+ * parked for WAYCA_SC_THREADPOOL_RETIRE_MS.
+ */
+#define WAYCA_SC_THREADPOOL_GROW_NS	1000000
+#define WAYCA_SC_THREADPOOL_RETIRE_MS	1000
+
+/* See struct wayca_threadpool_prio_queue */
+#define WAYCA_SC_THREADPOOL_PRIO_AGING	32
+
+/* The levels higher than the default are served before the workers' own tasks */
+#define THREADPOOL_PRIO_URGENT_MASK	((1UL << WAYCA_SC_THREADPOOL_PRIO_DEFAULT) - 1)
+
+/*
+ * Set in the pending number of a taskgroup once it has an eventfd, so
+ * the tasks counting it down without the lock see the fd created.
+ */
+#define THREADPOOL_TASKGROUP_EVENTFD	(~(SIZE_MAX >> 1))
+
+/* The state of a worker, also the futex it parks on */
+#define THREADPOOL_WORKER_RUNNING	0
+#define THREADPOOL_WORKER_PARKED	1
+
+/*
+ * The buckets of the latency histograms in ns. Bucket 0 counts 0ns, and
+ * bucket b counts [2^(b-1), 2^b), the last one takes all the larger.
+ */
+#define THREADPOOL_HIST_BUCKETS	64
+
+/*
+ * The timing wheel of the delayed tasks, THREADPOOL_TIMER_LEVELS levels
+ * of THREADPOOL_TIMER_SLOTS slots. Each slot of level 0 is a tick of
+ * WAYCA_SC_THREADPOOL_TIMER_TICK_NS, and each slot of a level covers
+ * all the slots of the level below.
+ */
+#define WAYCA_SC_THREADPOOL_TIMER_TICK_NS	1000000
+#define THREADPOOL_TIMER_SLOT_BITS	6
+#define THREADPOOL_TIMER_SLOTS		(1 << THREADPOOL_TIMER_SLOT_BITS)
+#define THREADPOOL_TIMER_LEVELS		5
+
+/* The size of each slab chunk for allocating the task descriptors */
+#define WAYCA_SC_THREADPOOL_SLAB_SIZE	(64 * 1024)
+
+struct wayca_threadpool_task {
+	/* The wayca threadpool this task belongs to */
+	struct wayca_threadpool *pool;
+	/* The cache this task is allocated from */
+	struct wayca_threadpool_cache *cache;
+	/* The task function */
+	wayca_sc_threadpool_task_func task;
+	/* The argument of the task function */
+	void *arg;
+	/* The taskgroup this task belongs to, NULL if none */
+	struct wayca_threadpool_taskgroup *taskgroup;
+	/*
+	 * The topology domain the task must run in, one of WT_GF_CPU,
+	 * WT_GF_CCL, WT_GF_NUMA and WT_GF_PACKAGE with the id of the
+	 * domain in @topo_id, or 0 if it can run on any worker.
+	 */
+	wayca_sc_group_attr_t topo;
+	int topo_id;
+	/* When this task was queued, in ns of CLOCK_MONOTONIC */
+	long long queued;
+	/* Previous and next task in the queue of the threadpool */
+	struct wayca_threadpool_task *next, *prev;
+};
+
+/*
+ * The slab cache of the task descriptors. The owner allocates and
+ * frees the tasks through @free without any lock. Tasks freed by
+ * the other threads are pushed to @remote_free locklessly, and
+ * the owner takes them back all at once when @free is exhausted.
+ */
+struct wayca_threadpool_cache {
+	/* The tasks can be allocated, only accessed by the owner */
+	struct wayca_threadpool_task *free;
+	/* The slab chunks of this cache */
+	struct wayca_threadpool_slab *slabs;
+	/* The NUMA node to allocate the slabs from, -1 for no preference */
+	_Atomic int node;
+	/* The tasks freed by the threads other than the owner */
+	_Atomic(struct wayca_threadpool_task *) remote_free __cacheline_aligned;
+};
+
+/*
+ * A set of tasks queued to the same threadpool which can be waited for
+ * together. The last finished task wakes up the waiters under @mutex.
+ */
+struct wayca_threadpool_taskgroup {
+	/* The taskgroup id */
+	wayca_sc_taskgroup_t id;
+	/* The threadpool the tasks are queued to */
+	struct wayca_threadpool *pool;
+	/* The number of the tasks queued but not finished, and the flag above */
+	_Atomic size_t pending;
+	/* The number of threads sleeping on @cond, under @mutex */
+	size_t waiters;
+	/* The mutex to protect the sleeping of the waiters */
+	pthread_mutex_t mutex;
+	/* Conditional variable to wakeup the waiters */
+	pthread_cond_t cond;
+	/* The eventfd counting the tasks finished, -1 if not created */
+	_Atomic int eventfd;
+};
+
+/*
+ * The statistics of the tasks run by a worker, only updated by the
+ * owner so no atomic RMW is needed, and read by anyone without lock.
+ * The ones of the threads out of the pool are shared and updated by
+ * atomic RMWs.
+ */
+struct wayca_threadpool_stats {
+	/* The number of the tasks run */
+	_Atomic unsigned long long executed;
+	/* The times of parking for no tasks */
+	_Atomic unsigned long long parks;
+	/* The total time the tasks waited in the queues and ran */
+	_Atomic unsigned long long wait_ns, run_ns;
+	/* The log2 histograms of the waiting and running time */
+	_Atomic unsigned long long wait_hist[THREADPOOL_HIST_BUCKETS];
+	_Atomic unsigned long long run_hist[THREADPOOL_HIST_BUCKETS];
+};
+
+/* A task of a taskgraph */
+struct wayca_threadpool_graph_node {
+	/* The taskgraph this task belongs to */
+	struct wayca_threadpool_taskgraph *graph;
+	/* The function to run and its argument */
+	wayca_sc_threadpool_task_func task;
+	void *arg;
+	/* The indexes of the tasks depending on this one */
+	size_t *succs;
+	size_t succ_num, succ_size;
+	/* The number of the tasks this one depends on */
+	size_t dep_num;
+	/* The dependencies not finished yet in the current run */
+	_Atomic size_t pending;
+};
+
+/*
+ * A set of tasks with the dependencies between them. The tasks are
+ * run in @taskgroup, so the graph is running while it has pending
+ * tasks, and can't be changed then.
+ */
+struct wayca_threadpool_taskgraph {
+	/* The taskgraph id */
+	wayca_sc_taskgraph_t id;
+	/* The tasks of this graph */
+	struct wayca_threadpool_graph_node *nodes;
+	size_t node_num, node_size;
+	/* True if the dependencies have been checked to make no cycle */
+	bool checked;
+	/* The taskgroup the tasks run in */
+	struct wayca_threadpool_taskgroup taskgroup;
+	/* Serialize changing and starting the graph */
+	pthread_mutex_t mutex;
+};
+
+/* A FIFO of tasks, protected by the lock of the owner */
+struct wayca_threadpool_queue {
+	/* The head task on the queue waiting to run */
+	struct wayca_threadpool_task *head;
+	/* The number of the tasks in the queue, can be peeked without lock */
+	_Atomic size_t num;
+};
+
+/*
+ * The shared queue of the pool, a FIFO for each priority level. The
+ * highest non-empty level is served first, unless the head of a lower
+ * level has waited for WAYCA_SC_THREADPOOL_PRIO_AGING services per
+ * level of the difference, so the lower levels won't starve.
+ */
+struct wayca_threadpool_prio_queue {
+	struct {
+		struct wayca_threadpool_queue queue;
+		/* The @seq when the current head became the head */
+		unsigned long long since;
+	} levels[WAYCA_SC_THREADPOOL_PRIO_LEVELS];
+	/* The non-empty levels, can be peeked without lock */
+	_Atomic unsigned long bitmap;
+	/* The number of the tasks in all levels, can be peeked without lock */
+	_Atomic size_t num;
+	/* The number of the tasks dequeued */
+	unsigned long long seq;
+};
+
+/*
+ * A part of the shared queue of the pool. A pool created per NUMA node
+ * has a shard for each node, taking the tasks queued on the node, so
+ * the lock and the list stay in the node. Others have only one shard.
+ */
+struct wayca_threadpool_shard {
+	/*
+	 * The tasks queued by the threads out of this threadpool, or
+	 * with a priority other than the default
+	 */
+	struct wayca_threadpool_prio_queue queue;
+	/* The task descriptors allocated out of the pool, under @mutex */
+	struct wayca_threadpool_cache cache;
+	/*
+	 * The number of live workers on the node of this shard. The tasks
+	 * more than that are taken by the idle workers of the other nodes.
+	 */
+	_Atomic size_t worker_num;
+	/* The mutex to protect @queue and @cache */
+	pthread_mutex_t mutex;
+} __cacheline_aligned;
+
+/*
+ * The bounded MPMC ring of WT_PF_BOUNDED, by Dmitry Vyukov. The tasks
+ * are kept by value in the cells, so no descriptor is allocated. The
+ * cell for the position pos is free for the producer when its @seq is
+ * pos, and ready for the consumer when it's pos + 1.
+ */
+struct wayca_threadpool_ring_cell {
+	_Atomic size_t seq;
+	wayca_sc_threadpool_task_func task;
+	void *arg;
+	struct wayca_threadpool_taskgroup *taskgroup;
+	long long queued;
+} __cacheline_aligned;
+
+struct wayca_threadpool_ring {
+	/* The next position to dequeue */
+	_Atomic size_t head __cacheline_aligned;
+	/* The next position to queue */
+	_Atomic size_t tail __cacheline_aligned;
+	/* Allocated when WT_PF_BOUNDED is set for the first time */
+	struct wayca_threadpool_ring_cell *cells;
+	size_t mask;
+};
+
+/* A delayed or periodic task */
+struct wayca_threadpool_timer {
+	/* The timer id, unique in the pool */
+	wayca_sc_timer_t id;
+	/* The task function and its argument */
+	wayca_sc_threadpool_task_func task;
+	void *arg;
+	/* The tick when the task is due */
+	unsigned long long expires;
+	/* The period in ticks, 0 if the task is queued only once */
+	unsigned long long period;
+	/* The next timer in the same slot of the wheel */
+	struct wayca_threadpool_timer *next;
+};
+
+/*
+ * The hierarchical timing wheel of a pool. A timer is put in the
+ * level where the ticks to its expiry fit, and moved down a level when
+ * the slot of the lower level wraps around to it. The timer thread
+ * sleeps on @fd, which is armed for the next tick where something
+ * expires or moves down.
+ */
+struct wayca_threadpool_timers {
+	struct wayca_threadpool_timer *wheel[THREADPOOL_TIMER_LEVELS][THREADPOOL_TIMER_SLOTS];
+	/* The non-empty slots of each level */
+	unsigned long long bitmap[THREADPOOL_TIMER_LEVELS];
+	/* The next tick to process */
+	unsigned long long jiffies;
+	/* The CLOCK_MONOTONIC time of the tick 0 in ns */
+	long long base;
+	/* The tick @fd is armed for, ULLONG_MAX if disarmed */
+	unsigned long long armed;
+	/* The id of the next timer */
+	wayca_sc_timer_t next_id;
+	/* The timerfd, -1 before the first timer is added */
+	int fd;
+	pthread_t thread;
+	/* Protect all the above, held while queueing the due tasks */
+	pthread_mutex_t mutex;
+};
+
+/* What a fiber switched back to its runner for */
+#define THREADPOOL_FIBER_YIELD		0
+#define THREADPOOL_FIBER_PARK		1
+#define THREADPOOL_FIBER_EXIT		2
+
+/* The wake up state of a fiber */
+#define THREADPOOL_FIBER_RUNNING	0
+#define THREADPOOL_FIBER_PARKED		1
+#define THREADPOOL_FIBER_NOTIFIED	2
+
+/* The most fiber stacks cached by a worker */
+#define THREADPOOL_FIBER_STACKS		64
+
+/*
+ * A task running on its own stack. Each time the fiber is queued, a
+ * task of the runner is queued instead, which switches to the fiber
+ * on the worker and handles the reason it switches back.
+ */
+struct wayca_threadpool_fiber {
+	/* The fiber id */
+	wayca_sc_fiber_t id;
+	/* The threadpool this fiber belongs to */
+	struct wayca_threadpool *pool;
+	/* The task function and its argument */
+	wayca_sc_threadpool_task_func task;
+	void *arg;
+	/* The mapping of the stack, the guard page included */
+	void *stack;
+	/* The CPU of the worker first ran the fiber, -1 if not yet */
+	int cpu;
+	/* THREADPOOL_FIBER_YIELD/PARK/EXIT, set before switching back */
+	int action;
+	/* THREADPOOL_FIBER_RUNNING/PARKED/NOTIFIED */
+	_Atomic int state;
+	/* The context of the fiber and the runner resuming it */
+	ucontext_t ctx;
+	ucontext_t caller;
+};
+
+/*
+ * The Chase-Lev work stealing deque. Only the owner worker can push
+ * and take the tasks at the bottom, while others steal from the top.
+ */
+struct wayca_threadpool_deque {
+	_Atomic long top __cacheline_aligned;
+	_Atomic long bottom __cacheline_aligned;
+	_Atomic(struct wayca_threadpool_task *) *buffer;
+	long mask;
+};
+
+struct wayca_threadpool_worker {
+	/* The threadpool this worker belongs to */
+	struct wayca_threadpool *pool;
+	/* The wayca thread of this worker */
+	struct wayca_thread *thread;
+	/* The index of this worker in the pool */
+	int index;
+	/* Seed for picking the victim to steal from */
+	unsigned int seed;
+	/* True if a working thread is serving this slot */
+	_Atomic bool live;
+	/* The first CPU and its topology this worker placed on, -1 if unknown */
+	_Atomic int cpu, ccl, node, package;
+	/*
+	 * The other live workers sorted by the topology distance to this
+	 * worker. victims[level_end[level - 1], level_end[level]) are the
+	 * workers in the steal level @level. Rebuilt in place when the
+	 * workers come and go, so the readers may see a mix of the old
+	 * and the new ones, which are all valid slots anyway.
+	 */
+	_Atomic int *victims;
+	_Atomic int level_end[THREADPOOL_STEAL_LEVELS];
+	/* The number of successful steals at each level */
+	_Atomic unsigned long long steals[THREADPOOL_STEAL_LEVELS];
+	/* The tasks queued by this worker */
+	struct wayca_threadpool_deque deque;
+	/*
+	 * The tasks queued by others to run on this worker, under
+	 * @inbox_mutex. Idle workers steal from here only if there's
+	 * nothing in the deques.
+	 */
+	struct wayca_threadpool_queue inbox;
+	pthread_mutex_t inbox_mutex;
+	/* The task descriptors allocated by this worker */
+	struct wayca_threadpool_cache cache;
+	/* The fiber stacks freed on this worker, only used by the owner */
+	void *fiber_stacks;
+	size_t fiber_stack_num;
+	/* The tasks run by this worker, kept off the lines others write */
+	struct wayca_threadpool_stats stats __cacheline_aligned;
+	/* THREADPOOL_WORKER_*, only the waker moves it out of PARKED */
+	_Atomic int park __cacheline_aligned;
+} __cacheline_aligned;
+
+struct wayca_threadpool {
+	/* The taskpool id */
+	wayca_sc_threadpool_t id;
+	/* The workers of this threadpool */
+	struct wayca_threadpool_worker *workers;
+	/* The number of worker slots allocated in @workers, the most workers */
+	size_t max_worker_num;
+	/* The fewest workers, the same as @max_worker_num if not elastic */
+	size_t min_worker_num;
+	/*
+	 * The indexes of the live workers sorted by the package, node,
+	 * cluster and CPU they're placed on, so that neighbours share the
+	 * caches. @total_worker_num of them, under @resize_mutex.
+	 */
+	_Atomic int *order;
+	/* Total number of worker threads available in this threadpool */
+	_Atomic size_t total_worker_num;
+	/* Serialize spawning and retiring workers and rebuilding the victims */
+	pthread_mutex_t resize_mutex;
+	/* The stack size of the workers spawned on demand, 0 for the default */
+	size_t stack_size;
+	/* Since when the tasks have been waiting with no idle worker, in ns */
+	_Atomic long long backlog_since;
+	/* The number of idle workers in this threadpool */
+	_Atomic size_t idle_num;
+	/* The number of the tasks waiting to run which any worker can run */
+	_Atomic size_t task_num;
+	/* The number of the tasks waiting to run in a topology domain */
+	_Atomic size_t local_num;
+	/* The number of workers parked */
+	_Atomic size_t sleep_num;
+	/* The shared queue, a shard per NUMA node or only one */
+	struct wayca_threadpool_shard *shards;
+	size_t shard_num;
+	/* The tasks in the default priority queued to a WT_PF_BOUNDED pool */
+	struct wayca_threadpool_ring ring;
+	/* The delayed and periodic tasks */
+	struct wayca_threadpool_timers timers;
+	/* The tasks run by the threads out of the pool helping the waits */
+	struct wayca_threadpool_stats stats __cacheline_aligned;
+	/* The wayca sc group that the threads in this threadpool belongs to */
+	struct wayca_sc_group *group;
+	/* The number of taskgroups created on this threadpool */
+	_Atomic size_t taskgroup_num;
+	/* The number of fibers of this threadpool not finished */
+	_Atomic size_t fiber_num;
+	/* The weight in the CPU budget, 0 if not in, under the budget lock */
+	unsigned int weight;
+	/* The next threadpool in the budget, under the budget lock */
+	struct wayca_threadpool *budget_next;
+	/* The CPUs of its own and the ones borrowed, under the budget lock */
+	cpu_set_t budget_own;
+	cpu_set_t budget_cpus;
+	/* True if the CPUs of this pool are lent to the others */
+	_Atomic bool lent;
+	/* Set on queueing to a lending pool, a worker takes the CPUs back */
+	_Atomic bool reclaim;
+	/* The attribute of this threadpool, WT_PF_* */
+	_Atomic wayca_sc_threadpool_attr_t attribute;
+	/* True if the victims of the workers have been sorted */
+	_Atomic bool victims_ready;
+	/* The mutex to protect @group and allocating @ring */
+	pthread_mutex_t mutex;
+	/* True to Notify the workers to stop */
+	_Atomic bool stop;
+};
+
+static inline bool threadpool_queue_is_empty(struct wayca_threadpool_queue *queue)
+{
+	return queue->head == NULL;
+}
+
+/*
+ * Allocate the workers and their deques of a new threadpool, and
+ * @shard_num shards of the shared queue
+ */
+int wayca_threadpool_setup(struct wayca_threadpool *pool, size_t num,
+			   size_t shard_num);
+
+/* Discard the tasks still in the queues and release the workers */
+void wayca_threadpool_cleanup(struct wayca_threadpool *pool);
+
+/* The routine of each worker thread, @priv is the wayca_threadpool_worker */
+void *wayca_threadpool_worker_func(void *priv);
+
+/*
+ * Queue a task to the threadpool and wake up a worker if necessary.
+ * @taskgroup is the taskgroup of the task, or NULL. @prio is one of
+ * WAYCA_SC_THREADPOOL_PRIO_*.
+ */
+int wayca_threadpool_queue(struct wayca_threadpool *pool,
+			   struct wayca_threadpool_taskgroup *taskgroup, int prio,
+			   wayca_sc_threadpool_task_func task_func, void *arg);
+
+/* Queue @num tasks to the threadpool at once, either all or none queued */
+int wayca_threadpool_queue_batch(struct wayca_threadpool *pool,
+				 struct wayca_threadpool_taskgroup *taskgroup,
+				 wayca_sc_threadpool_task_func *task_funcs,
+				 void **args, size_t num);
+
+/*
+ * Split [@begin, @end) into a contiguous block per worker in the
+ * topology order, and wait for all of them processed.
+ */
+int wayca_threadpool_parallel_for(struct wayca_threadpool *pool,
+				  size_t begin, size_t end, size_t grain,
+				  wayca_sc_parallel_for_func func, void *ctx);
+
+/*
+ * Queue a task to run on a worker in the topology domain @topo with
+ * the id @id, returns -ENOENT if no worker in the domain.
+ */
+int wayca_threadpool_queue_on(struct wayca_threadpool *pool,
+			      wayca_sc_group_attr_t topo, int id,
+			      wayca_sc_threadpool_task_func task_func, void *arg);
+
+/*
+ * Queue a task to the pool after @ns nanoseconds, and every @period
+ * nanoseconds then if @period is not 0. The id of the timer is stored
+ * in @id if it's not NULL.
+ */
+int wayca_threadpool_queue_after(struct wayca_threadpool *pool,
+				 unsigned long long ns, unsigned long long period,
+				 wayca_sc_threadpool_task_func task_func, void *arg,
+				 wayca_sc_timer_t *id);
+
+/* Cancel a timer of the pool, returns -ENOENT if it's not pending */
+int wayca_threadpool_cancel_timer(struct wayca_threadpool *pool,
+				  wayca_sc_timer_t id);
+
+/*
+ * Set up a fiber of @pool running @task_func and queue it. The stack
+ * is allocated from the current worker if it's in @pool.
+ */
+int wayca_threadpool_queue_fiber(struct wayca_threadpool *pool,
+				 struct wayca_threadpool_fiber *fiber,
+				 wayca_sc_threadpool_task_func task_func,
+				 void *arg);
+
+/* The fiber running on current thread, NULL if not in a fiber */
+struct wayca_threadpool_fiber *wayca_threadpool_current_fiber(void);
+
+/* Switch back to the runner of current fiber for THREADPOOL_FIBER_* @action */
+void wayca_threadpool_fiber_switch(struct wayca_threadpool_fiber *fiber,
+				   int action);
+
+/* Queue a parked fiber again or notify a running one */
+int wayca_threadpool_fiber_wake(struct wayca_threadpool_fiber *fiber);
+
+/*
+ * Take back the CPUs @pool lent to the other pools in the budget, the
+ * ones the others lent stay. Implemented by the owner of the budget.
+ */
+void wayca_threadpool_budget_reclaim(struct wayca_threadpool *pool);
+
+/*
+ * Release the id of a finished fiber and free it, implemented by the
+ * owner of the ids.
+ */
+void wayca_threadpool_fiber_release(struct wayca_threadpool_fiber *fiber);
+
+/* Set the WT_PF_* attribute of the pool */
+int wayca_threadpool_set_attr(struct wayca_threadpool *pool,
+			      wayca_sc_threadpool_attr_t attr);
+
+/* Initialize a taskgroup of @pool */
+void wayca_threadpool_taskgroup_init(struct wayca_threadpool_taskgroup *taskgroup,
+				     struct wayca_threadpool *pool);
+
+/* Get the eventfd of a taskgroup, created at the first call */
+int wayca_threadpool_taskgroup_eventfd(struct wayca_threadpool_taskgroup *taskgroup);
+
+/* Release a taskgroup, fails with -EBUSY if it has unfinished tasks */
+int wayca_threadpool_taskgroup_fini(struct wayca_threadpool_taskgroup *taskgroup);
+
+/*
+ * Wait for all the tasks of the taskgroup finished, executing the
+ * tasks of the pool in the meantime.
+ */
+void wayca_threadpool_wait(struct wayca_threadpool_taskgroup *taskgroup);
+
+/* Initialize an empty taskgraph of @pool */
+void wayca_threadpool_taskgraph_init(struct wayca_threadpool_taskgraph *graph,
+				     struct wayca_threadpool *pool);
+
+/* Release a taskgraph, fails with -EBUSY if it's running */
+int wayca_threadpool_taskgraph_fini(struct wayca_threadpool_taskgraph *graph);
+
+/* Add a task to the graph, return its index or a negative error number */
+ssize_t wayca_threadpool_taskgraph_add_task(struct wayca_threadpool_taskgraph *graph,
+					    wayca_sc_threadpool_task_func task_func,
+					    void *arg);
+
+/* Make the task @to depend on the task @from */
+int wayca_threadpool_taskgraph_add_edge(struct wayca_threadpool_taskgraph *graph,
+					size_t from, size_t to);
+
+/* Queue the tasks of the graph depending on nothing */
+int wayca_threadpool_taskgraph_run(struct wayca_threadpool_taskgraph *graph);
+
+/*
+ * Sort the victims of each live worker according to where they're
+ * placed. The caller should hold @pool->resize_mutex.
+ */
+void wayca_threadpool_build_victims(struct wayca_threadpool *pool);
+
+/*
+ * Create a working thread for the slot @worker with @attr, or the
+ * stack size of the pool if @attr is NULL, and place it in the group
+ * of the pool. The caller should hold @pool->resize_mutex.
+ */
+int wayca_threadpool_spawn(struct wayca_threadpool *pool,
+			   struct wayca_threadpool_worker *worker,
+			   pthread_attr_t *attr);
+
+/* Sum up the steals of all the workers in each level */
+void wayca_threadpool_get_steals(struct wayca_threadpool *pool,
+				 struct wayca_sc_threadpool_steals *steals);
+
+/* Sum up the statistics of all the workers and the helpers */
+void wayca_threadpool_get_stats(struct wayca_threadpool *pool,
+				struct wayca_sc_threadpool_stats *stats);
+
+/* Notify all the workers to stop after finishing the running tasks */
+void wayca_threadpool_stop(struct wayca_threadpool *pool);
+
+#endif	/* _WAYCA_THREADPOOL_H */
@@ -18,13 +18,17 @@
 #include <pthread.h>
 #include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/syscall.h>
 
+#include "handle.h"
+#include "threadpool.h"
 #include "wayca_thread.h"
 #include "wayca-scheduler.h"
 
@@ -277,30 +281,205 @@ WAYCA_SC_DECLSPEC char *wayca_scheduler_socket_path = "/etc/wayca-scheduler/wayc
  * a bit less than the default limits of the system.
  */
 #define DEFAULT_WAYCA_SC_THREADS_NUM	32760
-static struct wayca_thread **wayca_threads_array;
-static pthread_mutex_t wayca_threads_array_mutex;
-static size_t wayca_threads_array_size;
+static struct wayca_handle_table wayca_threads_table;
 
 #define DEFAULT_WAYCA_SC_GROUPS_NUM		256
-static struct wayca_sc_group **wayca_groups_array;
-static pthread_mutex_t wayca_groups_array_mutex;
-static size_t wayca_groups_array_size;
+static struct wayca_handle_table wayca_groups_table;
 
 #define DEFAULT_WAYCA_SC_THREADPOOLS_NUM	256
-static struct wayca_threadpool **wayca_threadpools_array;
-static pthread_mutex_t wayca_threadpools_array_mutex;
-static size_t wayca_threadpools_num;
+static struct wayca_handle_table wayca_threadpools_table;
+
+#define DEFAULT_WAYCA_SC_TASKGROUPS_NUM		1024
+static struct wayca_handle_table wayca_taskgroups_table;
+
+#define DEFAULT_WAYCA_SC_TASKGRAPHS_NUM		1024
+static struct wayca_handle_table wayca_taskgraphs_table;
+
+#define DEFAULT_WAYCA_SC_FIBERS_NUM		4096
+static struct wayca_handle_table wayca_fibers_table;
+/*
+ * Serialize waking a fiber against its release, so a fiber found in
+ * the table stays alive while it's woken.
+ */
+static pthread_mutex_t wayca_fibers_mutex;
+
+/*
+ * The threadpools sharing the CPUs of the process by weight, under
+ * @wayca_budget_mutex. They leave the list before destroyed.
+ */
+static struct wayca_threadpool *wayca_budget_pools;
+static pthread_mutex_t wayca_budget_mutex;
+/* The weight of the threadpools created, 0 for not joining the budget */
+static size_t wayca_threadpool_default_weight;
+
+/*
+ * The thread rebalancing the groups in the background, started and
+ * stopped under the mutex.
+ */
+static struct {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool running;
+	bool stop;
+	/* The period in ns */
+	long long period;
+	unsigned long tick;
+	int nr_cpus;
+	/* The run queue wait of each CPU so far, and in the last period */
+	unsigned long long *run_delay;
+	long long *wait;
+	/* Is the run queue wait of the CPUs known */
+	bool sampled;
+	/* The groups to rebalance in a period, taken out of the table lock */
+	struct wayca_sc_group **groups;
+	int nr_groups;
+	int max_groups;
+} wayca_rebalancer;
 
 cpu_set_t total_cpu_set;
 
-long long *wayca_cpu_loads;
-pthread_mutex_t wayca_cpu_loads_mutex;
+struct wayca_domain_table wayca_domains[WAYCA_DOMAIN_LEVELS];
+
+static struct wayca_load *wayca_loads_alloc(int num)
+{
+	struct wayca_load *loads;
+
+	if (posix_memalign((void **)&loads, WAYCA_SC_CACHELINE_SIZE,
+			   num * sizeof(struct wayca_load)))
+		return NULL;
+
+	for (int i = 0; i < num; i++) {
+		atomic_init(&loads[i].load, 0);
+		atomic_init(&loads[i].util, 0);
+	}
+
+	return loads;
+}
+
+static int wayca_domains_in_level(enum wayca_domain_level level)
+{
+	switch (level) {
+	case WAYCA_DOMAIN_CPU:
+		return wayca_sc_cpus_in_total();
+	case WAYCA_DOMAIN_CCL:
+		return wayca_sc_ccls_in_total();
+	case WAYCA_DOMAIN_NODE:
+		return wayca_sc_nodes_in_total();
+	case WAYCA_DOMAIN_PACKAGE:
+		return wayca_sc_packages_in_total();
+	default:
+		return 1;
+	}
+}
+
+static int wayca_domain_cpu_mask(enum wayca_domain_level level, int id,
+				 cpu_set_t *mask)
+{
+	switch (level) {
+	case WAYCA_DOMAIN_CPU:
+		CPU_ZERO(mask);
+		CPU_SET(id, mask);
+		return 0;
+	case WAYCA_DOMAIN_CCL:
+		return wayca_sc_ccl_cpu_mask(id, sizeof(cpu_set_t), mask);
+	case WAYCA_DOMAIN_NODE:
+		return wayca_sc_node_cpu_mask(id, sizeof(cpu_set_t), mask);
+	case WAYCA_DOMAIN_PACKAGE:
+		return wayca_sc_package_cpu_mask(id, sizeof(cpu_set_t), mask);
+	default:
+		memcpy(mask, &total_cpu_set, sizeof(cpu_set_t));
+		return 0;
+	}
+}
+
+/*
+ * Build the domains of each topology level from the CPU masks of the
+ * topology, leaving out the offline CPUs and the nodes without CPUs.
+ * A level the topology doesn't have ends up with no domains. The loads
+ * are accounted for the CPUs, CCLs and nodes, the levels above sum up
+ * their nodes.
+ */
+static int wayca_domains_init(int total_cpu_cnt)
+{
+	for (int level = 0; level < WAYCA_DOMAIN_LEVELS; level++) {
+		struct wayca_domain_table *table = &wayca_domains[level];
+		int num = wayca_domains_in_level(level);
+
+		if (num <= 0)
+			continue;
+
+		table->domains = calloc(num, sizeof(struct wayca_domain));
+		table->cpu_domain = malloc(total_cpu_cnt * sizeof(int));
+		if (!table->domains || !table->cpu_domain)
+			return -ENOMEM;
+
+		for (int cpu = 0; cpu < total_cpu_cnt; cpu++)
+			table->cpu_domain[cpu] = -1;
+
+		for (int id = 0; id < num; id++) {
+			struct wayca_domain *domain = &table->domains[table->nr];
+			int cpu;
+
+			if (wayca_domain_cpu_mask(level, id, &domain->cpus))
+				continue;
+
+			CPU_AND(&domain->cpus, &domain->cpus, &total_cpu_set);
+			if (!CPU_COUNT(&domain->cpus))
+				continue;
+
+			domain->first = cpuset_find_first_set(&domain->cpus);
+			for (cpu = domain->first; cpu >= 0;
+			     cpu = cpuset_find_next_set(&domain->cpus, cpu))
+				table->cpu_domain[cpu] = table->nr;
+			table->nr++;
+		}
+
+		if (level > WAYCA_DOMAIN_NODE || !table->nr)
+			continue;
+
+		table->loads = wayca_loads_alloc(table->nr);
+		if (!table->loads)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void wayca_domains_exit(void)
+{
+	for (int level = 0; level < WAYCA_DOMAIN_LEVELS; level++) {
+		struct wayca_domain_table *table = &wayca_domains[level];
+
+		free(table->domains);
+		free(table->cpu_domain);
+		free(table->loads);
+		memset(table, 0, sizeof(*table));
+	}
+}
 
 static inline bool is_env_invalid(size_t num)
 {
 	return !num || num >= ULLONG_MAX / sizeof(void *);
 }
 
+static void wayca_rebalancer_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_mutex_init(&wayca_rebalancer.mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wayca_rebalancer.cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static void wayca_rebalancer_exit(void)
+{
+	pthread_cond_destroy(&wayca_rebalancer.cond);
+	pthread_mutex_destroy(&wayca_rebalancer.mutex);
+}
+
 static void wayca_thread_init_from_envs(size_t *num, size_t def,
 					const char *env)
 {
@@ -326,188 +505,102 @@ static void wayca_thread_init(void)
 	int total_cpu_cnt;
 	size_t num;
 
+	wayca_rebalancer_init();
+	wayca_graph_init();
+
 	CPU_ZERO(&total_cpu_set);
 	total_cpu_cnt = wayca_sc_cpus_in_total();
 	if (total_cpu_cnt < 0)
 		return;
 
-	for (int cpu = 0; cpu < total_cpu_cnt; cpu++)
-		CPU_SET(cpu, &total_cpu_set);
+	/* Offline CPUs are left out, or take all if we fail to tell */
+	if (wayca_sc_total_online_cpu_mask(sizeof(cpu_set_t), &total_cpu_set) ||
+	    !CPU_COUNT(&total_cpu_set)) {
+		CPU_ZERO(&total_cpu_set);
+		for (int cpu = 0; cpu < total_cpu_cnt; cpu++)
+			CPU_SET(cpu, &total_cpu_set);
+	}
 
-	wayca_cpu_loads = malloc(total_cpu_cnt * sizeof(long long));
-	if (!wayca_cpu_loads)
+	if (wayca_domains_init(total_cpu_cnt))
 		return;
+	wayca_cpu_util_init(total_cpu_cnt);
+	wayca_migration_init(total_cpu_cnt);
 
-	memset(wayca_cpu_loads, 0, sizeof(long long) * total_cpu_cnt);
-	pthread_mutex_init(&wayca_cpu_loads_mutex, NULL);
+	pthread_mutex_init(&wayca_budget_mutex, NULL);
+	wayca_thread_init_from_envs(&wayca_threadpool_default_weight, 0,
+				    "WAYCA_SC_THREADPOOL_WEIGHT");
+	wayca_threadpool_default_weight = min(wayca_threadpool_default_weight,
+					      UINT_MAX);
 
 	wayca_thread_init_from_envs(&num, DEFAULT_WAYCA_SC_THREADS_NUM,
 				    "WAYCA_SC_THREADS_NUMBER");
-	wayca_threads_array = malloc(num * sizeof(struct wayca_thread *));
-	if (!wayca_threads_array) {
-		wayca_threads_array = NULL;
-		return;
-	}
-
-	memset(wayca_threads_array, 0, num * sizeof(struct wayca_thread *));
-	wayca_threads_array_size = num;
-	pthread_mutex_init(&wayca_threads_array_mutex, NULL);
+	wayca_handle_table_init(&wayca_threads_table, num);
 
 	wayca_thread_init_from_envs(&num, DEFAULT_WAYCA_SC_GROUPS_NUM,
 				    "WAYCA_SC_GROUPS_NUMBER");
-	wayca_groups_array = malloc(num * sizeof(struct wayca_sc_group *));
-	if (!wayca_groups_array) {
-		wayca_groups_array = NULL;
-		wayca_threads_array_size = 0;
-		return;
-	}
-
-	memset(wayca_groups_array, 0, num * sizeof(struct wayca_sc_group *));
-	wayca_groups_array_size = num;
-	pthread_mutex_init(&wayca_groups_array_mutex, NULL);
+	wayca_handle_table_init(&wayca_groups_table, num);
 
 	wayca_thread_init_from_envs(&num, DEFAULT_WAYCA_SC_THREADPOOLS_NUM,
 				    "WAYCA_SC_THREADPOOLS_NUMBER");
-	wayca_threadpools_array = malloc(num * sizeof(struct wayca_threadpool *));
-	if (!wayca_threadpools_array) {
-		wayca_threadpools_array = NULL;
-		wayca_threadpools_num = 0;
-		return;
-	}
-	memset(wayca_threadpools_array, 0,
-	       num * sizeof(struct wayca_threadpool *));
-	wayca_threadpools_num = num;
-	pthread_mutex_init(&wayca_threadpools_array_mutex, NULL);
-}
-
-static void wayca_thread_exit(void)
-{
-	if (wayca_cpu_loads) {
-		free(wayca_cpu_loads);
-		wayca_cpu_loads = NULL;
-	}
-	pthread_mutex_destroy(&wayca_cpu_loads_mutex);
-
-	if (wayca_threads_array) {
-		free(wayca_threads_array);
-		wayca_threads_array = NULL;
-	}
-	pthread_mutex_destroy(&wayca_threads_array_mutex);
-
-	if (wayca_groups_array) {
-		free(wayca_groups_array);
-		wayca_groups_array = NULL;
-	}
-	pthread_mutex_destroy(&wayca_groups_array_mutex);
-
-	if (wayca_threadpools_array) {
-		free(wayca_threadpools_array);
-		wayca_threadpools_array = NULL;
-	}
-	pthread_mutex_destroy(&wayca_threadpools_array_mutex);
-}
+	wayca_handle_table_init(&wayca_threadpools_table, num);
 
-/**
- * The caller should have hold the @wayca_threads_array_mutex lock.
- */
-static int find_free_thread_id_locked(wayca_sc_thread_t *id)
-{
-	for (wayca_sc_thread_t i = 0; i < wayca_threads_array_size; i++) {
-		if (!wayca_threads_array[i]) {
-			*id = i;
-			return 0;
-		}
-	}
-
-	return -EAGAIN;
-}
-
-/**
- * The caller should have hold the @wayca_groups_array_mutex lock.
- */
-static int find_free_group_id_locked(wayca_sc_thread_t *id)
-{
-	for (wayca_sc_group_t i = 0; i < wayca_groups_array_size; i++) {
-		if (!wayca_groups_array[i]) {
-			*id = i;
-			return 0;
-		}
-	}
-
-	return -EAGAIN;
-}
+	wayca_thread_init_from_envs(&num, DEFAULT_WAYCA_SC_TASKGROUPS_NUM,
+				    "WAYCA_SC_TASKGROUPS_NUMBER");
+	wayca_handle_table_init(&wayca_taskgroups_table, num);
 
-/**
- * The caller should have hold the @wayca_threadpools_array_mutex lock.
- */
-static int find_free_threadpool_id_locked(wayca_sc_threadpool_t *id)
-{
-	for (wayca_sc_threadpool_t i = 0; i < wayca_threadpools_num; i++) {
-		if (!wayca_threadpools_array[i]) {
-			*id = i;
-			return 0;
-		}
-	}
+	wayca_thread_init_from_envs(&num, DEFAULT_WAYCA_SC_TASKGRAPHS_NUM,
+				    "WAYCA_SC_TASKGRAPHS_NUMBER");
+	wayca_handle_table_init(&wayca_taskgraphs_table, num);
 
-	return -EAGAIN;
+	wayca_thread_init_from_envs(&num, DEFAULT_WAYCA_SC_FIBERS_NUM,
+				    "WAYCA_SC_FIBERS_NUMBER");
+	wayca_handle_table_init(&wayca_fibers_table, num);
+	pthread_mutex_init(&wayca_fibers_mutex, NULL);
 }
 
-static bool is_thread_id_valid(wayca_sc_thread_t id)
+static void wayca_thread_exit(void)
 {
-	bool valid;
-
-	if (id >= wayca_threads_array_size)
-		return false;
-
-	pthread_mutex_lock(&wayca_threads_array_mutex);
-	valid = wayca_threads_array[id] != NULL;
-	pthread_mutex_unlock(&wayca_threads_array_mutex);
+	/* The rebalancer walks the groups, stop it before they go away */
+	wayca_sc_group_rebalance_stop();
+	wayca_rebalancer_exit();
+	wayca_graph_exit();
+	wayca_migration_exit();
+	wayca_cpu_util_exit();
+	wayca_domains_exit();
+	pthread_mutex_destroy(&wayca_budget_mutex);
 
-	return valid;
+	wayca_handle_table_fini(&wayca_threads_table);
+	wayca_handle_table_fini(&wayca_groups_table);
+	wayca_handle_table_fini(&wayca_threadpools_table);
+	wayca_handle_table_fini(&wayca_taskgroups_table);
+	wayca_handle_table_fini(&wayca_taskgraphs_table);
+	wayca_handle_table_fini(&wayca_fibers_table);
+	pthread_mutex_destroy(&wayca_fibers_mutex);
 }
 
-static bool is_group_id_valid(wayca_sc_group_t id)
+static struct wayca_thread *id_to_wayca_thread(wayca_sc_thread_t id)
 {
-	bool valid;
-
-	if (id >= wayca_groups_array_size)
-		return false;
-
-	pthread_mutex_lock(&wayca_groups_array_mutex);
-	valid = wayca_groups_array[id] != NULL;
-	pthread_mutex_unlock(&wayca_groups_array_mutex);
-
-	return valid;
+	return wayca_handle_lookup(&wayca_threads_table, id);
 }
 
-static bool is_threadpool_id_valid(wayca_sc_threadpool_t id)
+static struct wayca_sc_group *id_to_wayca_group(wayca_sc_group_t id)
 {
-	bool valid;
-
-	if (id >= wayca_threadpools_num)
-		return false;
-
-	pthread_mutex_lock(&wayca_threadpools_array_mutex);
-	valid = wayca_threadpools_array[id] != NULL;
-	pthread_mutex_unlock(&wayca_threadpools_array_mutex);
-
-	return valid;
+	return wayca_handle_lookup(&wayca_groups_table, id);
 }
 
-/* The caller should make sure the @id is valid */
-static struct wayca_thread *id_to_wayca_thread(wayca_sc_thread_t id)
+static struct wayca_threadpool *id_to_wayca_threadpool(wayca_sc_threadpool_t id)
 {
-	return is_thread_id_valid(id) ? wayca_threads_array[id] : NULL;
+	return wayca_handle_lookup(&wayca_threadpools_table, id);
 }
 
-static struct wayca_sc_group *id_to_wayca_group(wayca_sc_group_t id)
+static struct wayca_threadpool_taskgroup *id_to_wayca_taskgroup(wayca_sc_taskgroup_t id)
 {
-	return is_group_id_valid(id) ? wayca_groups_array[id] : NULL;
+	return wayca_handle_lookup(&wayca_taskgroups_table, id);
 }
 
-static struct wayca_threadpool *id_to_wayca_threadpool(wayca_sc_threadpool_t id)
+static struct wayca_threadpool_taskgraph *id_to_wayca_taskgraph(wayca_sc_taskgraph_t id)
 {
-	return is_threadpool_id_valid(id) ? wayca_threadpools_array[id] : NULL;
+	return wayca_handle_lookup(&wayca_taskgraphs_table, id);
 }
 
 void *wayca_thread_start_routine(void *private)
@@ -563,36 +656,58 @@ int WAYCA_SC_DECLSPEC wayca_sc_thread_get_attr(wayca_sc_thread_t wthread,
 	return 0;
 }
 
-static struct wayca_thread *wayca_thread_alloc(void)
+int WAYCA_SC_DECLSPEC wayca_sc_thread_set_edge(wayca_sc_thread_t wthread,
+					       wayca_sc_thread_t peer,
+					       unsigned int weight)
 {
-	wayca_sc_thread_t id;
+	struct wayca_thread *wt_p, *peer_p;
 
-	pthread_mutex_lock(&wayca_threads_array_mutex);
-	if (find_free_thread_id_locked(&id) < 0)
-		goto err;
+	wt_p = id_to_wayca_thread(wthread);
+	peer_p = id_to_wayca_thread(peer);
+	if (!wt_p || !peer_p || wt_p == peer_p)
+		return -EINVAL;
 
-	wayca_threads_array[id] = malloc(sizeof(struct wayca_thread));
-	if (!wayca_threads_array[id])
-		goto err;
+	return wayca_graph_set_edge(wt_p, peer_p, weight);
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_thread_get_edge(wayca_sc_thread_t wthread,
+					       wayca_sc_thread_t peer,
+					       unsigned int *weight)
+{
+	struct wayca_thread *wt_p, *peer_p;
 
-	pthread_mutex_unlock(&wayca_threads_array_mutex);
+	wt_p = id_to_wayca_thread(wthread);
+	peer_p = id_to_wayca_thread(peer);
+	if (!wt_p || !peer_p || wt_p == peer_p || !weight)
+		return -EINVAL;
 
-	memset(wayca_threads_array[id], 0, sizeof(struct wayca_thread));
-	wayca_threads_array[id]->id = id;
+	*weight = wayca_graph_get_edge(wt_p, peer_p);
+	return 0;
+}
 
-	return wayca_threads_array[id];
-err:
-	pthread_mutex_unlock(&wayca_threads_array_mutex);
-	return NULL;
+static struct wayca_thread *wayca_thread_alloc(void)
+{
+	struct wayca_thread *thread;
+
+	thread = malloc(sizeof(struct wayca_thread));
+	if (!thread)
+		return NULL;
+
+	memset(thread, 0, sizeof(struct wayca_thread));
+	if (wayca_handle_alloc(&wayca_threads_table, thread, &thread->id)) {
+		free(thread);
+		return NULL;
+	}
+
+	return thread;
 }
 
 static void wayca_thread_free(struct wayca_thread *thread)
 {
+	wayca_graph_clear(thread);
 	wayca_thread_update_load(thread, false);
-	pthread_mutex_lock(&wayca_threads_array_mutex);
-	wayca_threads_array[thread->id] = NULL;
+	wayca_handle_free(&wayca_threads_table, thread->id);
 	free(thread);
-	pthread_mutex_unlock(&wayca_threads_array_mutex);
 }
 
 int WAYCA_SC_DECLSPEC wayca_sc_thread_create(wayca_sc_thread_t *wthread,
@@ -632,10 +747,11 @@ int WAYCA_SC_DECLSPEC wayca_sc_thread_create(wayca_sc_thread_t *wthread,
 
 	/**
 	 * We'll return until the user routine to be started,
-	 * this won't last long here.
+	 * this won't last long here. Yield meanwhile in case the
+	 * new thread is waiting for the CPU we're spinning on.
 	 */
 	while (!wt_p->start)
-		asm volatile("" : : : "memory");
+		sched_yield();
 
 	*wthread = wt_p->id;
 	return 0;
@@ -806,33 +922,36 @@ int WAYCA_SC_DECLSPEC wayca_sc_group_get_attr(wayca_sc_group_t group,
 
 static struct wayca_sc_group *wayca_group_alloc(void)
 {
-	wayca_sc_group_t id;
+	struct wayca_sc_group *group;
 
-	pthread_mutex_lock(&wayca_groups_array_mutex);
-	if (find_free_group_id_locked(&id) < 0)
-		goto err;
-
-	wayca_groups_array[id] = malloc(sizeof(struct wayca_sc_group));
-	if (!wayca_groups_array[id])
-		goto err;
+	group = malloc(sizeof(struct wayca_sc_group));
+	if (!group)
+		return NULL;
 
-	pthread_mutex_unlock(&wayca_groups_array_mutex);
+	memset(group, 0, sizeof(struct wayca_sc_group));
+	atomic_init(&group->refs, 1);
+	return group;
+}
 
-	memset(wayca_groups_array[id], 0, sizeof(struct wayca_sc_group));
-	wayca_groups_array[id]->id = id;
+static void wayca_group_put(struct wayca_sc_group *group)
+{
+	if (atomic_fetch_sub(&group->refs, 1) == 1)
+		free(group);
+}
 
-	return wayca_groups_array[id];
-err:
-	pthread_mutex_unlock(&wayca_groups_array_mutex);
-	return NULL;
+/*
+ * Only make the group seen in the table after it's initialized, as the
+ * rebalancer may walk it meanwhile.
+ */
+static int wayca_group_publish(struct wayca_sc_group *group)
+{
+	return wayca_handle_alloc(&wayca_groups_table, group, &group->id);
 }
 
 static void wayca_group_free(struct wayca_sc_group *group)
 {
-	pthread_mutex_lock(&wayca_groups_array_mutex);
-	wayca_groups_array[group->id] = NULL;
-	free(group);
-	pthread_mutex_unlock(&wayca_groups_array_mutex);
+	wayca_handle_free(&wayca_groups_table, group->id);
+	wayca_group_put(group);
 }
 
 int WAYCA_SC_DECLSPEC wayca_sc_group_create(wayca_sc_group_t *group)
@@ -848,8 +967,10 @@ int WAYCA_SC_DECLSPEC wayca_sc_group_create(wayca_sc_group_t *group)
 		return -ENOMEM;
 
 	ret = wayca_group_init(wg_p);
+	if (!ret)
+		ret = wayca_group_publish(wg_p);
 	if (ret < 0) {
-		wayca_group_free(wg_p);
+		free(wg_p);
 		return ret;
 	}
 
@@ -1008,147 +1129,272 @@ int WAYCA_SC_DECLSPEC wayca_sc_is_group_in_group(wayca_sc_group_t target,
 	return is_group_in_father(wg_p, father_p);
 }
 
-static void threadpool_queue_task(struct wayca_threadpool *pool,
-			   struct wayca_threadpool_task *task)
+/*
+ * Take a reference of each group in the table, so the groups can be
+ * rebalanced out of the table lock and the others created or destroyed
+ * meanwhile.
+ */
+static int wayca_rebalance_collect(void *ptr, void *arg)
 {
-	if (threadpool_task_is_empty(pool)) {
-		WAYCA_SC_ASSERT(!pool->task_num);
-		pool->task_head = task;
-		pool->task_head->next = task;
-		pool->task_head->prev = task;
-	} else {
-		struct wayca_threadpool_task *prev, *next;
+	struct wayca_sc_group *group = ptr, **groups;
+	int max;
 
-		WAYCA_SC_ASSERT(pool->task_num);
-		prev = pool->task_head->prev;
-		next = pool->task_head;
+	if (wayca_rebalancer.nr_groups == wayca_rebalancer.max_groups) {
+		max = wayca_rebalancer.max_groups ? wayca_rebalancer.max_groups * 2 : 64;
+		groups = realloc(wayca_rebalancer.groups, max * sizeof(*groups));
+		if (!groups)
+			return -ENOMEM;
 
-		next->prev = task;
-		task->next = next;
-		task->prev = prev;
-		prev->next = task;
+		wayca_rebalancer.groups = groups;
+		wayca_rebalancer.max_groups = max;
 	}
 
-	pool->task_num++;
+	atomic_fetch_add(&group->refs, 1);
+	wayca_rebalancer.groups[wayca_rebalancer.nr_groups++] = group;
+	return 0;
+}
+
+static void wayca_rebalance_one(struct wayca_sc_group *group,
+				const long long *wait)
+{
+	/* Moving a thread away splits it from the threads it talks to */
+	pthread_mutex_lock(&group->mutex);
+	if (group->nr_threads && !(group->attribute & WT_GF_AFFINE_GRAPH))
+		wayca_group_rebalance(group, wait, wayca_rebalancer.tick);
+	pthread_mutex_unlock(&group->mutex);
 }
 
-static struct wayca_threadpool_task *
-threadpool_dequeue_task(struct wayca_threadpool *pool)
+/* Sample the run queue wait of the CPUs and rebalance each group */
+static void wayca_rebalance_groups(void)
 {
-	struct wayca_threadpool_task *queue, *next, *prev;
+	unsigned long long *run_delay = wayca_rebalancer.run_delay;
+	long long *wait = wayca_rebalancer.wait;
+	int nr_cpus = wayca_rebalancer.nr_cpus;
+	bool sampled;
 
-	if (threadpool_task_is_empty(pool))
-		return NULL;
+	/* Smooth the wait the same as the wait of the threads */
+	sampled = !wayca_cpu_wait_read(wayca_rebalancer.run_delay, nr_cpus);
+	for (int cpu = 0; cpu < nr_cpus && sampled; cpu++) {
+		long long delta = run_delay[cpu] - run_delay[nr_cpus + cpu];
 
-	queue = pool->task_head;
-	WAYCA_SC_ASSERT(queue);
-
-	/* If there is only one task in the queue */
-	if (queue->next == queue) {
-		WAYCA_SC_ASSERT(pool->task_num == 1);
-		pool->task_head = NULL;
-	} else {
-		WAYCA_SC_ASSERT(pool->task_num >= 2);
-		next = queue->next;
-		prev = queue->prev;
-
-		next->prev = prev;
-		prev->next = next;
-		pool->task_head = next;
+		if (wayca_rebalancer.sampled)
+			wait[cpu] += (delta - wait[cpu]) / 2;
+		run_delay[nr_cpus + cpu] = run_delay[cpu];
 	}
 
-	pool->task_num--;
-	return queue;
+	/* Nothing to compare with on the first sample */
+	if (!sampled || !wayca_rebalancer.sampled)
+		wait = NULL;
+	wayca_rebalancer.sampled = sampled;
+
+	wayca_rebalancer.tick++;
+
+	/* Rebalance the groups taken so far even if out of memory */
+	wayca_rebalancer.nr_groups = 0;
+	wayca_handle_for_each(&wayca_groups_table, wayca_rebalance_collect, NULL);
+	for (int i = 0; i < wayca_rebalancer.nr_groups; i++) {
+		wayca_rebalance_one(wayca_rebalancer.groups[i], wait);
+		wayca_group_put(wayca_rebalancer.groups[i]);
+	}
 }
 
-static void *wayca_threadpool_worker_func(void *priv)
+static void *wayca_rebalance_routine(void *arg)
 {
-	struct wayca_threadpool *pool = priv;
-	struct wayca_threadpool_task *task;
+	struct timespec ts;
 
-	while (true) {
-		pthread_mutex_lock(&pool->mutex);
-		if (pool->stop) {
-			pthread_mutex_unlock(&pool->mutex);
-			break;
+	pthread_mutex_lock(&wayca_rebalancer.mutex);
+	while (!wayca_rebalancer.stop) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += wayca_rebalancer.period / 1000000000LL;
+		ts.tv_nsec += wayca_rebalancer.period % 1000000000LL;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
 		}
 
-		if (!pool->task_num) {
-			pthread_cond_wait(&pool->cond, &pool->mutex);
-			pthread_mutex_unlock(&pool->mutex);
-			continue;
-		}
+		while (!wayca_rebalancer.stop &&
+		       pthread_cond_timedwait(&wayca_rebalancer.cond,
+					      &wayca_rebalancer.mutex,
+					      &ts) != ETIMEDOUT)
+			;
+		if (wayca_rebalancer.stop)
+			break;
+
+		pthread_mutex_unlock(&wayca_rebalancer.mutex);
+		wayca_rebalance_groups();
+		pthread_mutex_lock(&wayca_rebalancer.mutex);
+	}
+	pthread_mutex_unlock(&wayca_rebalancer.mutex);
+
+	return NULL;
+}
 
-		WAYCA_SC_ASSERT(pool->task_head);
-		task = threadpool_dequeue_task(pool);
-		pool->idle_num--;
+int WAYCA_SC_DECLSPEC wayca_sc_group_rebalance_start(unsigned int period_ms)
+{
+	int nr_cpus = wayca_sc_cpus_in_total();
+	int ret = 0;
 
-		pthread_mutex_unlock(&pool->mutex);
+	if (!period_ms || nr_cpus <= 0)
+		return -EINVAL;
 
-		task->task(task->arg);
-		free(task);
+	pthread_mutex_lock(&wayca_rebalancer.mutex);
+	if (wayca_rebalancer.running) {
+		ret = -EBUSY;
+		goto out;
+	}
 
-		pthread_mutex_lock(&pool->mutex);
-		pool->idle_num++;
-		pthread_mutex_unlock(&pool->mutex);
+	/* The wait read last is kept after the one just read */
+	wayca_rebalancer.run_delay = calloc(nr_cpus * 2,
+					    sizeof(*wayca_rebalancer.run_delay));
+	wayca_rebalancer.wait = calloc(nr_cpus, sizeof(*wayca_rebalancer.wait));
+	if (!wayca_rebalancer.run_delay || !wayca_rebalancer.wait) {
+		ret = -ENOMEM;
+		goto err;
 	}
 
-	return NULL;
+	wayca_rebalancer.nr_cpus = nr_cpus;
+	wayca_rebalancer.period = period_ms * 1000000LL;
+	wayca_rebalancer.sampled = false;
+	wayca_rebalancer.stop = false;
+
+	ret = -pthread_create(&wayca_rebalancer.thread, NULL,
+			      wayca_rebalance_routine, NULL);
+	if (ret)
+		goto err;
+
+	wayca_rebalancer.running = true;
+	goto out;
+err:
+	free(wayca_rebalancer.run_delay);
+	wayca_rebalancer.run_delay = NULL;
+	free(wayca_rebalancer.wait);
+	wayca_rebalancer.wait = NULL;
+out:
+	pthread_mutex_unlock(&wayca_rebalancer.mutex);
+	return ret;
 }
 
-static struct wayca_threadpool *wayca_threadpool_alloc(size_t thread_num)
+int WAYCA_SC_DECLSPEC wayca_sc_group_rebalance_stop(void)
 {
-	wayca_sc_threadpool_t id;
+	pthread_mutex_lock(&wayca_rebalancer.mutex);
+	if (!wayca_rebalancer.running || wayca_rebalancer.stop) {
+		pthread_mutex_unlock(&wayca_rebalancer.mutex);
+		return -EINVAL;
+	}
 
-	pthread_mutex_lock(&wayca_threadpools_array_mutex);
-	if (find_free_threadpool_id_locked(&id) < 0)
-		goto err;
+	wayca_rebalancer.stop = true;
+	pthread_cond_signal(&wayca_rebalancer.cond);
+	pthread_mutex_unlock(&wayca_rebalancer.mutex);
+
+	pthread_join(wayca_rebalancer.thread, NULL);
+
+	pthread_mutex_lock(&wayca_rebalancer.mutex);
+	free(wayca_rebalancer.run_delay);
+	wayca_rebalancer.run_delay = NULL;
+	free(wayca_rebalancer.wait);
+	wayca_rebalancer.wait = NULL;
+	free(wayca_rebalancer.groups);
+	wayca_rebalancer.groups = NULL;
+	wayca_rebalancer.nr_groups = 0;
+	wayca_rebalancer.max_groups = 0;
+	wayca_rebalancer.running = false;
+	pthread_mutex_unlock(&wayca_rebalancer.mutex);
+
+	return 0;
+}
+
+static struct wayca_threadpool *wayca_threadpool_alloc(size_t thread_num,
+						       size_t shard_num)
+{
+	struct wayca_threadpool *pool;
+
+	/* The pool has members aligned to the cache line */
+	if (posix_memalign((void **)&pool, WAYCA_SC_CACHELINE_SIZE,
+			   sizeof(struct wayca_threadpool)))
+		return NULL;
+	memset(pool, 0, sizeof(struct wayca_threadpool));
 
-	wayca_threadpools_array[id] = malloc(sizeof(struct wayca_threadpool));
-	if (!wayca_threadpools_array[id])
+	if (wayca_threadpool_setup(pool, thread_num, shard_num))
 		goto err;
-	memset(wayca_threadpools_array[id], 0, sizeof(struct wayca_threadpool));
 
-	wayca_threadpools_array[id]->workers = malloc(thread_num *
-						sizeof(struct wayca_threads *));
-	if (!wayca_threadpools_array[id]) {
-		free(wayca_threadpools_array[id]);
-		wayca_threadpools_array[id] = NULL;
+	if (wayca_handle_alloc(&wayca_threadpools_table, pool, &pool->id)) {
+		wayca_threadpool_cleanup(pool);
 		goto err;
 	}
 
-	pthread_mutex_unlock(&wayca_threadpools_array_mutex);
-	wayca_threadpools_array[id]->id = id;
-
-	return wayca_threadpools_array[id];
+	return pool;
 err:
-	pthread_mutex_unlock(&wayca_threadpools_array_mutex);
+	free(pool);
 	return NULL;
 }
 
 static void wayca_threadpool_free(struct wayca_threadpool *pool)
 {
-	pthread_mutex_lock(&wayca_threadpools_array_mutex);
-	wayca_threadpools_array[pool->id] = NULL;
-	free(pool->workers);
+	wayca_threadpool_cleanup(pool);
+
+	wayca_handle_free(&wayca_threadpools_table, pool->id);
 	free(pool);
-	pthread_mutex_unlock(&wayca_threadpools_array_mutex);
+}
+
+int wayca_threadpool_spawn(struct wayca_threadpool *pool,
+			   struct wayca_threadpool_worker *worker,
+			   pthread_attr_t *attr)
+{
+	pthread_attr_t stack_attr;
+	wayca_sc_thread_t wthread;
+	int ret;
+
+	/* Reap the thread retired from this slot */
+	if (worker->thread) {
+		wayca_sc_thread_join(worker->thread->id, NULL);
+		worker->thread = NULL;
+	}
+
+	if (!attr && pool->stack_size) {
+		pthread_attr_init(&stack_attr);
+		pthread_attr_setstacksize(&stack_attr, pool->stack_size);
+		attr = &stack_attr;
+	}
+
+	atomic_store(&worker->live, true);
+	atomic_fetch_add(&pool->idle_num, 1);
+
+	ret = wayca_sc_thread_create(&wthread, attr,
+				     wayca_threadpool_worker_func, worker);
+	if (attr == &stack_attr)
+		pthread_attr_destroy(&stack_attr);
+	if (ret)
+		goto err;
+
+	worker->thread = id_to_wayca_thread(wthread);
+
+	ret = wayca_sc_thread_attach_group(wthread, pool->group->id);
+	if (ret) {
+		wayca_sc_thread_kill(wthread, SIGKILL);
+		wayca_sc_thread_join(wthread, NULL);
+		worker->thread = NULL;
+		goto err;
+	}
+
+	atomic_fetch_add(&pool->total_worker_num, 1);
+	return 0;
+err:
+	atomic_store(&worker->live, false);
+	atomic_fetch_sub(&pool->idle_num, 1);
+	return ret;
 }
 
 static int wayca_threadpool_init(struct wayca_threadpool *pool,
-				 pthread_attr_t *attr, size_t num)
+				 pthread_attr_t *attr, size_t min,
+				 wayca_sc_group_attr_t group_attr)
 {
-	wayca_sc_group_attr_t group_attr;
-	struct wayca_thread *thread;
 	wayca_sc_group_t wgroup;
-	wayca_sc_thread_t wthread;
-	int ret, worker_num;
+	int ret;
 
 	ret = wayca_sc_group_create(&wgroup);
 	if (ret)
 		return ret;
 
-	group_attr = WT_GF_CPU | WT_GF_COMPACT | WT_GF_PERCPU;
 	ret = wayca_sc_group_set_attr(wgroup, &group_attr);
 	if (ret) {
 		wayca_sc_group_destroy(wgroup);
@@ -1156,82 +1402,324 @@ static int wayca_threadpool_init(struct wayca_threadpool *pool,
 	}
 
 	pool->group = id_to_wayca_group(wgroup);
-	pool->stop = false;
 	pthread_mutex_init(&pool->mutex, NULL);
-	pthread_cond_init(&pool->cond, NULL);
+	pool->min_worker_num = min;
+	if (attr)
+		pthread_attr_getstacksize(attr, &pool->stack_size);
 
-	for (worker_num = 0; worker_num < num; worker_num++) {
-		ret = wayca_sc_thread_create(&wthread, attr,
-					wayca_threadpool_worker_func, pool);
-		if (ret)
+	pthread_mutex_lock(&pool->resize_mutex);
+	for (size_t i = 0; i < min; i++)
+		if (wayca_threadpool_spawn(pool, &pool->workers[i], attr))
 			break;
 
-		thread = id_to_wayca_thread(wthread);
-		pool->workers[worker_num] = thread;
+	wayca_threadpool_build_victims(pool);
+	pthread_mutex_unlock(&pool->resize_mutex);
 
-		ret = wayca_sc_thread_attach_group(wthread, wgroup);
-		if (ret) {
-			wayca_sc_thread_kill(wthread, SIGKILL);
-			wayca_sc_thread_join(wthread, NULL);
-			break;
-		}
+	return 0;
+}
+
+/*
+ * Limit the working threads of @pool to @cpus, or all the CPUs if
+ * @cpus is empty, and rebuild the victims as they're placed.
+ */
+static void wayca_threadpool_restrict(struct wayca_threadpool *pool,
+				      cpu_set_t *cpus)
+{
+	struct wayca_sc_group *group = pool->group;
+
+	pthread_mutex_lock(&pool->resize_mutex);
+	pthread_mutex_lock(&group->mutex);
+	if (CPU_EQUAL(&group->limit, cpus)) {
+		pthread_mutex_unlock(&group->mutex);
+		pthread_mutex_unlock(&pool->resize_mutex);
+		return;
 	}
 
-	pool->total_worker_num = worker_num;
-	pool->idle_num = worker_num;
-	pool->task_head = NULL;
-	pool->task_num = 0;
+	memcpy(&group->limit, cpus, sizeof(cpu_set_t));
+	wayca_group_rearrange_group(group);
+	pthread_mutex_unlock(&group->mutex);
 
-	return 0;
+	wayca_threadpool_build_victims(pool);
+	pthread_mutex_unlock(&pool->resize_mutex);
 }
 
-ssize_t WAYCA_SC_DECLSPEC wayca_sc_threadpool_create(wayca_sc_threadpool_t *threadpool,
-						     pthread_attr_t *attr, size_t num)
+/*
+ * Split the @num CPUs in @cpus into contiguous ranges for the @pools in
+ * proportion to their weights, and add the range of @pools[i] to
+ * @sets[i]. A pool gets one CPU shared with the neighbour at least.
+ */
+static void wayca_budget_split(int *cpus, int num,
+			       struct wayca_threadpool **pools, int pool_num,
+			       cpu_set_t *sets)
 {
-	struct wayca_threadpool *pool;
+	unsigned long long total = 0, sum = 0;
+	int begin, end;
 
-	if (!threadpool || !num)
-		return -EINVAL;
+	for (int i = 0; i < pool_num; i++)
+		total += pools[i]->weight;
 
-	pool = wayca_threadpool_alloc(num);
-	if (!pool)
-		return -ENOMEM;
+	for (int i = 0; i < pool_num; i++) {
+		begin = sum * num / total;
+		sum += pools[i]->weight;
+		end = max((int)(sum * num / total), begin + 1);
 
-	if (wayca_threadpool_init(pool, attr, num)) {
-		wayca_threadpool_free(pool);
-		return -ENOMEM;
+		for (int j = begin; j < end; j++)
+			CPU_SET(cpus[j], &sets[i]);
 	}
-
-	*threadpool = pool->id;
-	return pool->total_worker_num;
 }
 
-int WAYCA_SC_DECLSPEC wayca_sc_threadpool_destroy(wayca_sc_threadpool_t threadpool)
+/* A pool is idle if all the working threads are parked with nothing to do */
+static bool wayca_threadpool_is_idle(struct wayca_threadpool *pool)
 {
-	struct wayca_threadpool *pool;
-	struct wayca_threadpool_task *task;
-
-	pool = id_to_wayca_threadpool(threadpool);
-	if (!pool)
-		return -EINVAL;
+	return atomic_load(&pool->sleep_num) == atomic_load(&pool->total_worker_num) &&
+	       !atomic_load(&pool->task_num) && !atomic_load(&pool->local_num);
+}
 
-	/* Wait for the finish of current running tasks */
-	pthread_mutex_lock(&pool->mutex);
-	pool->stop = true;
-	pthread_cond_broadcast(&pool->cond);
-	pthread_mutex_unlock(&pool->mutex);
+/*
+ * Partition the CPUs among the pools in the budget, and lend the
+ * ones of the idle pools to the busy ones if @lend. The caller should
+ * hold @wayca_budget_mutex.
+ */
+static int wayca_budget_rebalance_locked(bool lend)
+{
+	int pool_num = 0, busy_num = 0, cpu_num = 0, lent_num = 0;
+	struct wayca_threadpool **pools, **busy, *pool;
+	cpu_set_t *sets, *borrowed, lent_set;
+	int *cpus, *lent;
+	bool *idle;
+
+	for (pool = wayca_budget_pools; pool; pool = pool->budget_next)
+		pool_num++;
+	if (!pool_num)
+		return 0;
+
+	/* There may be many pools, keep their sets off the stack */
+	pools = malloc(2 * pool_num * sizeof(*pools));
+	sets = calloc(2 * pool_num, sizeof(*sets));
+	idle = calloc(pool_num, sizeof(*idle));
+	cpus = malloc(2 * CPU_SETSIZE * sizeof(*cpus));
+	if (!pools || !sets || !idle || !cpus) {
+		free(pools);
+		free(sets);
+		free(idle);
+		free(cpus);
+		return -ENOMEM;
+	}
+	busy = pools + pool_num;
+	borrowed = sets + pool_num;
+	lent = cpus + CPU_SETSIZE;
+
+	pool_num = 0;
+	for (pool = wayca_budget_pools; pool; pool = pool->budget_next)
+		pools[pool_num++] = pool;
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &total_cpu_set))
+			cpus[cpu_num++] = cpu;
+
+	wayca_budget_split(cpus, cpu_num, pools, pool_num, sets);
+	for (int i = 0; i < pool_num; i++)
+		memcpy(&pools[i]->budget_own, &sets[i], sizeof(cpu_set_t));
+
+	CPU_ZERO(&lent_set);
+	for (int i = 0; lend && i < pool_num; i++) {
+		idle[i] = wayca_threadpool_is_idle(pools[i]);
+		if (idle[i])
+			CPU_OR(&lent_set, &lent_set, &sets[i]);
+		else
+			busy[busy_num++] = pools[i];
+	}
 
-	for (int worker = 0; worker < pool->total_worker_num; worker++)
-		wayca_sc_thread_join(pool->workers[worker]->id, NULL);
+	/* The CPUs of the idle pools go to the busy ones in proportion too */
+	if (busy_num && CPU_COUNT(&lent_set)) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &lent_set))
+				lent[lent_num++] = cpu;
 
-	pthread_mutex_lock(&pool->mutex);
-	wayca_sc_group_destroy(pool->group->id);
+		wayca_budget_split(lent, lent_num, busy, busy_num, borrowed);
+		for (int i = 0, j = 0; i < pool_num; i++)
+			if (!idle[i])
+				CPU_OR(&sets[i], &sets[i], &borrowed[j++]);
+	}
+
+	/*
+	 * Mark the lenders first, so the tasks queued meanwhile reclaim,
+	 * and the reclaims asked before are covered by the sets here.
+	 */
+	for (int i = 0; i < pool_num; i++) {
+		atomic_store(&pools[i]->lent, idle[i] && busy_num);
+		atomic_store(&pools[i]->reclaim, false);
+	}
+
+	for (int i = 0; i < pool_num; i++) {
+		memcpy(&pools[i]->budget_cpus, &sets[i], sizeof(cpu_set_t));
+		wayca_threadpool_restrict(pools[i], &sets[i]);
+	}
+
+	free(pools);
+	free(sets);
+	free(idle);
+	free(cpus);
+	return 0;
+}
+
+void wayca_threadpool_budget_reclaim(struct wayca_threadpool *pool)
+{
+	struct wayca_threadpool *other;
+	cpu_set_t cpus;
+
+	pthread_mutex_lock(&wayca_budget_mutex);
+
+	/* It has left the budget or lent the CPUs again since */
+	if (!pool->weight || atomic_load(&pool->lent)) {
+		pthread_mutex_unlock(&wayca_budget_mutex);
+		return;
+	}
+
+	/* The borrowers keep their own CPUs, shared with us at the edge */
+	for (other = wayca_budget_pools; other; other = other->budget_next) {
+		if (other == pool)
+			continue;
+
+		CPU_AND(&cpus, &other->budget_cpus, &pool->budget_own);
+		CPU_XOR(&cpus, &other->budget_cpus, &cpus);
+		CPU_OR(&cpus, &cpus, &other->budget_own);
+		if (CPU_EQUAL(&cpus, &other->budget_cpus))
+			continue;
+
+		memcpy(&other->budget_cpus, &cpus, sizeof(cpu_set_t));
+		wayca_threadpool_restrict(other, &cpus);
+	}
+	pthread_mutex_unlock(&wayca_budget_mutex);
+}
+
+/* Set the weight of @pool in the budget, 0 to leave the budget */
+static int wayca_threadpool_set_weight(struct wayca_threadpool *pool,
+				       unsigned int weight, bool destroying)
+{
+	struct wayca_threadpool **pprev;
+	cpu_set_t all;
+	int ret;
+
+	pthread_mutex_lock(&wayca_budget_mutex);
+	if (weight && !pool->weight) {
+		/* The earlier pools get the lower CPUs */
+		for (pprev = &wayca_budget_pools; *pprev; pprev = &(*pprev)->budget_next)
+			;
+		pool->budget_next = NULL;
+		*pprev = pool;
+	} else if (!weight && pool->weight) {
+		for (pprev = &wayca_budget_pools; *pprev != pool;
+		     pprev = &(*pprev)->budget_next)
+			;
+		*pprev = pool->budget_next;
+		atomic_store(&pool->lent, false);
+
+		/* Back to all the CPUs unless it's going away */
+		if (!destroying) {
+			CPU_ZERO(&all);
+			wayca_threadpool_restrict(pool, &all);
+		}
+	}
+	pool->weight = weight;
+
+	ret = wayca_budget_rebalance_locked(false);
+	pthread_mutex_unlock(&wayca_budget_mutex);
+
+	return ret;
+}
+
+ssize_t WAYCA_SC_DECLSPEC wayca_sc_threadpool_create(wayca_sc_threadpool_t *threadpool,
+						     pthread_attr_t *attr, size_t num)
+{
+	return wayca_sc_threadpool_create_elastic(threadpool, attr, num, num);
+}
+
+ssize_t WAYCA_SC_DECLSPEC wayca_sc_threadpool_create_elastic(wayca_sc_threadpool_t *threadpool,
+							     pthread_attr_t *attr,
+							     size_t min, size_t max)
+{
+	struct wayca_threadpool *pool;
 
-	while (!threadpool_task_is_empty(pool)) {
-		task = threadpool_dequeue_task(pool);
-		free(task);
+	if (!threadpool || !min || min > max)
+		return -EINVAL;
+
+	pool = wayca_threadpool_alloc(max, 1);
+	if (!pool)
+		return -ENOMEM;
+
+	if (wayca_threadpool_init(pool, attr, min,
+				  WT_GF_CPU | WT_GF_COMPACT | WT_GF_PERCPU)) {
+		wayca_threadpool_free(pool);
+		return -ENOMEM;
+	}
+
+	/* Failing to join the budget is not fatal, just placed anywhere */
+	if (wayca_threadpool_default_weight)
+		wayca_threadpool_set_weight(pool, wayca_threadpool_default_weight,
+					    false);
+
+	*threadpool = pool->id;
+	return atomic_load(&pool->total_worker_num);
+}
+
+ssize_t WAYCA_SC_DECLSPEC wayca_sc_threadpool_create_numa(wayca_sc_threadpool_t *threadpool,
+							  pthread_attr_t *attr, size_t num)
+{
+	struct wayca_threadpool *pool;
+	int nodes;
+
+	if (!threadpool || !num)
+		return -EINVAL;
+
+	/* Only one shard if the NUMA topology is unknown */
+	nodes = wayca_sc_nodes_in_total();
+	if (nodes <= 0)
+		nodes = 1;
+
+	pool = wayca_threadpool_alloc(num * nodes, nodes);
+	if (!pool)
+		return -ENOMEM;
+
+	/* The group places the threads on the nodes in turn */
+	if (wayca_threadpool_init(pool, attr, num * nodes, WT_GF_NUMA)) {
+		wayca_threadpool_free(pool);
+		return -ENOMEM;
 	}
 
+	*threadpool = pool->id;
+	return atomic_load(&pool->total_worker_num);
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_threadpool_destroy(wayca_sc_threadpool_t threadpool)
+{
+	struct wayca_threadpool *pool;
+
+	pool = id_to_wayca_threadpool(threadpool);
+	if (!pool)
+		return -EINVAL;
+
+	if (atomic_load(&pool->taskgroup_num) || atomic_load(&pool->fiber_num))
+		return -EBUSY;
+
+	/* Give the CPUs to the others in the budget */
+	wayca_threadpool_set_weight(pool, 0, true);
+
+	/* Wait for the finish of current running tasks */
+	wayca_threadpool_stop(pool);
+
+	/* No one resizes the pool after it's stopped */
+	pthread_mutex_lock(&pool->resize_mutex);
+	pthread_mutex_unlock(&pool->resize_mutex);
+
+	/* The retired workers have exited, but still to be joined */
+	for (int worker = 0; worker < pool->max_worker_num; worker++)
+		if (pool->workers[worker].thread)
+			wayca_sc_thread_join(pool->workers[worker].thread->id, NULL);
+
+	pthread_mutex_lock(&pool->mutex);
+	wayca_sc_group_destroy(pool->group->id);
+
 	/**
 	 * We have to unlock the mutex before destroy it.
 	 * As mentioned in the manual:
@@ -1272,38 +1760,524 @@ int WAYCA_SC_DECLSPEC wayca_sc_threadpool_get_group(wayca_sc_threadpool_t thread
 	return 0;
 }
 
+int WAYCA_SC_DECLSPEC wayca_sc_threadpool_set_weight(wayca_sc_threadpool_t threadpool,
+						     unsigned int weight)
+{
+	struct wayca_threadpool *pool;
+	bool percpu;
+
+	pool = id_to_wayca_threadpool(threadpool);
+	if (!pool)
+		return -EINVAL;
+
+	pthread_mutex_lock(&pool->group->mutex);
+	percpu = (pool->group->attribute & WT_GF_TOPO_MASK) == WT_GF_CPU;
+	pthread_mutex_unlock(&pool->group->mutex);
+	if (!percpu)
+		return -EINVAL;
+
+	return wayca_threadpool_set_weight(pool, weight, false);
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_threadpool_budget_rebalance(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&wayca_budget_mutex);
+	ret = wayca_budget_rebalance_locked(true);
+	pthread_mutex_unlock(&wayca_budget_mutex);
+
+	return ret;
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_threadpool_set_attr(wayca_sc_threadpool_t threadpool,
+						   wayca_sc_threadpool_attr_t *attr)
+{
+	struct wayca_threadpool *pool;
+
+	if (!attr || (*attr & ~WT_PF_MASK))
+		return -EINVAL;
+
+	pool = id_to_wayca_threadpool(threadpool);
+	if (!pool)
+		return -EINVAL;
+
+	return wayca_threadpool_set_attr(pool, *attr);
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_threadpool_get_attr(wayca_sc_threadpool_t threadpool,
+						   wayca_sc_threadpool_attr_t *attr)
+{
+	struct wayca_threadpool *pool;
+
+	if (!attr)
+		return -EINVAL;
+
+	pool = id_to_wayca_threadpool(threadpool);
+	if (!pool)
+		return -EINVAL;
+
+	*attr = atomic_load(&pool->attribute);
+	return 0;
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_threadpool_get_steals(wayca_sc_threadpool_t threadpool,
+						     struct wayca_sc_threadpool_steals *steals)
+{
+	struct wayca_threadpool *pool;
+
+	if (!steals)
+		return -EINVAL;
+
+	pool = id_to_wayca_threadpool(threadpool);
+	if (!pool)
+		return -EINVAL;
+
+	wayca_threadpool_get_steals(pool, steals);
+	return 0;
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_threadpool_get_stats(wayca_sc_threadpool_t threadpool,
+						    struct wayca_sc_threadpool_stats *stats)
+{
+	struct wayca_threadpool *pool;
+
+	if (!stats)
+		return -EINVAL;
+
+	pool = id_to_wayca_threadpool(threadpool);
+	if (!pool)
+		return -EINVAL;
+
+	wayca_threadpool_get_stats(pool, stats);
+	return 0;
+}
+
 int WAYCA_SC_DECLSPEC wayca_sc_threadpool_queue(wayca_sc_threadpool_t threadpool,
 						wayca_sc_threadpool_task_func task_func,
 						void *arg)
 {
 	struct wayca_threadpool *pool;
-	struct wayca_threadpool_task *task;
-	int ret = 0;
 
 	pool = id_to_wayca_threadpool(threadpool);
 	if (!pool || !task_func)
 		return -EINVAL;
 
-	task = malloc(sizeof(struct wayca_threadpool_task));
-	if (!task) {
-		ret = -ENOMEM;
-		goto out;
+	return wayca_threadpool_queue(pool, NULL, WAYCA_SC_THREADPOOL_PRIO_DEFAULT,
+				      task_func, arg);
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_threadpool_queue_prio(wayca_sc_threadpool_t threadpool,
+						     int prio,
+						     wayca_sc_threadpool_task_func task_func,
+						     void *arg)
+{
+	struct wayca_threadpool *pool;
+
+	if (prio < WAYCA_SC_THREADPOOL_PRIO_HIGHEST ||
+	    prio > WAYCA_SC_THREADPOOL_PRIO_LOWEST)
+		return -EINVAL;
+
+	pool = id_to_wayca_threadpool(threadpool);
+	if (!pool || !task_func)
+		return -EINVAL;
+
+	return wayca_threadpool_queue(pool, NULL, prio, task_func, arg);
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_threadpool_queue_on(wayca_sc_threadpool_t threadpool,
+						   wayca_sc_group_attr_t topo, int id,
+						   wayca_sc_threadpool_task_func task_func,
+						   void *arg)
+{
+	struct wayca_threadpool *pool;
+
+	if (topo != WT_GF_CPU && topo != WT_GF_CCL &&
+	    topo != WT_GF_NUMA && topo != WT_GF_PACKAGE)
+		return -EINVAL;
+
+	if (id < 0)
+		return -EINVAL;
+
+	pool = id_to_wayca_threadpool(threadpool);
+	if (!pool || !task_func)
+		return -EINVAL;
+
+	return wayca_threadpool_queue_on(pool, topo, id, task_func, arg);
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_threadpool_queue_batch(wayca_sc_threadpool_t threadpool,
+						      wayca_sc_threadpool_task_func *task_funcs,
+						      void **args, size_t num)
+{
+	struct wayca_threadpool *pool;
+
+	pool = id_to_wayca_threadpool(threadpool);
+	if (!pool || !task_funcs)
+		return -EINVAL;
+
+	for (size_t i = 0; i < num; i++)
+		if (!task_funcs[i])
+			return -EINVAL;
+
+	if (!num)
+		return 0;
+
+	return wayca_threadpool_queue_batch(pool, NULL, task_funcs, args, num);
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_threadpool_queue_after(wayca_sc_threadpool_t threadpool,
+						      unsigned long long ns,
+						      wayca_sc_threadpool_task_func task_func,
+						      void *arg)
+{
+	struct wayca_threadpool *pool;
+
+	pool = id_to_wayca_threadpool(threadpool);
+	if (!pool || !task_func)
+		return -EINVAL;
+
+	return wayca_threadpool_queue_after(pool, ns, 0, task_func, arg, NULL);
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_threadpool_queue_periodic(wayca_sc_threadpool_t threadpool,
+							 unsigned long long ns,
+							 unsigned long long period,
+							 wayca_sc_threadpool_task_func task_func,
+							 void *arg, wayca_sc_timer_t *timer)
+{
+	struct wayca_threadpool *pool;
+
+	pool = id_to_wayca_threadpool(threadpool);
+	if (!pool || !task_func || !period)
+		return -EINVAL;
+
+	return wayca_threadpool_queue_after(pool, ns, period, task_func, arg, timer);
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_threadpool_cancel_timer(wayca_sc_threadpool_t threadpool,
+						       wayca_sc_timer_t timer)
+{
+	struct wayca_threadpool *pool;
+
+	pool = id_to_wayca_threadpool(threadpool);
+	if (!pool)
+		return -EINVAL;
+
+	return wayca_threadpool_cancel_timer(pool, timer);
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_threadpool_queue_fiber(wayca_sc_threadpool_t threadpool,
+						      wayca_sc_threadpool_task_func task_func,
+						      void *arg, wayca_sc_fiber_t *fiber)
+{
+	struct wayca_threadpool_fiber *f;
+	struct wayca_threadpool *pool;
+	wayca_sc_fiber_t id;
+	int ret;
+
+	if (!task_func)
+		return -EINVAL;
+
+	pool = id_to_wayca_threadpool(threadpool);
+	if (!pool)
+		return -EINVAL;
+
+	f = malloc(sizeof(struct wayca_threadpool_fiber));
+	if (!f)
+		return -ENOMEM;
+
+	/*
+	 * Queue it with the lock held, so it's not woken before set up
+	 * and its id is not released before it's stored.
+	 */
+	pthread_mutex_lock(&wayca_fibers_mutex);
+	ret = wayca_handle_alloc(&wayca_fibers_table, f, &id);
+	if (ret) {
+		pthread_mutex_unlock(&wayca_fibers_mutex);
+		free(f);
+		return ret;
 	}
 
-	task->pool = pool;
-	task->task = task_func;
-	task->arg = arg;
+	f->id = id;
+	ret = wayca_threadpool_queue_fiber(pool, f, task_func, arg);
+	if (ret) {
+		wayca_handle_free(&wayca_fibers_table, id);
+		pthread_mutex_unlock(&wayca_fibers_mutex);
+		free(f);
+		return ret;
+	}
+	pthread_mutex_unlock(&wayca_fibers_mutex);
 
-	pthread_mutex_lock(&pool->mutex);
-	threadpool_queue_task(pool, task);
+	if (fiber)
+		*fiber = id;
+	return 0;
+}
+
+void wayca_threadpool_fiber_release(struct wayca_threadpool_fiber *fiber)
+{
+	pthread_mutex_lock(&wayca_fibers_mutex);
+	wayca_handle_free(&wayca_fibers_table, fiber->id);
+	pthread_mutex_unlock(&wayca_fibers_mutex);
+
+	free(fiber);
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_fiber_self(wayca_sc_fiber_t *fiber)
+{
+	struct wayca_threadpool_fiber *f = wayca_threadpool_current_fiber();
+
+	if (!fiber)
+		return -EINVAL;
+
+	if (!f)
+		return -EPERM;
+
+	*fiber = f->id;
+	return 0;
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_fiber_yield(void)
+{
+	struct wayca_threadpool_fiber *f = wayca_threadpool_current_fiber();
+
+	if (!f)
+		return -EPERM;
+
+	wayca_threadpool_fiber_switch(f, THREADPOOL_FIBER_YIELD);
+	return 0;
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_fiber_park(void)
+{
+	struct wayca_threadpool_fiber *f = wayca_threadpool_current_fiber();
+
+	if (!f)
+		return -EPERM;
+
+	wayca_threadpool_fiber_switch(f, THREADPOOL_FIBER_PARK);
+	return 0;
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_fiber_wake(wayca_sc_fiber_t fiber)
+{
+	struct wayca_threadpool_fiber *f;
+	int ret = -EINVAL;
+
+	/* Hold the lock so the fiber won't be released meanwhile */
+	pthread_mutex_lock(&wayca_fibers_mutex);
+	f = wayca_handle_lookup(&wayca_fibers_table, fiber);
+	if (f)
+		ret = wayca_threadpool_fiber_wake(f);
+	pthread_mutex_unlock(&wayca_fibers_mutex);
 
-	if (pool->idle_num)
-		pthread_cond_signal(&pool->cond);
-	pthread_mutex_unlock(&pool->mutex);
-out:
 	return ret;
 }
 
+int WAYCA_SC_DECLSPEC wayca_sc_parallel_for(wayca_sc_threadpool_t threadpool,
+					    size_t begin, size_t end, size_t grain,
+					    wayca_sc_parallel_for_func func,
+					    void *ctx)
+{
+	struct wayca_threadpool *pool;
+
+	pool = id_to_wayca_threadpool(threadpool);
+	if (!pool || !func || begin > end)
+		return -EINVAL;
+
+	if (begin == end)
+		return 0;
+
+	return wayca_threadpool_parallel_for(pool, begin, end, grain, func, ctx);
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_taskgroup_create(wayca_sc_taskgroup_t *taskgroup,
+						wayca_sc_threadpool_t threadpool)
+{
+	struct wayca_threadpool_taskgroup *tg;
+	struct wayca_threadpool *pool;
+	wayca_sc_taskgroup_t id;
+	int ret;
+
+	if (!taskgroup)
+		return -EINVAL;
+
+	pool = id_to_wayca_threadpool(threadpool);
+	if (!pool)
+		return -EINVAL;
+
+	tg = malloc(sizeof(struct wayca_threadpool_taskgroup));
+	if (!tg)
+		return -ENOMEM;
+
+	wayca_threadpool_taskgroup_init(tg, pool);
+	ret = wayca_handle_alloc(&wayca_taskgroups_table, tg, &id);
+	if (ret) {
+		wayca_threadpool_taskgroup_fini(tg);
+		free(tg);
+		return ret;
+	}
+	tg->id = id;
+
+	*taskgroup = id;
+	return 0;
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_taskgroup_destroy(wayca_sc_taskgroup_t taskgroup)
+{
+	struct wayca_threadpool_taskgroup *tg;
+	int ret;
+
+	tg = id_to_wayca_taskgroup(taskgroup);
+	if (!tg)
+		return -EINVAL;
+
+	ret = wayca_threadpool_taskgroup_fini(tg);
+	if (ret)
+		return ret;
+
+	wayca_handle_free(&wayca_taskgroups_table, taskgroup);
+	free(tg);
+
+	return 0;
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_taskgroup_eventfd(wayca_sc_taskgroup_t taskgroup)
+{
+	struct wayca_threadpool_taskgroup *tg;
+
+	tg = id_to_wayca_taskgroup(taskgroup);
+	if (!tg)
+		return -EINVAL;
+
+	return wayca_threadpool_taskgroup_eventfd(tg);
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_taskgroup_queue(wayca_sc_taskgroup_t taskgroup,
+					       wayca_sc_threadpool_task_func task_func,
+					       void *arg)
+{
+	struct wayca_threadpool_taskgroup *tg;
+
+	tg = id_to_wayca_taskgroup(taskgroup);
+	if (!tg || !task_func)
+		return -EINVAL;
+
+	return wayca_threadpool_queue(tg->pool, tg, WAYCA_SC_THREADPOOL_PRIO_DEFAULT,
+				      task_func, arg);
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_threadpool_wait(wayca_sc_taskgroup_t taskgroup)
+{
+	struct wayca_threadpool_taskgroup *tg;
+
+	tg = id_to_wayca_taskgroup(taskgroup);
+	if (!tg)
+		return -EINVAL;
+
+	wayca_threadpool_wait(tg);
+	return 0;
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_taskgraph_create(wayca_sc_taskgraph_t *taskgraph,
+						wayca_sc_threadpool_t threadpool)
+{
+	struct wayca_threadpool_taskgraph *graph;
+	struct wayca_threadpool *pool;
+	wayca_sc_taskgraph_t id;
+	int ret;
+
+	if (!taskgraph)
+		return -EINVAL;
+
+	pool = id_to_wayca_threadpool(threadpool);
+	if (!pool)
+		return -EINVAL;
+
+	graph = malloc(sizeof(struct wayca_threadpool_taskgraph));
+	if (!graph)
+		return -ENOMEM;
+
+	wayca_threadpool_taskgraph_init(graph, pool);
+	ret = wayca_handle_alloc(&wayca_taskgraphs_table, graph, &id);
+	if (ret) {
+		wayca_threadpool_taskgraph_fini(graph);
+		free(graph);
+		return ret;
+	}
+	graph->id = id;
+
+	*taskgraph = id;
+	return 0;
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_taskgraph_destroy(wayca_sc_taskgraph_t taskgraph)
+{
+	struct wayca_threadpool_taskgraph *graph;
+	int ret;
+
+	graph = id_to_wayca_taskgraph(taskgraph);
+	if (!graph)
+		return -EINVAL;
+
+	ret = wayca_threadpool_taskgraph_fini(graph);
+	if (ret)
+		return ret;
+
+	wayca_handle_free(&wayca_taskgraphs_table, taskgraph);
+	free(graph);
+
+	return 0;
+}
+
+ssize_t WAYCA_SC_DECLSPEC wayca_sc_taskgraph_add_task(wayca_sc_taskgraph_t taskgraph,
+						      wayca_sc_threadpool_task_func task_func,
+						      void *arg)
+{
+	struct wayca_threadpool_taskgraph *graph;
+
+	graph = id_to_wayca_taskgraph(taskgraph);
+	if (!graph || !task_func)
+		return -EINVAL;
+
+	return wayca_threadpool_taskgraph_add_task(graph, task_func, arg);
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_taskgraph_add_edge(wayca_sc_taskgraph_t taskgraph,
+						  size_t from, size_t to)
+{
+	struct wayca_threadpool_taskgraph *graph;
+
+	graph = id_to_wayca_taskgraph(taskgraph);
+	if (!graph)
+		return -EINVAL;
+
+	return wayca_threadpool_taskgraph_add_edge(graph, from, to);
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_taskgraph_run(wayca_sc_taskgraph_t taskgraph)
+{
+	struct wayca_threadpool_taskgraph *graph;
+
+	graph = id_to_wayca_taskgraph(taskgraph);
+	if (!graph)
+		return -EINVAL;
+
+	return wayca_threadpool_taskgraph_run(graph);
+}
+
+int WAYCA_SC_DECLSPEC wayca_sc_taskgraph_wait(wayca_sc_taskgraph_t taskgraph)
+{
+	struct wayca_threadpool_taskgraph *graph;
+
+	graph = id_to_wayca_taskgraph(taskgraph);
+	if (!graph)
+		return -EINVAL;
+
+	wayca_threadpool_wait(&graph->taskgroup);
+	return 0;
+}
+
 ssize_t WAYCA_SC_DECLSPEC wayca_sc_threadpool_thread_num(wayca_sc_threadpool_t threadpool)
 {
 	struct wayca_threadpool *pool;
@@ -1312,7 +2286,7 @@ ssize_t WAYCA_SC_DECLSPEC wayca_sc_threadpool_thread_num(wayca_sc_threadpool_t t
 	if (!pool)
 		return -EINVAL;
 
-	return pool->total_worker_num;
+	return atomic_load(&pool->total_worker_num);
 }
 
 ssize_t WAYCA_SC_DECLSPEC wayca_sc_threadpool_task_num(wayca_sc_threadpool_t threadpool)
@@ -1324,9 +2298,7 @@ ssize_t WAYCA_SC_DECLSPEC wayca_sc_threadpool_task_num(wayca_sc_threadpool_t thr
 	if (!pool)
 		return -EINVAL;
 
-	pthread_mutex_lock(&pool->mutex);
-	task_num = pool->task_num;
-	pthread_mutex_unlock(&pool->mutex);
+	task_num = atomic_load(&pool->task_num) + atomic_load(&pool->local_num);
 
 	return task_num;
 }
@@ -1340,9 +2312,8 @@ ssize_t WAYCA_SC_DECLSPEC wayca_sc_threadpool_running_num(wayca_sc_threadpool_t
 	if (!pool)
 		return -EINVAL;
 
-	pthread_mutex_lock(&pool->mutex);
-	running_num = pool->total_worker_num - pool->idle_num;
-	pthread_mutex_unlock(&pool->mutex);
+	running_num = atomic_load(&pool->total_worker_num) -
+		      atomic_load(&pool->idle_num);
 
 	return running_num;
 }
@@ -16,6 +16,7 @@
 
 #define _GNU_SOURCE
 #include <sched.h>
+#include <stdatomic.h>
 #include <syscall.h>
 
 #include "common.h"
@@ -48,11 +49,58 @@ static inline pid_t thread_sched_gettid(void)
 	return ret < 0 ? -errno : ret;
 }
 
-/* CPU set of all the cpus in the system */
+/* CPU set of all the online cpus in the system */
 extern cpu_set_t total_cpu_set;
-/* Load Array of each cpu, length is cores_in_total() */
-extern long long *wayca_cpu_loads;
-extern pthread_mutex_t wayca_cpu_loads_mutex;
+/*
+ * The load of a CPU, or the sum of the loads of the CPUs in a CCL or a
+ * node. Each one takes its own cache line as they're updated without
+ * locking by the threads being placed concurrently.
+ */
+struct wayca_load {
+	/* The wayca threads bound */
+	_Atomic long long load;
+	/* The CPU time taken by the others, sampled if enabled */
+	_Atomic long long util;
+} __cacheline_aligned;
+
+/* The topology levels the groups arrange their threads by */
+enum wayca_domain_level {
+	WAYCA_DOMAIN_CPU,
+	WAYCA_DOMAIN_CCL,
+	WAYCA_DOMAIN_NODE,
+	WAYCA_DOMAIN_PACKAGE,
+	WAYCA_DOMAIN_ALL,
+	WAYCA_DOMAIN_LEVELS,
+};
+
+/* A CPU, CCL, node, package, or all the CPUs */
+struct wayca_domain {
+	/* The online CPUs in the domain, never empty */
+	cpu_set_t cpus;
+	/* The first CPU in the domain */
+	int first;
+};
+
+/*
+ * The domains of one topology level, built from the CPU masks of the
+ * topology as the CPUs of a domain are not necessarily contiguous.
+ */
+struct wayca_domain_table {
+	struct wayca_domain *domains;
+	int nr;
+	/* The index of the domain of each CPU, -1 if offline */
+	int *cpu_domain;
+	/* The load of each domain, NULL if not accounted at this level */
+	struct wayca_load *loads;
+};
+
+extern struct wayca_domain_table wayca_domains[WAYCA_DOMAIN_LEVELS];
+
+/* An edge to the thread talking to, the heavier the more it talks */
+struct wayca_edge {
+	struct wayca_thread *peer;
+	unsigned int weight;
+};
 
 struct wayca_thread {
 	/* Wayca thread id which is identity to this thread */
@@ -68,6 +116,14 @@ struct wayca_thread {
 	struct wayca_thread *siblings;
 	/* Wayca group this thread directly belongs to */
 	struct wayca_sc_group *group;
+	/* The run queue wait in ns so far, and per rebalance period smoothed */
+	unsigned long long run_delay;
+	long long wait;
+	/* The rebalance period the thread was last migrated in */
+	unsigned long migrated;
+	/* The edges to the threads it talks to, under the graph mutex */
+	struct wayca_edge *edges;
+	int nr_edges;
 
 	/*
 	 * Following fields will be meaningful only if the thread is
@@ -82,7 +138,7 @@ struct wayca_thread {
 	/* The args for the routine */
 	void *arg;
 	/* Is the routine started ? */
-	bool start;
+	_Atomic bool start;
 };
 
 struct wayca_sc_group {
@@ -118,12 +174,27 @@ struct wayca_sc_group {
 	/* Stride for arranging the threads */
 	int stride;
 	int nr_cpus_per_topo;
+	/* The topology level to arrange the threads by */
+	enum wayca_domain_level level;
 	/* A hint to indicates where to request cpus, -1 means no hint */
 	int topo_hint;
 	/* Roll over cnts */
 	int roll_over_cnts;
+	/* The CPUs a top level group is limited to, no limit if empty */
+	cpu_set_t limit;
+	/*
+	 * The rebalance periods in a row the group is found imbalanced
+	 * between the same domains, and the hot * nr + cold of them.
+	 */
+	int imbalanced;
+	int imbalance;
+	/* Held by the table and the rebalancer, freed when dropped by both */
+	_Atomic int refs;
 };
 
+/* The bits of the group attribute for the topology to place the threads in */
+#define WT_GF_TOPO_MASK	0x0000ffff
+
 #define group_for_each_threads(thread, group)	\
 	for (thread = group->threads; thread != NULL; thread = thread->siblings)
 
@@ -151,47 +222,39 @@ int wayca_group_delete_group(struct wayca_sc_group *group, struct wayca_sc_group
 
 void wayca_thread_update_load(struct wayca_thread *thread, bool add);
 
-bool is_thread_in_group(struct wayca_sc_group *group, struct wayca_thread *thread);
+/* The cost in ns of moving a thread from CPU @from to CPU @to */
+long long wayca_migration_cost(int from, int to);
+/* Solve the places for the threads on @from to move to with the least cost */
+int wayca_migration_plan(const size_t *from, const size_t *to, int n, int *plan);
+void wayca_migration_init(int nr_cpus);
+void wayca_migration_exit(void);
 
-bool is_group_in_father(struct wayca_sc_group *group, struct wayca_sc_group *father);
+/* The edges between the threads, and partitioning the threads by them */
+int wayca_graph_set_edge(struct wayca_thread *thread,
+			 struct wayca_thread *peer, unsigned int weight);
+unsigned int wayca_graph_get_edge(struct wayca_thread *thread,
+				  struct wayca_thread *peer);
+void wayca_graph_clear(struct wayca_thread *thread);
+int wayca_graph_weights(struct wayca_thread *thread,
+			struct wayca_sc_group *group,
+			enum wayca_domain_level level, long long *weights);
+int wayca_graph_partition(struct wayca_thread **threads, int n,
+			  const int *caps, int nr_parts, int *order, int *part);
+void wayca_graph_init(void);
+void wayca_graph_exit(void);
 
-struct wayca_threadpool_task {
-	/* The wayca threadpool this task belongs to */
-	struct wayca_threadpool *pool;
-	/* The task function */
-	wayca_sc_threadpool_task_func task;
-	/* The argument of the task function */
-	void *arg;
-	/* Previous and next task in the queue of the threadpool */
-	struct wayca_threadpool_task *next, *prev;
-};
+/* Move a thread of the group to where its threads wait less for the CPUs */
+int wayca_group_rebalance(struct wayca_sc_group *group,
+			  const long long *wait, unsigned long tick);
 
-struct wayca_threadpool {
-	/* The taskpool id */
-	wayca_sc_threadpool_t id;
-	/* The wayca thread list of this threadpool */
-	struct wayca_thread **workers;
-	/* Total number of worker threads available in this threadpool */
-	size_t total_worker_num;
-	/* The number of idle workers in this threadpool */
-	size_t idle_num;
-	/* The head task on the queue waiting to run */
-	struct wayca_threadpool_task *task_head;
-	/* The number of the tasks in the queue */
-	size_t task_num;
-	/* The wayca sc group that the threads in this threadpool belongs to */
-	struct wayca_sc_group *group;
-	/* The mutex to protect this structure */
-	pthread_mutex_t mutex;
-	/* Conditonal variable to wakeup threads */
-	pthread_cond_t cond;
-	/* True to Notify the workers to stop */
-	bool stop;
-};
+/* Sample the CPU utilization into the loads once a period in a thread */
+void wayca_cpu_util_init(int nr_cpus);
+void wayca_cpu_util_exit(void);
+int wayca_cpu_wait_read(unsigned long long *wait, int nr_cpus);
+int wayca_task_wait_read(pid_t tid, unsigned long long *wait);
 
-static inline bool threadpool_task_is_empty(struct wayca_threadpool *pool)
-{
-	return pool->task_head == NULL;
-}
+bool is_thread_in_group(struct wayca_sc_group *group, struct wayca_thread *thread);
+
+bool is_group_in_father(struct wayca_sc_group *group, struct wayca_sc_group *father);
 
 #endif	/* _WAYCA_THREAD_H */
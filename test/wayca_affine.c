@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2021 HiSilicon Technologies Co., Ltd.
+ * Wayca scheduler is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+/*
+ * The test program for placing the threads talking to each other of
+ * Wayca scheduler.
+ *
+ * Usage: wayca_sc_test_affine [pairs]
+ *
+ * Create the pairs of threads talking to each other, each pair should be
+ * placed in a cluster by WT_GF_AFFINE_GRAPH, when they're attached as
+ * well as the group is arranged again.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <wayca-scheduler.h>
+
+#define AFFINE_PAIRS	2
+
+static int affine_pipe[2];
+
+static void *affine_func(void *arg)
+{
+	pid_t *tid = arg;
+	char c;
+
+	__atomic_store_n(tid, syscall(SYS_gettid), __ATOMIC_RELEASE);
+
+	/* Run until the pipe is closed */
+	while (read(affine_pipe[0], &c, 1) > 0)
+		;
+	return NULL;
+}
+
+/* The cluster of the first CPU the thread is bound to, or the node */
+static int affine_domain(pid_t tid)
+{
+	cpu_set_t cpuset;
+	int cpu = 0;
+
+	if (sched_getaffinity(tid, sizeof(cpuset), &cpuset))
+		return -errno;
+
+	while (!CPU_ISSET(cpu, &cpuset))
+		cpu++;
+
+	return wayca_sc_get_ccl_id(cpu) >= 0 ? wayca_sc_get_ccl_id(cpu) :
+					       wayca_sc_get_node_id(cpu);
+}
+
+static int affine_together(pid_t *tids, int pairs)
+{
+	int together = 0;
+
+	for (int i = 0; i < pairs; i++)
+		if (affine_domain(tids[i]) == affine_domain(tids[i + pairs]))
+			together++;
+
+	return together;
+}
+
+int main(int argc, char *argv[])
+{
+	wayca_sc_group_attr_t attr = WT_GF_CPU | WT_GF_PERCPU | WT_GF_AFFINE_GRAPH;
+	int pairs = argc > 1 ? atoi(argv[1]) : AFFINE_PAIRS;
+	int nr = pairs * 2, attached = 0, arranged = 0, ret, passed, i;
+	unsigned int weight = 0, dropped = 1;
+	wayca_sc_thread_t *threads;
+	wayca_sc_group_t group;
+	pid_t *tids;
+
+	if (pairs <= 0)
+		return 1;
+
+	threads = calloc(nr, sizeof(*threads));
+	tids = calloc(nr, sizeof(*tids));
+	if (!threads || !tids || pipe(affine_pipe)) {
+		free(threads);
+		free(tids);
+		return 1;
+	}
+
+	ret = wayca_sc_group_create(&group);
+	if (!ret)
+		ret = wayca_sc_group_set_attr(group, &attr);
+
+	for (i = 0; !ret && i < nr; i++)
+		ret = wayca_sc_thread_create(&threads[i], NULL, affine_func, &tids[i]);
+	nr = ret ? i - 1 : i;
+
+	for (i = 0; !ret && i < pairs; i++)
+		ret = wayca_sc_thread_set_edge(threads[i], threads[i + pairs], i + 1);
+
+	for (i = 0; !ret && i < nr; i++) {
+		while (!__atomic_load_n(&tids[i], __ATOMIC_ACQUIRE))
+			sched_yield();
+		ret = wayca_sc_thread_attach_group(threads[i], group);
+	}
+
+	if (!ret) {
+		attached = affine_together(tids, pairs);
+		ret = wayca_sc_group_set_attr(group, &attr);
+		arranged = affine_together(tids, pairs);
+		wayca_sc_thread_get_edge(threads[pairs], threads[0], &weight);
+
+		/* Dropping the edge drops it from the peer too */
+		ret = wayca_sc_thread_set_edge(threads[0], threads[pairs], 0);
+		if (!ret && (wayca_sc_thread_get_edge(threads[pairs], threads[0],
+						      &dropped) || dropped))
+			ret = -EINVAL;
+	}
+
+	close(affine_pipe[1]);
+	for (i = 0; i < nr; i++)
+		wayca_sc_thread_join(threads[i], NULL);
+	close(affine_pipe[0]);
+
+	wayca_sc_group_destroy(group);
+
+	passed = !ret && weight == 1 && attached == pairs && arranged == pairs;
+	printf("Affine graph: %d/%d pairs together when attached, %d/%d arranged %s\n",
+	       attached, pairs, arranged, pairs, passed ? "passed" : "failed");
+
+	free(threads);
+	free(tids);
+	return !passed;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2021 HiSilicon Technologies Co., Ltd.
+ * Wayca scheduler is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+/*
+ * The test program for sharing the CPUs among the threadpools by the
+ * weight of Wayca scheduler.
+ *
+ * Usage: wayca_sc_test_budget [threads]
+ *
+ * Share the CPUs among BUDGET_POOLS pools weighted 1, 2, ..., let them
+ * lend their CPUs to the others while they're idle, and take them back
+ * by running tasks on them.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <wayca-scheduler.h>
+
+#define BUDGET_POOLS	3
+
+static long budget_finished;
+
+static void budget_func(void *priv)
+{
+	__atomic_add_fetch(&budget_finished, 1, __ATOMIC_RELAXED);
+}
+
+int main(int argc, char *argv[])
+{
+	int thread_num = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_CONF);
+	wayca_sc_threadpool_t pools[BUDGET_POOLS];
+	int ret = 0, num = 0, passed;
+
+	if (thread_num <= 0)
+		return 1;
+
+	for (; num < BUDGET_POOLS; num++) {
+		ret = wayca_sc_threadpool_create(&pools[num], NULL, thread_num);
+		if (ret <= 0)
+			break;
+
+		ret = wayca_sc_threadpool_set_weight(pools[num], num + 1);
+		if (ret) {
+			wayca_sc_threadpool_destroy(pools[num]);
+			break;
+		}
+	}
+
+	if (!ret)
+		ret = wayca_sc_threadpool_budget_rebalance();
+
+	for (int i = 0; !ret && i < num; i++)
+		for (int j = 0; !ret && j < thread_num; j++)
+			ret = wayca_sc_threadpool_queue(pools[i], budget_func, NULL);
+
+	for (int i = 0; i < num; i++) {
+		while (wayca_sc_threadpool_running_num(pools[i]) ||
+		       wayca_sc_threadpool_task_num(pools[i]))
+			sched_yield();
+		if (wayca_sc_threadpool_destroy(pools[i]))
+			ret = -EBUSY;
+	}
+
+	passed = !ret && num == BUDGET_POOLS &&
+		 budget_finished == (long)num * thread_num;
+	printf("Budget: %ld/%d tasks of %d pools %s\n", budget_finished,
+	       num * thread_num, num, passed ? "passed" : "failed");
+
+	return !passed;
+}
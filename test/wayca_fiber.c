@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2021 HiSilicon Technologies Co., Ltd.
+ * Wayca scheduler is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+/*
+ * The test program for the fibers of the threadpool of Wayca scheduler.
+ *
+ * Usage: wayca_sc_test_fiber [fibers]
+ *
+ * Queue the fibers yielding and parking in turn, and keep waking them
+ * until all finished.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <wayca-scheduler.h>
+
+#define FIBER_NUM	64
+#define FIBER_ROUNDS	8
+
+static long fiber_rounds, fiber_finished, fiber_bad;
+
+/* Yield and park in turn, parking after waking ourselves returns at once */
+static void fiber_func(void *priv)
+{
+	wayca_sc_fiber_t self;
+
+	if (wayca_sc_fiber_self(&self))
+		__atomic_add_fetch(&fiber_bad, 1, __ATOMIC_RELAXED);
+
+	for (int i = 0; i < FIBER_ROUNDS; i++) {
+		if (wayca_sc_fiber_yield())
+			__atomic_add_fetch(&fiber_bad, 1, __ATOMIC_RELAXED);
+		if (i % 2 && wayca_sc_fiber_wake(self))
+			__atomic_add_fetch(&fiber_bad, 1, __ATOMIC_RELAXED);
+		if (wayca_sc_fiber_park())
+			__atomic_add_fetch(&fiber_bad, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&fiber_rounds, 1, __ATOMIC_RELAXED);
+	}
+
+	__atomic_add_fetch(&fiber_finished, 1, __ATOMIC_RELEASE);
+}
+
+static int run_fibers(wayca_sc_threadpool_t pool, int fiber_num)
+{
+	wayca_sc_fiber_t *fibers;
+	int ret = 0, i;
+
+	fibers = malloc(fiber_num * sizeof(*fibers));
+	if (!fibers)
+		return -ENOMEM;
+
+	for (i = 0; i < fiber_num; i++) {
+		ret = wayca_sc_threadpool_queue_fiber(pool, fiber_func, NULL, &fibers[i]);
+		if (ret)
+			break;
+	}
+
+	/* Out of the fibers, nothing to yield */
+	if (wayca_sc_fiber_yield() != -EPERM)
+		fiber_bad++;
+
+	/* Wait for the ones queued even if we failed to queue them all */
+	while (__atomic_load_n(&fiber_finished, __ATOMIC_ACQUIRE) < i) {
+		for (int j = 0; j < i; j++)
+			wayca_sc_fiber_wake(fibers[j]);
+		sched_yield();
+	}
+
+	/* The fibers finished have released their ids */
+	while (i && wayca_sc_fiber_wake(fibers[0]) != -EINVAL)
+		sched_yield();
+
+	free(fibers);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int fiber_num = argc > 1 ? atoi(argv[1]) : FIBER_NUM;
+	wayca_sc_threadpool_t pool;
+	int ret, passed;
+
+	if (fiber_num <= 0)
+		return 1;
+
+	ret = wayca_sc_threadpool_create(&pool, NULL, sysconf(_SC_NPROCESSORS_CONF));
+	if (ret <= 0)
+		return 1;
+
+	ret = run_fibers(pool, fiber_num);
+	passed = !ret && !fiber_bad && fiber_finished == fiber_num &&
+		 fiber_rounds == fiber_num * FIBER_ROUNDS;
+	printf("Fibers: %ld/%d finished, %ld/%d rounds %s\n",
+	       fiber_finished, fiber_num, fiber_rounds, fiber_num * FIBER_ROUNDS,
+	       passed ? "passed" : "failed");
+
+	wayca_sc_threadpool_destroy(pool);
+	return !passed;
+}
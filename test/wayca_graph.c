@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2021 HiSilicon Technologies Co., Ltd.
+ * Wayca scheduler is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+/*
+ * The test program for the graph of the threads talking to each other
+ * of Wayca scheduler.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+
+#include "../lib/wayca_thread.h"
+
+#define NR_THREADS	6
+
+static struct wayca_thread threads[NR_THREADS];
+
+/* The edges are kept by both the threads, and dropped by both */
+static void edge_case(void)
+{
+	struct wayca_thread *a = &threads[0], *b = &threads[1], *c = &threads[2];
+
+	assert(!wayca_graph_set_edge(a, b, 3));
+	assert(!wayca_graph_set_edge(c, a, 5));
+	assert(wayca_graph_get_edge(b, a) == 3);
+	assert(wayca_graph_get_edge(a, c) == 5);
+	assert(wayca_graph_get_edge(b, c) == 0);
+
+	/* Setting it again changes the weight only */
+	assert(!wayca_graph_set_edge(b, a, 4));
+	assert(wayca_graph_get_edge(a, b) == 4);
+	assert(a->nr_edges == 2 && b->nr_edges == 1);
+
+	/* No weight drops the edge */
+	assert(!wayca_graph_set_edge(a, b, 0));
+	assert(wayca_graph_get_edge(b, a) == 0);
+	assert(a->nr_edges == 1 && !b->nr_edges && !b->edges);
+
+	/* A thread freed leaves no edge on its peers alive */
+	assert(!wayca_graph_set_edge(a, b, 1));
+	wayca_graph_clear(a);
+	assert(!a->nr_edges && !a->edges);
+	assert(!b->nr_edges && !c->nr_edges);
+	assert(wayca_graph_get_edge(b, a) == 0);
+	assert(wayca_graph_get_edge(c, a) == 0);
+
+	printf("edge tests passed!\n");
+}
+
+/* The threads talking to each other are in the same part */
+static void partition_case(void)
+{
+	struct wayca_thread *list[NR_THREADS];
+	int order[NR_THREADS], part[NR_THREADS], where[NR_THREADS];
+	int caps[] = { 2, 2, 2 };
+
+	/* Pair the thread i with i + NR_THREADS / 2, heavier the later */
+	for (int i = 0; i < NR_THREADS / 2; i++)
+		assert(!wayca_graph_set_edge(&threads[i], &threads[i + NR_THREADS / 2],
+					     i + 1));
+
+	for (int i = 0; i < NR_THREADS; i++)
+		list[i] = &threads[i];
+	assert(!wayca_graph_partition(list, NR_THREADS, caps, 3, order, part));
+
+	memset(where, -1, sizeof(where));
+	for (int i = 0; i < NR_THREADS; i++) {
+		assert(where[order[i]] < 0);
+		where[order[i]] = part[i];
+	}
+
+	for (int i = 0; i < NR_THREADS / 2; i++) {
+		printf("thread %d and %d in part %d and %d\n", i, i + NR_THREADS / 2,
+		       where[i], where[i + NR_THREADS / 2]);
+		assert(where[i] == where[i + NR_THREADS / 2]);
+	}
+
+	for (int i = 0; i < NR_THREADS; i++)
+		wayca_graph_clear(&threads[i]);
+
+	printf("partition tests passed!\n");
+}
+
+int main(void)
+{
+	edge_case();
+	partition_case();
+
+	return 0;
+}
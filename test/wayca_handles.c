@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2021 HiSilicon Technologies Co., Ltd.
+ * Wayca scheduler is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+/*
+ * The test program for the ids of the handles of Wayca scheduler.
+ *
+ * Usage: wayca_sc_test_handles [handles]
+ *
+ * Create and destroy the short-lived threads and taskgroups, the ids of
+ * the destroyed ones should never be taken as the new ones.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <wayca-scheduler.h>
+
+#define HANDLE_NUM	1000
+
+static void *handle_func(void *arg)
+{
+	return arg;
+}
+
+int main(int argc, char *argv[])
+{
+	int handle_num = argc > 1 ? atoi(argv[1]) : HANDLE_NUM;
+	wayca_sc_thread_t thread, stale_thread = 0;
+	wayca_sc_taskgroup_t taskgroup, stale_taskgroup = 0;
+	struct timespec begin, end;
+	wayca_sc_threadpool_t pool;
+	long bad = 0;
+	int ret, i;
+
+	if (handle_num <= 0)
+		return 1;
+
+	ret = wayca_sc_threadpool_create(&pool, NULL, 1);
+	if (ret <= 0)
+		return 1;
+
+	ret = 0;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (i = 0; i < handle_num; i++) {
+		ret = wayca_sc_thread_create(&thread, NULL, handle_func, NULL);
+		if (ret)
+			break;
+		if (i && thread == stale_thread)
+			bad++;
+		wayca_sc_thread_join(thread, NULL);
+		stale_thread = thread;
+
+		ret = wayca_sc_taskgroup_create(&taskgroup, pool);
+		if (ret)
+			break;
+		if (i && taskgroup == stale_taskgroup)
+			bad++;
+		wayca_sc_taskgroup_destroy(taskgroup);
+		stale_taskgroup = taskgroup;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (i && (wayca_sc_thread_join(stale_thread, NULL) != -EINVAL ||
+		  wayca_sc_taskgroup_destroy(stale_taskgroup) != -EINVAL))
+		bad++;
+
+	printf("Handles: %d/%d created in %ld us %s\n", i, handle_num,
+	       (end.tv_sec - begin.tv_sec) * 1000000 +
+	       (end.tv_nsec - begin.tv_nsec) / 1000,
+	       !ret && !bad ? "passed" : "failed");
+
+	wayca_sc_threadpool_destroy(pool);
+	return ret || bad;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2021 HiSilicon Technologies Co., Ltd.
+ * Wayca scheduler is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+/*
+ * The test program for calibrating the migration cost of Wayca scheduler.
+ *
+ * Usage: wayca_sc_test_migration [file]
+ *
+ * Measure the migration cost into the file, /tmp/wayca_sc_migration_cost
+ * by default, and check the cost in use is the one just saved.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <wayca-scheduler.h>
+
+#define MIGRATION_FILE	"/tmp/wayca_sc_migration_cost"
+
+/* Compare the matrix saved in @path with the cost in use */
+static int check_matrix(const char *path)
+{
+	unsigned long long cost, saved;
+	char buf[256];
+	int nr, ret = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	do {
+		if (!fgets(buf, sizeof(buf), fp)) {
+			fclose(fp);
+			return -ENODATA;
+		}
+	} while (buf[0] == '#');
+
+	if (sscanf(buf, "%d", &nr) != 1 || nr != wayca_sc_cpus_in_total()) {
+		fclose(fp);
+		return -ENODATA;
+	}
+
+	for (int from = 0; from < nr && !ret; from++)
+		for (int to = 0; to < nr && !ret; to++) {
+			if (fscanf(fp, "%llu", &saved) != 1) {
+				ret = -ENODATA;
+				break;
+			}
+
+			/* The offline CPUs are refused */
+			if (wayca_sc_migration_cost(from, to, &cost))
+				continue;
+
+			if (cost != saved) {
+				printf("cost from CPU %d to %d is %llu, saved %llu\n",
+				       from, to, cost, saved);
+				ret = -EINVAL;
+			}
+		}
+	fclose(fp);
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = argc > 1 ? argv[1] : MIGRATION_FILE;
+	unsigned long long cost = 1;
+	int ret;
+
+	ret = wayca_sc_migration_cost_calibrate(path, 0);
+	printf("Calibrate into %s: %s\n", path, !ret ? "passed" : "failed");
+	if (ret)
+		return 1;
+
+	ret = check_matrix(path);
+	printf("Cost in use is the saved one: %s\n", !ret ? "passed" : "failed");
+	if (ret)
+		return 1;
+
+	ret = wayca_sc_migration_cost(0, 0, &cost) || cost ||
+	      wayca_sc_migration_cost(-1, 0, &cost) != -EINVAL;
+	printf("Cost of staying and of invalid CPUs: %s\n", !ret ? "passed" : "failed");
+
+	return ret;
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2021 HiSilicon Technologies Co., Ltd.
+ * Wayca scheduler is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+/*
+ * The test program for the parallel for of the threadpool of Wayca
+ * scheduler.
+ *
+ * Usage: wayca_sc_test_parallel_for [range]
+ *
+ * Sum up [0, range) in the chunks run in parallel, and again while all
+ * the working threads are busy, which the caller sums up by itself.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <wayca-scheduler.h>
+
+#define RANGE_NUM	1000000
+#define BUSY_THREADS	2
+
+static wayca_sc_threadpool_t pool;
+static unsigned long long range_sum;
+static long range_num = RANGE_NUM;
+static int busy_stop;
+
+static void range_func(size_t begin, size_t end, void *ctx)
+{
+	unsigned long long sum = 0;
+
+	for (size_t i = begin; i < end; i++)
+		sum += i;
+
+	__atomic_add_fetch(&range_sum, sum, __ATOMIC_RELAXED);
+}
+
+static void busy_func(void *priv)
+{
+	while (!__atomic_load_n(&busy_stop, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void *parallel_for_func(void *arg)
+{
+	long ret = wayca_sc_parallel_for(pool, 0, range_num, 0, range_func, NULL);
+
+	return (void *)ret;
+}
+
+/* The range is summed up while the working threads are all kept busy */
+static int run_busy(void)
+{
+	unsigned long long sum = (unsigned long long)range_num * (range_num - 1) / 2;
+	pthread_t thread;
+	void *ret;
+
+	range_sum = 0;
+	for (int i = 0; i < BUSY_THREADS; i++)
+		if (wayca_sc_threadpool_queue(pool, busy_func, NULL))
+			return 0;
+	while (wayca_sc_threadpool_running_num(pool) < BUSY_THREADS)
+		sched_yield();
+
+	if (pthread_create(&thread, NULL, parallel_for_func, NULL)) {
+		__atomic_store_n(&busy_stop, 1, __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	while (__atomic_load_n(&range_sum, __ATOMIC_RELAXED) != sum)
+		sched_yield();
+
+	__atomic_store_n(&busy_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(thread, &ret);
+
+	return !ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret, passed;
+
+	if (argc > 1)
+		range_num = atol(argv[1]);
+	if (range_num <= 0)
+		return 1;
+
+	ret = wayca_sc_threadpool_create(&pool, NULL, BUSY_THREADS);
+	if (ret <= 0)
+		return 1;
+
+	ret = wayca_sc_parallel_for(pool, 0, range_num, 0, range_func, NULL);
+	passed = !ret && range_sum == (unsigned long long)range_num * (range_num - 1) / 2;
+	printf("Parallel for [0, %ld) %s\n", range_num, passed ? "passed" : "failed");
+
+	ret = run_busy();
+	printf("Parallel for with the threads busy %s\n", ret ? "passed" : "failed");
+	passed = passed && ret;
+
+	wayca_sc_threadpool_destroy(pool);
+	return !passed;
+}
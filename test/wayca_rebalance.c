@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2021 HiSilicon Technologies Co., Ltd.
+ * Wayca scheduler is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+/*
+ * The test program for the rebalancing of the groups of Wayca scheduler.
+ *
+ * The groups are rebalanced and rearranged on a synthetic topology of 8
+ * CPUs in 2 CCLs,
+ * with the run queue wait of the CPUs made up, so it doesn't depend on
+ * the machine it runs on. The threads have no task behind them, they're
+ * neither sampled nor really bound.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "../lib/wayca_thread.h"
+
+#define NR_CPUS		8
+#define NR_CCLS		2
+#define NR_THREADS	5
+
+/* The made up wait of a CPU in a period and of a thread, in ns */
+#define HOT_WAIT	4000000
+#define THREAD_WAIT	8000000
+
+static struct wayca_domain_table saved_domains[WAYCA_DOMAIN_LEVELS];
+static cpu_set_t saved_cpu_set;
+
+static void fake_level(enum wayca_domain_level level, int nr)
+{
+	struct wayca_domain_table *table = &wayca_domains[level];
+	int per = NR_CPUS / nr;
+
+	table->nr = nr;
+	table->domains = calloc(nr, sizeof(*table->domains));
+	table->cpu_domain = calloc(NR_CPUS, sizeof(*table->cpu_domain));
+	table->loads = NULL;
+	if (level <= WAYCA_DOMAIN_NODE)
+		table->loads = calloc(nr, sizeof(*table->loads));
+	assert(table->domains && table->cpu_domain &&
+	       (level > WAYCA_DOMAIN_NODE || table->loads));
+
+	for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+		struct wayca_domain *domain = &table->domains[cpu / per];
+
+		if (cpu % per == 0)
+			domain->first = cpu;
+		CPU_SET(cpu, &domain->cpus);
+		table->cpu_domain[cpu] = cpu / per;
+	}
+}
+
+/* Replace the topology of the machine with the synthetic one */
+static void fake_topology(void)
+{
+	memcpy(saved_domains, wayca_domains, sizeof(saved_domains));
+	memcpy(&saved_cpu_set, &total_cpu_set, sizeof(saved_cpu_set));
+
+	CPU_ZERO(&total_cpu_set);
+	for (int cpu = 0; cpu < NR_CPUS; cpu++)
+		CPU_SET(cpu, &total_cpu_set);
+
+	fake_level(WAYCA_DOMAIN_CPU, NR_CPUS);
+	fake_level(WAYCA_DOMAIN_CCL, NR_CCLS);
+	fake_level(WAYCA_DOMAIN_NODE, 1);
+	fake_level(WAYCA_DOMAIN_PACKAGE, 1);
+	fake_level(WAYCA_DOMAIN_ALL, 1);
+}
+
+static void restore_topology(void)
+{
+	for (int level = 0; level < WAYCA_DOMAIN_LEVELS; level++) {
+		free(wayca_domains[level].domains);
+		free(wayca_domains[level].cpu_domain);
+		free(wayca_domains[level].loads);
+	}
+
+	memcpy(wayca_domains, saved_domains, sizeof(saved_domains));
+	memcpy(&total_cpu_set, &saved_cpu_set, sizeof(total_cpu_set));
+}
+
+/* Make the CPUs look busy with the others, so they're not the idlest */
+static void set_util(int cpu, long long util)
+{
+	atomic_store(&wayca_domains[WAYCA_DOMAIN_CPU].loads[cpu].util, util);
+}
+
+static int ccl_of(struct wayca_thread *thread)
+{
+	return thread->target_pos / (NR_CPUS / NR_CCLS);
+}
+
+/* Place @thread in @group and bind it, as attaching it does */
+static void attach(struct wayca_sc_group *group, struct wayca_thread *thread)
+{
+	thread->pid = -1;
+	assert(!wayca_group_add_thread(group, thread));
+	wayca_group_rearrange_thread(group, thread);
+}
+
+static void detach(struct wayca_sc_group *group, struct wayca_thread *thread)
+{
+	assert(!wayca_group_delete_thread(group, thread));
+	wayca_thread_update_load(thread, false);
+}
+
+/* No two threads of the per-CPU group are on the same CPU */
+static void check_no_double(struct wayca_thread *threads)
+{
+	for (int i = 0; i < NR_THREADS; i++)
+		for (int j = i + 1; j < NR_THREADS; j++)
+			assert(threads[i].target_pos != threads[j].target_pos);
+}
+
+/* Rebalance once per tick from @tick until a thread moves, return the tick */
+static unsigned long rebalance_until_moved(struct wayca_sc_group *group,
+					   const long long *wait,
+					   unsigned long tick, unsigned long end)
+{
+	for (; tick < end; tick++)
+		if (wayca_group_rebalance(group, wait, tick))
+			return tick;
+
+	return end;
+}
+
+static void rebalance_case(void)
+{
+	struct wayca_thread threads[NR_THREADS], *victim = NULL;
+	struct wayca_sc_group group;
+	long long wait[NR_CPUS];
+	unsigned long tick, moved;
+
+	fake_topology();
+
+	memset(&group, 0, sizeof(group));
+	assert(!wayca_group_init(&group));
+
+	/* Per CPU in the CCLs, compact so the first CCL is filled first */
+	group.attribute = WT_GF_CCL | WT_GF_PERCPU | WT_GF_COMPACT;
+	group.level = WAYCA_DOMAIN_CCL;
+	group.nr_cpus_per_topo = NR_CPUS / NR_CCLS;
+	group.stride = 1;
+
+	memset(threads, 0, sizeof(threads));
+	for (int i = 0; i < NR_THREADS; i++)
+		attach(&group, &threads[i]);
+
+	/* CPU 0-3 are taken by the first CCL and CPU 4 by the last thread */
+	for (int i = 0; i < NR_THREADS; i++)
+		printf("thread %d on CPU %zu\n", i, threads[i].target_pos);
+	for (int i = 0; i < NR_THREADS - 1; i++)
+		assert(ccl_of(&threads[i]) == 0);
+	assert(ccl_of(&threads[NR_THREADS - 1]) == 1);
+	check_no_double(threads);
+
+	/* The threads in the first CCL wait, and the CPUs left are busy */
+	for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+		wait[cpu] = cpu < NR_CPUS / NR_CCLS ? HOT_WAIT : 0;
+		set_util(cpu, cpu > threads[NR_THREADS - 1].target_pos ? 100 : 0);
+	}
+	for (int i = 0; i < NR_THREADS - 1; i++)
+		threads[i].wait = THREAD_WAIT;
+
+	/* Nothing moves until the imbalance persists */
+	tick = 8;
+	moved = rebalance_until_moved(&group, wait, tick, tick + 16);
+	printf("moved after %lu periods\n", moved - tick + 1);
+	assert(moved == tick + 2);
+
+	for (int i = 0; i < NR_THREADS; i++)
+		if (threads[i].migrated == moved)
+			victim = &threads[i];
+	assert(victim && ccl_of(victim) == 1);
+	printf("thread %ld moved to CPU %zu\n", victim - threads, victim->target_pos);
+
+	/* The idlest CPU of the cold CCL is taken, pick the free ones */
+	check_no_double(threads);
+
+	/* It waits the other way now, but the thread moved cools down */
+	for (int cpu = 0; cpu < NR_CPUS; cpu++)
+		wait[cpu] = cpu < NR_CPUS / NR_CCLS ? 0 : HOT_WAIT;
+	for (int i = 0; i < NR_THREADS; i++)
+		threads[i].wait = &threads[i] == victim ? THREAD_WAIT : 0;
+
+	tick = rebalance_until_moved(&group, wait, moved + 1, moved + 64);
+	printf("moved back after %lu periods\n", tick - moved);
+	assert(tick == moved + 8 + 2);
+	assert(victim->migrated == tick && ccl_of(victim) == 0);
+	check_no_double(threads);
+
+	for (int i = 0; i < NR_THREADS; i++)
+		detach(&group, &threads[i]);
+
+	restore_topology();
+	printf("rebalance tests passed!\n");
+}
+
+/* Only one rebalancer runs at a time, and it's stopped once */
+static void start_stop_case(void)
+{
+	assert(!wayca_sc_group_rebalance_start(1));
+	assert(wayca_sc_group_rebalance_start(1) == -EBUSY);
+	assert(!wayca_sc_group_rebalance_stop());
+	assert(wayca_sc_group_rebalance_stop() == -EINVAL);
+	assert(wayca_sc_group_rebalance_start(0) == -EINVAL);
+
+	printf("start and stop tests passed!\n");
+}
+
+/* The threads on the places the group takes again stay where they are */
+static void rearrange_case(void)
+{
+	struct wayca_thread threads[NR_THREADS];
+	size_t pos[NR_THREADS];
+	struct wayca_sc_group group;
+	int last = NR_THREADS - 1;
+
+	fake_topology();
+
+	/* Per CPU and compact by default */
+	memset(&group, 0, sizeof(group));
+	assert(!wayca_group_init(&group));
+
+	/* The last thread is kept off the CPUs next to the others */
+	for (int cpu = last; cpu < NR_CPUS - 1; cpu++)
+		set_util(cpu, 100);
+
+	memset(threads, 0, sizeof(threads));
+	for (int i = 0; i < NR_THREADS; i++) {
+		attach(&group, &threads[i]);
+		pos[i] = threads[i].target_pos;
+		printf("thread %d on CPU %zu\n", i, pos[i]);
+	}
+	assert(pos[last] == NR_CPUS - 1);
+
+	/* The places are CPU 0 to NR_THREADS - 1 when placed again */
+	for (int cpu = 0; cpu < NR_CPUS; cpu++)
+		set_util(cpu, 0);
+	assert(!wayca_group_rearrange_group(&group));
+
+	for (int i = 0; i < NR_THREADS; i++)
+		printf("thread %d on CPU %zu\n", i, threads[i].target_pos);
+	for (int i = 0; i < last; i++)
+		assert(threads[i].target_pos == pos[i]);
+	assert(threads[last].target_pos == last);
+
+	for (int i = 0; i < NR_THREADS; i++)
+		detach(&group, &threads[i]);
+
+	restore_topology();
+	printf("rearrange tests passed!\n");
+}
+
+int main(void)
+{
+	/* The cost loaded is measured on the CPUs of the machine, not ours */
+	wayca_migration_exit();
+
+	start_stop_case();
+	rebalance_case();
+	rearrange_case();
+
+	return 0;
+}
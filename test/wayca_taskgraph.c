@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2021 HiSilicon Technologies Co., Ltd.
+ * Wayca scheduler is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+/*
+ * The test program for the taskgraph of the threadpool of Wayca scheduler.
+ *
+ * Usage: wayca_sc_test_taskgraph [tasks]
+ *
+ * Run a graph where task i depends on task i / 2, twice to check the graph
+ * can be reused.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <wayca-scheduler.h>
+
+#define GRAPH_NUM	1000
+
+static char *graph_done;
+static long graph_bad;
+
+/* Task i of the graph depends on task i / 2, check it has finished */
+static void graph_func(void *priv)
+{
+	long i = (long)priv;
+
+	if (i && !__atomic_load_n(&graph_done[i / 2], __ATOMIC_ACQUIRE))
+		__atomic_add_fetch(&graph_bad, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&graph_done[i], 1, __ATOMIC_RELEASE);
+}
+
+static int run_taskgraph(wayca_sc_threadpool_t pool, int graph_num)
+{
+	wayca_sc_taskgraph_t taskgraph;
+	int ret;
+
+	graph_done = calloc(graph_num, 1);
+	if (!graph_done)
+		return -ENOMEM;
+
+	ret = wayca_sc_taskgraph_create(&taskgraph, pool);
+	if (ret)
+		goto out;
+
+	for (long i = 0; i < graph_num && !ret; i++) {
+		ret = wayca_sc_taskgraph_add_task(taskgraph, graph_func, (void *)i);
+		if (ret >= 0 && i)
+			ret = wayca_sc_taskgraph_add_edge(taskgraph, i / 2, i);
+		else if (ret >= 0)
+			ret = 0;
+	}
+
+	for (int round = 0; round < 2 && !ret; round++) {
+		for (int i = 0; i < graph_num; i++)
+			graph_done[i] = 0;
+
+		ret = wayca_sc_taskgraph_run(taskgraph);
+		if (!ret)
+			ret = wayca_sc_taskgraph_wait(taskgraph);
+		for (int i = 0; i < graph_num && !ret; i++)
+			if (!graph_done[i])
+				graph_bad++;
+	}
+
+	wayca_sc_taskgraph_destroy(taskgraph);
+out:
+	free(graph_done);
+	return ret ? ret : graph_bad ? -EINVAL : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int graph_num = argc > 1 ? atoi(argv[1]) : GRAPH_NUM;
+	wayca_sc_threadpool_t pool;
+	int ret;
+
+	if (graph_num <= 0)
+		return 1;
+
+	ret = wayca_sc_threadpool_create(&pool, NULL, sysconf(_SC_NPROCESSORS_CONF));
+	if (ret <= 0)
+		return 1;
+
+	ret = run_taskgraph(pool, graph_num);
+	printf("Taskgraph of %d tasks %s\n", graph_num, !ret ? "passed" : "failed");
+
+	wayca_sc_threadpool_destroy(pool);
+	return !!ret;
+}
@@ -4,8 +4,11 @@
 #include <sched.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <pthread.h>
+#include <poll.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
 
 #include <wayca-scheduler.h>
@@ -13,6 +16,13 @@
 wayca_sc_threadpool_t wayca_threadpool;
 static pthread_mutex_t time_mutex = PTHREAD_MUTEX_INITIALIZER;
 long total_queue_time = 0;
+int nested_num = 0;
+int batch = 0;
+int use_taskgroup = 0;
+int use_eventfd = 0;
+int use_prio = 0;
+int local_node = -1;
+long nested_finished = 0;
 
 struct threadinfo {
 	int index;
@@ -21,6 +31,13 @@ struct threadinfo {
 
 struct threadinfo *info;
 
+void nested_task_func(void *priv)
+{
+	pthread_mutex_lock(&time_mutex);
+	nested_finished++;
+	pthread_mutex_unlock(&time_mutex);
+}
+
 void task_func(void *priv)
 {
 	struct threadinfo *this_info = priv;
@@ -34,18 +51,89 @@ void task_func(void *priv)
 	pthread_mutex_unlock(&time_mutex);
 
 	printf("Task %d finished in %.12f sec\n", this_info->index, (float)time / 1000);
+
+	/* Fork the nested tasks and join them before returning */
+	if (use_taskgroup && nested_num) {
+		wayca_sc_taskgroup_t taskgroup;
+
+		if (wayca_sc_taskgroup_create(&taskgroup, wayca_threadpool))
+			return;
+		for (int i = 0; i < nested_num; i++)
+			wayca_sc_taskgroup_queue(taskgroup, nested_task_func, NULL);
+		wayca_sc_threadpool_wait(taskgroup);
+		wayca_sc_taskgroup_destroy(taskgroup);
+		return;
+	}
+
+	/* Tasks queued from the working thread go to its own deque */
+	if (batch && nested_num) {
+		wayca_sc_threadpool_task_func funcs[nested_num];
+
+		for (int i = 0; i < nested_num; i++)
+			funcs[i] = nested_task_func;
+		wayca_sc_threadpool_queue_batch(wayca_threadpool, funcs, NULL, nested_num);
+		return;
+	}
+
+	for (int i = 0; i < nested_num; i++)
+		wayca_sc_threadpool_queue(wayca_threadpool, nested_task_func, NULL);
+}
+
+static int queue_tasks_batch(int task_num)
+{
+	wayca_sc_threadpool_task_func *funcs;
+	void **args;
+	int ret;
+
+	funcs = malloc(task_num * sizeof(*funcs));
+	args = malloc(task_num * sizeof(*args));
+	if (!funcs || !args) {
+		free(funcs);
+		free(args);
+		return -ENOMEM;
+	}
+
+	printf("Queue Task 0-%d in batch\n", task_num - 1);
+	for (int i = 0; i < task_num; i++) {
+		info[i].index = i;
+		gettimeofday(&info[i].begin, NULL);
+		funcs[i] = task_func;
+		args[i] = &info[i];
+	}
+
+	ret = wayca_sc_threadpool_queue_batch(wayca_threadpool, funcs, args, task_num);
+	free(funcs);
+	free(args);
+	return ret;
 }
 
 int main(int argc, char *argv[])
 {
-	int thread_num = 0, task_num = 0, ret, c;
+	int thread_num = 0, task_num = 0, min_thread_num = 0, numa = 0, failed = 0, ret, c;
+	wayca_sc_threadpool_attr_t pool_attr = 0;
+	struct wayca_sc_threadpool_steals steals;
+	struct wayca_sc_threadpool_stats stats;
+	wayca_sc_taskgroup_t taskgroup;
+	eventfd_t completed = 0;
+	int event_fd = -1;
 	static struct option options[] = {
 		{ "thread", required_argument, NULL, 't' },
 		{ "tasks", required_argument, NULL, 'T' },
+		{ "nested", required_argument, NULL, 'n' },
+		{ "steal-topo", no_argument, NULL, 's' },
+		{ "spin", no_argument, NULL, 'S' },
+		{ "batch", no_argument, NULL, 'b' },
+		{ "taskgroup", no_argument, NULL, 'g' },
+		{ "prio", no_argument, NULL, 'P' },
+		{ "node", required_argument, NULL, 'N' },
+		{ "elastic", required_argument, NULL, 'e' },
+		{ "bounded", no_argument, NULL, 'B' },
+		{ "numa", no_argument, NULL, 'M' },
+		{ "eventfd", no_argument, NULL, 'E' },
 		{ 0, 0, 0, 0 },
 	};
 
-	while ((c = getopt_long(argc, argv, "t:T:", options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "t:T:n:sSbgPN:e:BME", options, NULL)) != -1) {
 		switch (c) {
 		case 't':
 			thread_num = atoi(optarg);
@@ -53,6 +141,39 @@ int main(int argc, char *argv[])
 		case 'T':
 			task_num = atoi(optarg);
 			break;
+		case 'n':
+			nested_num = atoi(optarg);
+			break;
+		case 's':
+			pool_attr |= WT_PF_STEAL_TOPO;
+			break;
+		case 'S':
+			pool_attr |= WT_PF_IDLE_SPIN;
+			break;
+		case 'b':
+			batch = 1;
+			break;
+		case 'g':
+			use_taskgroup = 1;
+			break;
+		case 'P':
+			use_prio = 1;
+			break;
+		case 'N':
+			local_node = atoi(optarg);
+			break;
+		case 'e':
+			min_thread_num = atoi(optarg);
+			break;
+		case 'B':
+			pool_attr |= WT_PF_BOUNDED;
+			break;
+		case 'M':
+			numa = 1;
+			break;
+		case 'E':
+			use_eventfd = 1;
+			break;
 		}
 	}
 
@@ -67,25 +188,123 @@ int main(int argc, char *argv[])
 	if (!info)
 		return -ENOMEM;
 
-	ret = wayca_sc_threadpool_create(&wayca_threadpool, NULL, thread_num);
+	/* The thread number is per NUMA node then */
+	if (numa)
+		ret = wayca_sc_threadpool_create_numa(&wayca_threadpool, NULL, thread_num);
+	else if (min_thread_num)
+		ret = wayca_sc_threadpool_create_elastic(&wayca_threadpool, NULL,
+							 min_thread_num, thread_num);
+	else
+		ret = wayca_sc_threadpool_create(&wayca_threadpool, NULL, thread_num);
 	if (ret <= 0)
 		return ret;
 
-	for (int i = 0; i < task_num; i++) {
+	ret = wayca_sc_threadpool_set_attr(wayca_threadpool, &pool_attr);
+	if (ret)
+		return ret;
+
+	if (use_taskgroup) {
+		ret = wayca_sc_taskgroup_create(&taskgroup, wayca_threadpool);
+		if (ret)
+			return ret;
+	}
+
+	/* Collect the completions like an event loop, -g implied */
+	if (use_eventfd) {
+		if (!use_taskgroup)
+			ret = wayca_sc_taskgroup_create(&taskgroup, wayca_threadpool);
+		if (ret)
+			return ret;
+		use_taskgroup = 1;
+
+		event_fd = wayca_sc_taskgroup_eventfd(taskgroup);
+		if (event_fd < 0)
+			return event_fd;
+	}
+
+	if (batch)
+		ret = queue_tasks_batch(task_num);
+
+	for (int i = 0; !batch && i < task_num; i++) {
 		printf("Queue Task %d\n", i);
 		info[i].index = i;
 		gettimeofday(&info[i].begin, NULL);
-		ret = wayca_sc_threadpool_queue(wayca_threadpool, task_func, &info[i]);
+		if (use_taskgroup)
+			ret = wayca_sc_taskgroup_queue(taskgroup, task_func, &info[i]);
+		else if (local_node >= 0)
+			ret = wayca_sc_threadpool_queue_on(wayca_threadpool, WT_GF_NUMA,
+							   local_node, task_func, &info[i]);
+		else if (use_prio)
+			ret = wayca_sc_threadpool_queue_prio(wayca_threadpool,
+							     i % WAYCA_SC_THREADPOOL_PRIO_LEVELS,
+							     task_func, &info[i]);
+		else
+			ret = wayca_sc_threadpool_queue(wayca_threadpool, task_func, &info[i]);
+
+		/* The bounded queue is full, retry after the workers drain it */
+		if (ret == -EAGAIN) {
+			sched_yield();
+			i--;
+			continue;
+		}
 		if (ret)
 			break;
 	}
+	if (ret) {
+		printf("Queue Task: %s failed\n", strerror(-ret));
+		failed++;
+	}
+
+	while (use_eventfd && completed < task_num) {
+		struct pollfd pfd = { .fd = event_fd, .events = POLLIN };
+		eventfd_t cnt;
+
+		if (poll(&pfd, 1, -1) == 1 && !eventfd_read(event_fd, &cnt))
+			completed += cnt;
+	}
+	if (use_eventfd) {
+		printf("Eventfd: %llu/%d completions %s\n", (unsigned long long)completed,
+		       task_num, completed == task_num ? "passed" : "failed");
+		failed += completed != task_num;
+	}
 
-	/* Wait for all the tasks finished */
-	while (wayca_sc_threadpool_running_num(wayca_threadpool))
+	/* Wait for all the tasks finished, helping to run them if we can */
+	if (use_taskgroup) {
+		wayca_sc_threadpool_wait(taskgroup);
+		wayca_sc_taskgroup_destroy(taskgroup);
+	}
+
+	while (wayca_sc_threadpool_running_num(wayca_threadpool) ||
+	       wayca_sc_threadpool_task_num(wayca_threadpool))
 		sched_yield();
 
+	if (min_thread_num)
+		printf("Elastic threads: %zd of %d-%d\n",
+		       wayca_sc_threadpool_thread_num(wayca_threadpool),
+		       min_thread_num, thread_num);
+
+	if (!wayca_sc_threadpool_get_steals(wayca_threadpool, &steals))
+		printf("Steals: ccl %llu node %llu package %llu remote %llu\n",
+		       steals.ccl, steals.node, steals.package, steals.remote);
+
+	if (!wayca_sc_threadpool_get_stats(wayca_threadpool, &stats)) {
+		printf("Stats: executed %llu steals %llu parks %llu\n",
+		       stats.executed, stats.steals, stats.parks);
+		printf("Wait ns: avg %llu p50 %llu p99 %llu p999 %llu\n",
+		       stats.wait_avg, stats.wait_p50, stats.wait_p99, stats.wait_p999);
+		printf("Run ns: avg %llu p50 %llu p99 %llu p999 %llu\n",
+		       stats.run_avg, stats.run_p50, stats.run_p99, stats.run_p999);
+	}
+
 	wayca_sc_threadpool_destroy(wayca_threadpool);
 
 	printf("Average queue time is %.12f\n", (float)total_queue_time / task_num / 1000);
-	return 0;
+	if (nested_num) {
+		printf("Nested tasks finished %ld/%ld %s\n", nested_finished,
+		       (long)task_num * nested_num,
+		       nested_finished == (long)task_num * nested_num ? "passed" : "failed");
+		failed += nested_finished != (long)task_num * nested_num;
+	}
+
+	return !!failed;
 }
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2021 HiSilicon Technologies Co., Ltd.
+ * Wayca scheduler is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+/*
+ * The test program for the timers of the threadpool of Wayca scheduler.
+ *
+ * Usage: wayca_sc_test_timer [period in ms]
+ *
+ * Queue TIMER_NUM tasks due in i * i ms, crossing the levels of the
+ * timing wheel, and a periodic one until the last of them is due.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <wayca-scheduler.h>
+
+#define TIMER_NUM	32
+#define TIMER_PERIOD	10
+
+static pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static long timer_fired, timer_early, periodic_fired;
+
+static long long now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* @priv points to the time the task is due */
+static void timer_func(void *priv)
+{
+	long long due = *(long long *)priv;
+
+	pthread_mutex_lock(&timer_mutex);
+	timer_fired++;
+	if (now_ns() < due)
+		timer_early++;
+	pthread_mutex_unlock(&timer_mutex);
+}
+
+static void periodic_func(void *priv)
+{
+	pthread_mutex_lock(&timer_mutex);
+	periodic_fired++;
+	pthread_mutex_unlock(&timer_mutex);
+}
+
+int main(int argc, char *argv[])
+{
+	long long due[TIMER_NUM], last = (TIMER_NUM - 1) * (TIMER_NUM - 1) * 1000000LL;
+	int period = argc > 1 ? atoi(argv[1]) : TIMER_PERIOD;
+	wayca_sc_threadpool_t pool;
+	wayca_sc_timer_t timer;
+	int ret, passed;
+
+	if (period <= 0)
+		return 1;
+
+	ret = wayca_sc_threadpool_create(&pool, NULL, sysconf(_SC_NPROCESSORS_CONF));
+	if (ret <= 0)
+		return 1;
+
+	ret = wayca_sc_threadpool_queue_periodic(pool, 0, period * 1000000ULL,
+						 periodic_func, NULL, &timer);
+
+	for (int i = 0; !ret && i < TIMER_NUM; i++) {
+		due[i] = now_ns() + i * i * 1000000LL;
+		ret = wayca_sc_threadpool_queue_after(pool, i * i * 1000000ULL,
+						      timer_func, &due[i]);
+	}
+
+	/* Leave some time for the last one to be queued and run */
+	if (!ret) {
+		usleep(last / 1000 + 100000);
+		ret = wayca_sc_threadpool_cancel_timer(pool, timer);
+	}
+
+	pthread_mutex_lock(&timer_mutex);
+	passed = !ret && timer_fired == TIMER_NUM && !timer_early;
+	printf("Timers: %ld/%d fired, %ld early, periodic fired %ld in %lld periods %s\n",
+	       timer_fired, TIMER_NUM, timer_early, periodic_fired,
+	       last / 1000000 / period, passed ? "passed" : "failed");
+	pthread_mutex_unlock(&timer_mutex);
+
+	wayca_sc_threadpool_destroy(pool);
+	return !passed;
+}
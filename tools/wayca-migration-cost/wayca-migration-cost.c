@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2022 HiSilicon Technologies Co., Ltd.
+ *
+ * wayca-migration-cost measures the cost of moving a thread between the
+ * CPUs, which is mostly the time to warm up the caches again, and saves
+ * the cost matrix for libwaycascheduler to load when it starts.
+ *
+ * Wayca scheduler is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <wayca-scheduler.h>
+
+#define WAYCA_MIGRATION_COST	"wayca-migration-cost"
+
+static char *version = WAYCA_SCHEDULER_VERSION;
+static char *output;
+static unsigned int flags;
+
+static void show_version(void)
+{
+	printf("%s version %s\n", WAYCA_MIGRATION_COST, version);
+}
+
+static void usage(void)
+{
+	show_version();
+	printf("Usage: %s [options]\n"
+	       "Options:\n"
+	       "-o, --output <file>		the file to save the cost matrix, default to be\n"
+	       "				$WAYCA_SC_MIGRATION_COST_FILE or\n"
+	       "				/var/cache/wayca-scheduler/migration_cost\n"
+	       "-a, --all			measure each pair of the CPUs, rather than one pair\n"
+	       "				of each topology level\n"
+	       "-v, --version			show the version of this tool\n"
+	       "-h, --help			show this informaton\n",
+	       WAYCA_MIGRATION_COST);
+}
+
+static int parse_command(int argc, char *argv[])
+{
+	static struct option options[] = {
+		{ "output",	required_argument,	NULL, 'o' },
+		{ "all",	no_argument,		NULL, 'a' },
+		{ "version",	no_argument,		NULL, 'v' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ 0,		0,			0,     0  }
+	};
+	int c;
+
+	while ((c = getopt_long(argc, argv, "o:avh", options, NULL)) != EOF) {
+		switch (c) {
+		case 'o':
+			output = optarg;
+			break;
+		case 'a':
+			flags |= WT_MC_ALL_PAIRS;
+			break;
+		case 'v':
+			show_version();
+			exit(0);
+		case 'h':
+			usage();
+			exit(0);
+		default:
+			usage();
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	ret = parse_command(argc, argv);
+	if (ret)
+		return ret;
+
+	ret = wayca_sc_migration_cost_calibrate(output, flags);
+	if (ret) {
+		fprintf(stderr, "failed to measure the migration cost: %s\n",
+			strerror(-ret));
+		return ret;
+	}
+
+	printf("Migration cost of %d CPUs is saved\n", wayca_sc_cpus_in_total());
+
+	return 0;
+}